@@ -4,7 +4,9 @@
 #include <modules/button.h>
 #include <modules/joystick.h>
 #include <modules/led_indicator.h>
+#include <modules/battery.h>
 #include <utils/sleep_controller.h>
+#include <utils/active_idle.h>
 #include <utils/click_detector.h>
 #include <layer/keyboard_layer.h>
 #include <layer/mouse_layer.h>
@@ -21,8 +23,14 @@ using yAxis = module::axis<gpio::JOYSTICK_Y, true>;
 using joystick = module::joystick<xAxis, yAxis, gpio::JOYSTICK_BUTTON>;
 //using joystick = module::joystick<gpio::JOYSTICK_X, gpio::JOYSTICK_Y, gpio::JOYSTICK_BUTTON>;
 using led_indicator = module::led_indicator<LED_RED, LED_GREEN, LED_BLUE>;
+using battery = module::battery<gpio::BATTERY, gpio::BATTERY_ENABLE>;
 
 using keyboard_layer = layer::keyboard_layer<button1, button2, button3, button4, middle_button1, joystick>;
 using mouse_layer = layer::mouse_layer<button1, button2, button3, button4, middle_button1, joystick>;
 using sleep_controller = utils::sleep_controller<button1, button2, button3, button4, middle_button1, joystick>;
-using click_detector = utils::click_detector<joystick::pushButton>;
\ No newline at end of file
+using active_idle = utils::active_idle<button1, button2, button3, button4, middle_button1>;
+using click_detector = utils::click_detector<joystick::pushButton>;
+
+// PPI/GPIOTE/TIMER/RTC/PWMのチャネルがモジュール間/SoftDeviceと重ならないことをビルド時に確かめる
+using hw_allocation = utils::hw_allocation<utils::hw_system_resources, led_indicator::resources, sleep_controller::resources, active_idle::resources>;
+static_assert(hw_allocation::value, "hardware resource conflict");
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <ble/ble_battery.h>
+#include <utils/debug.h>
+
+using namespace ble;
+
+volatile bool ble_battery::_isRadioActive = false;
+
+
+void ble_battery::init()
+{
+    _bas.begin();
+
+    // 無線の動作開始(800us前)と終了で割り込む
+    auto err = sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_BOTH, NRF_RADIO_NOTIFICATION_DISTANCE_800US);
+    if (err != NRF_SUCCESS) {
+        DEBUG_PRINTF("radio notification failed 0x%x", err);
+        return ;
+    }
+    sd_nvic_ClearPendingIRQ(SWI1_EGU1_IRQn);
+    sd_nvic_SetPriority(SWI1_EGU1_IRQn, 6);
+    sd_nvic_EnableIRQ(SWI1_EGU1_IRQn);
+}
+
+
+/**
+ * @brief 残量を設定し、変わっていれば接続中のホストに通知する
+ * @param [in] percent 残量(%)
+ */
+void ble_battery::update(const uint8_t percent)
+{
+    if (!_hasValue) {
+        _hasValue = true;
+        _percent = percent;
+        _bas.write(percent);
+        return ;
+    }
+    if (percent == _percent) {
+        return ;
+    }
+    _percent = percent;
+    _bas.write(percent);
+    _bas.notify(percent);
+}
+
+
+extern "C" {
+    /**
+     * @brief Radio Notificationの割り込みハンドラ(動作開始と終了が交互に来る)
+     */
+    void SWI1_EGU1_IRQHandler(void)
+    {
+        ble_battery::_isRadioActive = !ble_battery::_isRadioActive;
+    }
+}
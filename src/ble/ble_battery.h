@@ -0,0 +1,36 @@
+#pragma once
+
+#include <bluefruit.h>
+
+namespace ble
+{
+    /**
+     * @brief 標準のBattery Service(0x180F)で残量を公開するクラス
+     * @details 残量が変わったときだけ通知する。
+     *          SoftDeviceのRadio Notificationで無線の動作中かを追い、電圧は無線が止まっている間に測れるようにする
+     *          (動作開始の通知は無線が動く800us前に来るので、止まっていると判定してから800us以内の処理は無線と重ならない)。
+     */
+    class ble_battery
+    {
+    public:
+        ble_battery() = delete;
+
+        static void init();
+        static void update(const uint8_t percent);
+
+        /**
+         * @brief 無線が止まっているか(次の動作まで800us以上ある)
+         */
+        static bool isRadioIdle()
+        {
+            return !_isRadioActive;
+        }
+
+        static volatile bool _isRadioActive;
+
+    private:
+        static inline BLEBas _bas;
+        static inline bool _hasValue = false;
+        static inline uint8_t _percent = 0;
+    };
+}
@@ -36,7 +36,7 @@ namespace ble
         Bluefruit.configPrphConn(128, 6, 6, BLE_GATTC_WRITE_CMD_TX_QUEUE_SIZE_DEFAULT);
 
         // 初期化処理
-        Bluefruit.begin(2); //
+        Bluefruit.begin(3); // ble_link::LINK_COUNT(HIDホスト2台 + 設定アプリ)
         Bluefruit.setName("ChordiMouse");
 
         Bluefruit.autoConnLed(false);
@@ -1,12 +1,15 @@
 #include <ble/ble_config.h>
-#include <utils/timeout.h>
 #include <utils/debug.h>
 
 using namespace ble;
 
-void ble_config::init()
+/**
+ * @brief 設定サービスを登録する
+ * @return すべてのCharacteristicを登録できたか(属性テーブルが足りないとNRF_ERROR_NO_MEMで登録されない)
+ */
+bool ble_config::init()
 {
-    configService.begin();
+    auto isSuccess = (configService.begin() == ERROR_NONE);
 
     // グローバル設定Characteristic
     {
@@ -29,7 +32,7 @@ void ble_config::init()
                 updateConfigCallback(cfg);
             } 
         });
-        globalConfigChar.begin();
+        isSuccess &= beginCharacteristic(globalConfigChar, "global");
     }
 
     // キープロファイル設定Characteristic
@@ -50,36 +53,58 @@ void ble_config::init()
                 updateKeyprofCallback(profs);
             }
         });
-        keyProfileConfigChar.begin();
+        isSuccess &= beginCharacteristic(keyProfileConfigChar, "keyprof");
     }
-}
 
+    // 計測値Characteristic
+    // 種類ごとにCharacteristicを分けると属性テーブル(デフォルト0xC00バイト)に収まらないため、
+    // 1バイト書き込んで種類を選び、[種類, JSON]を読み出す。値はconfig/statsタスクで更新する
+    {
+        statsChar.setProperties(CHR_PROPS_READ | CHR_PROPS_WRITE);
+        statsChar.setPermission(SECMODE_OPEN, SECMODE_OPEN);
+        statsChar.setMaxLen(STATS_MAX_SIZE);
+        statsChar.setWriteCallback([](uint16_t conn_handle, BLECharacteristic *chr, uint8_t *data, uint16_t len) {
+            if (len < 1) {
+                return ;
+            }
+            auto stats = (Stats)(data[0] & ~STATS_RESET_FLAG);
+            if (stats >= STATS_COUNT) {
+                return ;
+            }
+            if ((data[0] & STATS_RESET_FLAG) && stats == STATS_LATENCY && resetLatencyCallback) {
+                resetLatencyCallback();
+            }
+            selectedStats = stats;
+            isStatsRequested = true;
+        });
+        isSuccess &= beginCharacteristic(statsChar, "stats");
+    }
 
-bool ble_config::connect(const config& cfg, const key_profiles& profs, const uint32_t timeoutMs)
-{
-    if (isConnected()) {
-        return true;
+    // トレースCharacteristic(通知で送る)
+    {
+        traceChar.setProperties(CHR_PROPS_READ | CHR_PROPS_NOTIFY);
+        traceChar.setPermission(SECMODE_OPEN, SECMODE_NO_ACCESS);
+        traceChar.setMaxLen(TRACE_MAX_SIZE);
+        isSuccess &= beginCharacteristic(traceChar, "trace");
     }
 
-    connectionHandle = BLE_CONN_HANDLE_INVALID;
+    return isSuccess;
+}
 
-    auto currentAddr = Bluefruit.getAddr();
-    auto generatedAddress = generateAddress(3);
-    if (memcmp(&currentAddr, &generatedAddress, sizeof(ble_gap_addr_t)) != 0) {
-        auto r = Bluefruit.setAddr(&generatedAddress);
-        DEBUG_PRINTF("%s", r ? "OK": "NG");
+
+bool ble_config::beginCharacteristic(BLECharacteristic& chr, const char* name)
+{
+    auto err = chr.begin();
+    if (err != ERROR_NONE) {
+        DEBUG_PRINTF("begin %s characteristic failed 0x%x", name, err);
+        return false;
     }
+    return true;
+}
 
-    Bluefruit.Periph.setConnectCallback([](uint16_t c){
-        connectionHandle = c;
-    });
-    Bluefruit.Periph.setDisconnectCallback([](uint16_t c, uint8_t r) {
-        connectionHandle = BLE_CONN_HANDLE_INVALID;
-        if(disconnectCallback) {
-            disconnectCallback();
-        }
-    });
 
+void ble_config::begin(const config& cfg, const key_profiles& profs)
+{
     // バッファ更新
     {
         uint8_t buff[config::MAX_BUFFSIZE];
@@ -92,6 +117,35 @@ bool ble_config::connect(const config& cfg, const key_profiles& profs, const uin
         keyProfileConfigChar.write(buff, size);
     }
 
+    // 設定アプリは専用のリンクを使う(HIDの接続は維持したまま設定を変えられる)
+    ble_link::begin(CONFIG_LINK, ble_link::CONFIG, startAdvertising, false);
+}
+
+
+/**
+ * @brief 設定モードを終了(接続中なら切断する)
+ */
+void ble_config::end()
+{
+    ble_link::end(CONFIG_LINK);
+}
+
+
+bool ble_config::isConnected()
+{
+    return ble_link::isConnected(CONFIG_LINK, ble_link::CONFIG);
+}
+
+
+ble_link::Advertising ble_config::startAdvertising(const ble_link::Link link, const uint8_t attempt)
+{
+    auto currentAddr = Bluefruit.getAddr();
+    auto generatedAddress = generateAddress(3);
+    if (memcmp(&currentAddr, &generatedAddress, sizeof(ble_gap_addr_t)) != 0) {
+        auto r = Bluefruit.setAddr(&generatedAddress);
+        DEBUG_PRINTF("%s", r ? "OK": "NG");
+    }
+
     // アドバタイズ設定
     Bluefruit.Advertising.clearData();
     Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE);
@@ -99,47 +153,62 @@ bool ble_config::connect(const config& cfg, const key_profiles& profs, const uin
     Bluefruit.ScanResponse.addTxPower();
     Bluefruit.ScanResponse.addName();
     Bluefruit.ScanResponse.addService(configService);
-    Bluefruit.Advertising.restartOnDisconnect(false);
     Bluefruit.Advertising.setInterval(32, 244); // in unit of 0.625 ms
+    Bluefruit.Advertising.setFastTimeout(ble_link::ADVERTISING_TIMEOUT_S);
 
-    // アドバタイズ開始
-    auto success = Bluefruit.Advertising.start(timeoutMs / 1000); 
-    if (!success) {
-        DEBUG_PRINTF("failed to start advertising!");
-        return false;
+    if (!Bluefruit.Advertising.start(ble_link::ADVERTISING_TIMEOUT_S)) {
+        return ble_link::ADVERTISING_FAILED;
     }
+    return ble_link::ADVERTISING_UNDIRECTED;
+}
 
-    // 接続待機
-    auto connected = waitCondition(isConnected, timeoutMs);
-    Bluefruit.Advertising.stop();
-    return connected;
+
+/**
+ * @brief 設定アプリが選んだ計測値の種類
+ */
+ble_config::Stats ble_config::getSelectedStats()
+{
+    return selectedStats;
 }
 
 
-bool ble_config::isConnected()
+/**
+ * @brief 計測値の種類が選ばれたか(選ばれたらすぐに値を更新する)
+ * @return 前回の呼び出しから新たに選ばれたか
+ */
+bool ble_config::takeStatsRequest()
 {
-    return Bluefruit.connected(connectionHandle);
+    if (!isStatsRequested) {
+        return false;
+    }
+    isStatsRequested = false;
+    return true;
 }
 
 
-void ble_config::disconnect(const uint32_t timeoutMs)
+/**
+ * @brief 計測値を更新する
+ * @param [in] stats 種類(先頭1バイトに入れ、設定アプリは選んだ種類と一致するまで読み直す)
+ * @param [in] json  JSON
+ * @param [in] len   JSONのサイズ
+ */
+void ble_config::updateStats(const Stats stats, const char* json, const uint16_t len)
 {
-    auto connection = Bluefruit.Connection(connectionHandle);
+    uint8_t buff[STATS_MAX_SIZE];
+    auto size = min(len, (uint16_t)(STATS_MAX_SIZE - 1));
+    buff[0] = stats;
+    memcpy(buff + 1, json, size);
+    statsChar.write(buff, size + 1);
+}
 
-    // 未接続なら終了
-    if (!connection || (connection && !connection->connected())) {
-        connectionHandle = BLE_CONN_HANDLE_INVALID;
-        return ;
-    }
 
-    connection->disconnect();
+bool ble_config::isTraceSubscribed()
+{
+    return isConnected() && traceChar.notifyEnabled(ble_link::getConnectionHandle(CONFIG_LINK));
+}
 
-    // 切断待機
-    auto disconnected = waitCondition([](){
-        return !isConnected();
-    }, timeoutMs);
 
-    if (disconnected) {
-        connectionHandle = BLE_CONN_HANDLE_INVALID;
-    }
-}
\ No newline at end of file
+bool ble_config::notifyTrace(const uint8_t* data, const uint16_t len)
+{
+    return traceChar.notify(ble_link::getConnectionHandle(CONFIG_LINK), data, min(len, TRACE_MAX_SIZE));
+}
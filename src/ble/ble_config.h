@@ -4,6 +4,8 @@
 #include <config/config.h>
 #include <config/key_profile.h>
 #include <ble/ble_common.h>
+#include <ble/ble_link.h>
+#include <utils/trace.h>
 
 namespace ble
 {
@@ -15,25 +17,55 @@ namespace ble
     public:
         using UpdateConfigCallback = void(*)(const config& cfg); ///< 設定更新コールバック
         using UpdateKeyprofCallback = void(*)(const key_profiles& keyProfs); ///< キープロファイル更新コールバック
-        using DisconnectCallback = void(*)(); ///< 切断コールバック
+        using ResetStatsCallback = void(*)(); ///< 計測値のリセット要求コールバック
+
+        /**
+         * @brief 計測値の種類(計測値Characteristicに1バイト書き込んで選ぶ)
+         * @note tools/profile/js/chordimouse.js の STATS と合わせること
+         */
+        enum Stats : uint8_t
+        {
+            STATS_SCHEDULER = 0, ///< タスクごとの実行時間
+            STATS_GOVERNOR,      ///< スキャン/レポートの周期の段階
+            STATS_LINK,          ///< BLE接続の状態遷移
+            STATS_CONN_PARAM,    ///< 接続パラメータの要求
+            STATS_RECONNECT,     ///< 再接続/復帰時間とレポートの溜め込み
+            STATS_LINK_QUALITY,  ///< リンク品質
+            STATS_SLEEP_POLICY,  ///< 無操作時間のヒストグラムとスリープの設定値
+            STATS_POWER,         ///< スリープ前に止まっていなかった周辺機能
+            STATS_BATTERY,       ///< バッテリー残量
+            STATS_LATENCY,       ///< 入力からレポートまでの遅延
+            STATS_ENERGY,        ///< 消費電荷の見積もり
+            STATS_BOOT,          ///< 起動の段階ごとの時間
+            STATS_CPU,           ///< CPUの稼働率
+            STATS_COUNT,
+        };
+        static constexpr uint8_t STATS_RESET_FLAG = 0x80; ///< 種類と一緒に書き込むと計測値をリセットする(STATS_LATENCYのみ)
 
         ble_config() = delete;
+        static constexpr uint16_t STATS_MAX_SIZE = 512; ///< 計測値Characteristicのサイズ(先頭1バイトの種類 + JSON)
+        static constexpr uint16_t TRACE_MAX_SIZE = utils::trace::HEADER_SIZE + sizeof(utils::trace::Record) * 7; ///< 1回の通知で送るトレースのサイズ
 
-        static void init();
-        static bool connect(const config& cfg, const key_profiles& profs, const uint32_t timeoutMs=0);
+        static bool init();
+        static void begin(const config& cfg, const key_profiles& profs);
+        static void end();
         static bool isConnected();
-        static void disconnect(const uint32_t timeoutMs=0);
+        static Stats getSelectedStats();
+        static bool takeStatsRequest();
+        static void updateStats(const Stats stats, const char* json, const uint16_t len);
+        static bool isTraceSubscribed();
+        static bool notifyTrace(const uint8_t* data, const uint16_t len);
         static void setUpdateConfigCallback(UpdateConfigCallback callback)
         {
             updateConfigCallback = callback;
         }
-        static void setUpdateKeyProfCallback(UpdateKeyprofCallback callback)
+        static void setResetLatencyCallback(ResetStatsCallback callback)
         {
-            updateKeyprofCallback = callback;
+            resetLatencyCallback = callback;
         }
-        static void setDisconnectCallback(DisconnectCallback callback)
+        static void setUpdateKeyProfCallback(UpdateKeyprofCallback callback)
         {
-            disconnectCallback = callback;
+            updateKeyprofCallback = callback;
         }
 
 
@@ -41,14 +73,25 @@ namespace ble
         static constexpr auto CONFIG_SERVICE_UUID = 0xF00D;
         static constexpr auto CONFIG_CHR_GLOBAL_UUID = 0xFF01;
         static constexpr auto CONFIG_CHR_KEYPROF_UUID = 0xFF02;
+        static constexpr auto CONFIG_CHR_STATS_UUID = 0xFF03;
+        static constexpr auto CONFIG_CHR_TRACE_UUID = 0xFF0C;
+        static constexpr auto CONFIG_LINK = ble_link::LINK_CONFIG;
 
         static inline BLEService configService{CONFIG_SERVICE_UUID};
         static inline BLECharacteristic globalConfigChar{CONFIG_CHR_GLOBAL_UUID};
         static inline BLECharacteristic keyProfileConfigChar{CONFIG_CHR_KEYPROF_UUID};
+        static inline BLECharacteristic statsChar{CONFIG_CHR_STATS_UUID};
+        static inline BLECharacteristic traceChar{CONFIG_CHR_TRACE_UUID};
+
+        static inline volatile Stats selectedStats = STATS_SCHEDULER; ///< 選ばれた計測値(BLEのタスクから書き込まれる)
+        static inline volatile bool isStatsRequested = false;       ///< 計測値が選ばれて、まだ反映していない
+
+        static bool beginCharacteristic(BLECharacteristic& chr, const char* name);
         static inline UpdateConfigCallback updateConfigCallback = nullptr;
         static inline UpdateKeyprofCallback updateKeyprofCallback = nullptr;
-        static inline DisconnectCallback disconnectCallback = nullptr;
-        static inline uint16_t connectionHandle = BLE_CONN_HANDLE_INVALID;
+        static inline ResetStatsCallback resetLatencyCallback = nullptr;
+
+        static ble_link::Advertising startAdvertising(const ble_link::Link link, const uint8_t attempt);
     };
 
 };
\ No newline at end of file
@@ -1,7 +1,13 @@
 #include <ble/ble_hid.h>
+#include <ble/link_monitor.h>
+#include <ble/report_queue.h>
 
-#include <utils/timeout.h>
 #include <utils/debug.h>
+#include <utils/json_writer.h>
+#include <utils/trace.h>
+#include <utils/latency_monitor.h>
+#include <utils/energy_meter.h>
+#include <utils/boot_profiler.h>
 
 using namespace ble;
 
@@ -12,133 +18,509 @@ void ble_hid::init()
 {
     // 
     blehid.begin();
+    ble_link::addEventHandler(onEvent);
 }
 
-bool ble_hid::connect(uint8_t peerId, uint32_t timeoutMs, const ConnectionParam params)
+/**
+ * @brief HIDデバイスとしての接続を開始
+ * @details 全てのホストのリンクでアドバタイズし、接続を維持する(接続処理はble_link::update()で進む)
+ * @param [in] param 接続パラメータ
+ */
+void ble_hid::begin(const ConnectionParam param)
 {
-    // 接続済みなら終了
-    if (isConnected()) {
-        return true;
+    _param = param;
+    for (uint8_t host = 0; host < HOST_COUNT; host++) {
+        ble_link::begin(toLink(host), ble_link::HID, startAdvertising, true);
     }
+}
+
+
+/**
+ * @brief HIDデバイスとしての接続を終了
+ * @note 他の用途で使っているリンクはそのまま
+ */
+void ble_hid::end()
+{
+    for (uint8_t host = 0; host < HOST_COUNT; host++) {
+        if (ble_link::getRole(toLink(host)) == ble_link::HID) {
+            ble_link::end(toLink(host));
+        }
+    }
+}
+
+
+/**
+ * @brief 再接続時の指向性アドバタイズの宛先を設定
+ * @param [in] host ホスト
+ * @param [in] peer 前回接続したセントラルの識別情報。nullptrなら通常のアドバタイズのみ
+ */
+void ble_hid::setDirectedPeer(const uint8_t host, const ble_gap_id_key_t* peer)
+{
+    auto& h = _hosts[host];
+    h.hasDirectedPeer = (peer != nullptr);
+    if (peer) {
+        h.directedPeer = *peer;
+    }
+}
+
+
+/**
+ * @brief レポートの送信先のホストを切り替える
+ * @details 接続は維持したまま送信先だけ変えるため、切り替えは即時。
+ *          切り替え前のホストには押下中のキー/ボタンを離すレポートを送っておく。
+ *          切り替え前のホスト宛てに溜めていたレポートは捨てる。
+ * @param [in] host ホスト
+ */
+void ble_hid::setActiveHost(const uint8_t host)
+{
+    if (host >= HOST_COUNT || host == _activeHost) {
+        return ;
+    }
+
+    auto handle = connectionHandle();
+    if (handle != BLE_CONN_HANDLE_INVALID) {
+        uint8_t scancodes[6] = {0, 0, 0, 0, 0, 0};
+        blehid.keyboardReport(handle, 0, scancodes);
+        blehid.mouseButtonRelease(handle, blehid.getMouseButtons());
+    }
+    _mouseButtons = 0;
+    report_queue::clear();
+    _activeHost = host;
+    DEBUG_PRINTF("active host %d", host);
+}
+
+
+/**
+ * @brief アクティブなホストに接続済みか
+ */
+bool ble_hid::isConnected()
+{
+    return isConnected(_activeHost);
+}
+
+
+bool ble_hid::isConnected(const uint8_t host)
+{
+    return ble_link::isReady(toLink(host), ble_link::HID);
+}
+
+
+/**
+ * @brief レポートを受け付けるか
+ * @details アクティブなホストに接続済みか、再接続中(HIDとしてアドバタイズ/接続処理中)なら受け付ける。
+ *          再接続中のレポートは溜めておき、接続したらreplay()で送る。
+ */
+bool ble_hid::isReportable()
+{
+    return isConnected() || ble_link::getRole(toLink(_activeHost)) == ble_link::HID;
+}
+
+
+/**
+ * @brief 溜めておいたレポートを順に送る
+ * @details 接続中に周期的に呼ぶ。送信キューが埋まったら残りは次回に送る。
+ *          溜めている間は新しいレポートも後ろに溜めて順序を保つ。
+ */
+void ble_hid::replay()
+{
+    auto handle = connectionHandle();
+    if (handle == BLE_CONN_HANDLE_INVALID) {
+        return ;
+    }
+
+    for (uint8_t i = 0; i < REPLAY_MAX_REPORTS; i++) {
+        auto entry = report_queue::front();
+        if (!entry) {
+            break;
+        }
+
+        bool success = false;
+        bool isDone = true;
+        switch (entry->type) {
+            case report_queue::KEYBOARD:
+                success = blehid.keyboardReport(handle, entry->keyboard.modifier, entry->keyboard.scancodes);
+                if (success) {
+                    utils::latency_monitor::markReport(utils::latency_monitor::KEY_CHORD);
+                }
+                break;
+
+            case report_queue::BUTTONS:
+                success = blehid.mouseButtonReport(handle, entry->buttons);
+                if (success) {
+                    utils::latency_monitor::markReport(utils::latency_monitor::MOUSE_BUTTON);
+                }
+                break;
+
+            case report_queue::MOTION:
+            {
+                // 1レポートで送れる分ずつ送る
+                auto& m = entry->motion;
+                int8_t x = constrain(m.x, -127, 127);
+                int8_t y = constrain(m.y, -127, 127);
+                int8_t vertical = constrain(m.vertical, -127, 127);
+                int8_t horizontal = constrain(m.horizontal, -127, 127);
+                success = blehid.mouseReport(handle, x, y, vertical, horizontal);
+                if (success) {
+                    markMotionReport(x, y, vertical, horizontal);
+                    m.x -= x;
+                    m.y -= y;
+                    m.vertical -= vertical;
+                    m.horizontal -= horizontal;
+                    isDone = (m.x == 0 && m.y == 0 && m.vertical == 0 && m.horizontal == 0);
+                }
+                break;
+            }
+
+            case report_queue::ABSOLUTE:
+                success = blehid.absoluteReport(handle, entry->absolute.x, entry->absolute.y);
+                break;
+        }
+
+        if (!success) {
+            // 送信キューが空いてから再開
+            break;
+        }
+        reported(true);
+        report_queue::replayed();
+        if (isDone) {
+            report_queue::pop();
+        }
+    }
+}
+
+
+/**
+ * @brief 復帰/起動した時刻を記録し、次に送ったレポートまでの時間を計測する
+ * @param [in] kind   きっかけ
+ * @param [in] wakeUs 復帰/起動した時刻(micros。起動ならリセットからの時間として0)
+ */
+void ble_hid::markWake(const WakeKind kind, const uint32_t wakeUs)
+{
+    _wakeKind = kind;
+    _wakeUs = wakeUs;
+    _isAwaitingWakeReport = true;
+}
+
+
+/**
+ * @brief 接続中のセントラルの識別情報(IRKと識別アドレス)を取得
+ * @details 接続時のアドレスはRPAで変わることがあるため、ボンディングで受け取った識別アドレスを使う。
+ *          識別情報を配らないセントラル(プライバシーを使わない)は接続時のアドレスがそのまま識別アドレスになる。
+ * @param [in]  host     ホスト
+ * @param [out] identity 識別情報(IRKがなければ0)
+ * @retval true  取得した
+ * @retval false HIDとして接続していないかボンディングしていない
+ */
+bool ble_hid::getPeerIdentity(const uint8_t host, ble_gap_id_key_t& identity)
+{
+    if (!isConnected(host)) {
+        return false;
+    }
+    auto connection = Bluefruit.Connection(ble_link::getConnectionHandle(toLink(host)));
+    if (!connection || !connection->bonded()) {
+        return false;
+    }
+
+    bond_keys_t keys = {};
+    if (!connection->loadBondKey(&keys)) {
+        return false;
+    }
+    static constexpr ble_gap_id_key_t NO_IDENTITY = {};
+    if (memcmp(&keys.peer_id, &NO_IDENTITY, sizeof(ble_gap_id_key_t)) == 0) {
+        identity = {};
+        identity.id_addr_info = connection->getPeerAddr();
+    } else {
+        identity = keys.peer_id;
+    }
+    return true;
+}
+
+
+/**
+ * @brief 経路ごとの再接続時間をJSONにシリアライズ
+ * @details {"d":[回数,直近ms,最大ms],"f":[...],"s":[...],"w":[[回数,直近us,最大us],[...],[...]],"b":{溜めたレポートの計測値}}
+ *          (指向性/短い間隔/長い間隔、wはLightSleep復帰/起動/DeepSleep復帰から最初のレポートまで)
+ * @return 書き込んだサイズ(終端文字を含まない)
+ */
+size_t ble_hid::serializeReconnectStats(char* buffer, const size_t size)
+{
+    const char* keys[PHASE_COUNT] = {"d", "f", "s"};
+    utils::json_writer writer(buffer, size, 2); // "]}"
+    writer.append("{");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        auto& stats = _reconnectStats[i];
+        writer.append("%s\"%s\":[%lu,%lu,%lu]",
+            (i == 0) ? "" : ",",
+            keys[i],
+            (unsigned long)stats.count,
+            (unsigned long)stats.lastMs,
+            (unsigned long)stats.maxMs);
+    }
+    if (writer.append(",\"w\":[")) {
+        for (int i = 0; i < WAKE_KIND_COUNT; i++) {
+            auto& stats = _wakeStats[i];
+            writer.append("%s[%lu,%lu,%lu]",
+                (i == 0) ? "" : ",",
+                (unsigned long)stats.count,
+                (unsigned long)stats.lastUs,
+                (unsigned long)stats.maxUs);
+        }
+        writer.close("]");
+    }
+    char queue[64];
+    if (report_queue::serializeStats(queue, sizeof(queue)) > 0) {
+        writer.append(",\"b\":%s", queue);
+    }
+    writer.close("}");
+    return writer.getLength();
+}
+
+
+/**
+ * @brief アドバタイズを開始する(ble_linkから呼ばれる)
+ * @details 前回の接続先が分かっていれば最初の1回だけ指向性アドバタイズを行い、
+ *          以降は短い間隔→長い間隔の通常のアドバタイズを行う。
+ */
+ble_link::Advertising ble_hid::startAdvertising(const ble_link::Link link, const uint8_t attempt)
+{
+    auto host = static_cast<uint8_t>(link);
+    auto& h = _hosts[host];
+    if (attempt == 0) {
+        h.reconnectStartMs = millis();
+        h.isAwaitingFirstReport = true;
+    }
+
+    setupAdvertising(host);
+
+    if (attempt == 0 && h.hasDirectedPeer) {
+        h.isDirected = ble_link::startDirectedAdvertising(h.directedPeer);
+        if (h.isDirected) {
+            return ble_link::ADVERTISING_DIRECTED;
+        }
+        // 開始できなければ通常のアドバタイズに進む
+    }
+
+    h.isDirected = false;
+    h.undirectedStartMs = millis();
+    if (!Bluefruit.Advertising.start(ble_link::ADVERTISING_TIMEOUT_S)) {
+        return ble_link::ADVERTISING_FAILED;
+    }
+    return ble_link::ADVERTISING_UNDIRECTED;
+}
+
+
+/**
+ * @brief BLEイベント(BLEのタスクから呼ばれる)
+ */
+void ble_hid::onEvent(ble_evt_t* evt)
+{
+    if (evt->header.evt_id != BLE_GAP_EVT_CONNECTED
+        || evt->evt.gap_evt.params.connected.role != BLE_GAP_ROLE_PERIPH) {
+        return ;
+    }
+
+    // 接続したのはアドバタイズしていたリンク
+    auto link = ble_link::getAdvertisingLink();
+    if (link >= HOST_COUNT || ble_link::getRole(link) != ble_link::HID) {
+        return ;
+    }
+
+    auto& h = _hosts[link];
+    if (h.isDirected) {
+        h.connectedPhase = PHASE_DIRECTED;
+    } else {
+        h.connectedPhase = (millis() - h.undirectedStartMs) < FAST_TIMEOUT_S * 1000 ? PHASE_FAST : PHASE_SLOW;
+    }
+}
 
+
+/**
+ * @brief カーソル移動/スクロールのレポートを入力からの遅延として記録
+ */
+void ble_hid::markMotionReport(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal)
+{
+    if (x != 0 || y != 0) {
+        utils::latency_monitor::markReport(utils::latency_monitor::MOTION);
+    }
+    if (vertical != 0 || horizontal != 0) {
+        utils::latency_monitor::markReport(utils::latency_monitor::SCROLL);
+    }
+}
+
+
+/**
+ * @brief レポート送信後の処理
+ * @details 送信結果を接続品質の監視に渡し、スリープ復帰/再接続後の最初のレポートでそれぞれの所要時間を記録する
+ */
+void ble_hid::reported(const bool success)
+{
+    link_monitor::onSent(toLink(_activeHost), success);
+    if (!success) {
+        TRACE(REPORT_FAILED);
+    } else {
+        utils::energy_meter::onReport();
+        utils::boot_profiler::mark(utils::boot_profiler::FIRST_REPORT);
+    }
+
+    // 復帰/起動から最初のレポートを送信キューに積むまで
+    if (success && _isAwaitingWakeReport) {
+        _isAwaitingWakeReport = false;
+        auto elapsedUs = micros() - _wakeUs;
+        auto& stats = _wakeStats[_wakeKind];
+        stats.count++;
+        stats.lastUs = elapsedUs;
+        if (elapsedUs > stats.maxUs) {
+            stats.maxUs = elapsedUs;
+        }
+        DEBUG_PRINTF("first report after wake(%d) %dus", _wakeKind, elapsedUs);
+    }
+
+    auto& h = _hosts[_activeHost];
+    if (!success || !h.isAwaitingFirstReport) {
+        return ;
+    }
+    h.isAwaitingFirstReport = false;
+
+    auto elapsedMs = millis() - h.reconnectStartMs;
+    auto& stats = _reconnectStats[h.connectedPhase];
+    stats.count++;
+    stats.lastMs = elapsedMs;
+    if (elapsedMs > stats.maxMs) {
+        stats.maxMs = elapsedMs;
+    }
+    DEBUG_PRINTF("reconnected host=%d phase=%d %dms", _activeHost, h.connectedPhase, elapsedMs);
+}
+
+
+/**
+ * @brief アドバタイズの準備
+ * @details ホストごとにアドレスを変えて、それぞれ別のデバイスとしてペアリングさせる
+ */
+void ble_hid::setupAdvertising(const uint8_t host)
+{
     // 接続設定
-    Bluefruit.Periph.setConnInterval(params.connectionIntervalMin, params.connectionIntervalMax);
-    Bluefruit.Periph.setConnSlaveLatency(params.slaveLatency);
-    Bluefruit.setTxPower(params.txPower);
+    Bluefruit.Periph.setConnInterval(_param.connectionIntervalMin, _param.connectionIntervalMax);
+    Bluefruit.Periph.setConnSlaveLatency(_param.slaveLatency);
+    Bluefruit.setTxPower(_param.txPower);
 
     // アドレス設定
     auto currentAddr = Bluefruit.getAddr();
-    auto generatedAddress = generateAddress(peerId);
+    auto generatedAddress = generateAddress(host + 1);
     if (memcmp(&currentAddr, &generatedAddress, sizeof(ble_gap_addr_t)) != 0) {
         auto r = Bluefruit.setAddr(&generatedAddress);
         DEBUG_PRINTF("%s", r ? "OK": "NG");
     }
 
     // アドバタイズ設定
-    Bluefruit.Periph.setConnectCallback([] (uint16_t c) {
-        DEBUG_PRINTF("onConnectCallback");
-        connectionHandle = c;
-    });
-    Bluefruit.Periph.setDisconnectCallback(nullptr);
     Bluefruit.Advertising.clearData();
     Bluefruit.Advertising.addFlags(BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE);
     Bluefruit.Advertising.addTxPower();
     Bluefruit.Advertising.addAppearance(BLE_APPEARANCE_HID_MOUSE);
     Bluefruit.Advertising.addAppearance(BLE_APPEARANCE_HID_KEYBOARD);
     Bluefruit.Advertising.addName();
-    Bluefruit.Advertising.restartOnDisconnect(false);
     Bluefruit.Advertising.setInterval(32, 244); // in unit of 0.625 ms
+    Bluefruit.Advertising.setFastTimeout(FAST_TIMEOUT_S);
     Bluefruit.Advertising.addService(blehid);
+}
 
-    // アドバタイズ開始
-    auto success = Bluefruit.Advertising.start(timeoutMs / 1000);
-    if (!success) {
-        DEBUG_PRINTF("start advertising failed!");
-        return false;
-    }
-
-    // 接続待ち
-    auto connected = waitCondition(isConnected, timeoutMs);
-    Bluefruit.Advertising.stop();
 
-#if 1
-    if (isConnected()) {
-        auto connection = Bluefruit.Connection(connectionHandle);
-        auto s = connection->requestPHY(BLE_GAP_PHY_2MBPS);
-        DEBUG_PRINTF("request ble phy %d", s);
-        s = connection->requestMtuExchange(247);
-        DEBUG_PRINTF("request ble mtu %d", s);
+/**
+ * @brief レポートを溜めるか(未接続か、溜めた分を送り切っていない)
+ */
+bool ble_hid::isQueueing()
+{
+    if (ble_link::getRole(toLink(_activeHost)) != ble_link::HID) {
+        return false;
     }
-#endif
-
-    return connected;
+    return !isConnected() || !report_queue::isEmpty();
 }
 
 
-void ble_hid::disconnect(const uint32_t timeoutMs)
+void ble_hid::keyboardReport(const uint8_t modifier, const uint8_t (&scancodes)[6])
 {
-    auto connection = Bluefruit.Connection(connectionHandle);
-
-    // 未接続なら終了
-    if (!connection || (connection && !connection->connected())) {
-        connectionHandle = BLE_CONN_HANDLE_INVALID;
+    TRACE(REPORT_KEYBOARD, modifier, scancodes[0] | (scancodes[1] << 8) | (scancodes[2] << 16) | ((uint32_t)scancodes[3] << 24));
+    if (isQueueing() && report_queue::pushKeyboard(modifier, scancodes)) {
+        TRACE(REPORT_QUEUED, utils::trace::REPORT_KEYBOARD);
         return ;
     }
+    utils::latency_monitor::markReport(utils::latency_monitor::KEY_CHORD);
+    reported(blehid.keyboardReport(connectionHandle(), modifier, scancodes));
+}
 
-    connection->disconnect();
-
-    // 切断待機
-    auto disconnected = waitCondition([](){
-        return !isConnected();
-    }, timeoutMs);
 
-    if (disconnected) {
-        connectionHandle = BLE_CONN_HANDLE_INVALID;
+void ble_hid::mouseButtonReport()
+{
+    TRACE(REPORT_BUTTONS, _mouseButtons);
+    if (isQueueing() && report_queue::pushButtons(_mouseButtons)) {
+        TRACE(REPORT_QUEUED, utils::trace::REPORT_BUTTONS);
+        return ;
     }
+    utils::latency_monitor::markReport(utils::latency_monitor::MOUSE_BUTTON);
+    reported(blehid.mouseButtonReport(connectionHandle(), _mouseButtons));
 }
 
 
-bool ble_hid::isConnected()
+void ble_hid::mouseReport(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal)
 {
-    return Bluefruit.connected(connectionHandle);
+    TRACE(REPORT_MOUSE, 0, (uint8_t)x | ((uint8_t)y << 8) | ((uint8_t)vertical << 16) | ((uint32_t)(uint8_t)horizontal << 24));
+    if (isQueueing() && report_queue::pushMotion(x, y, vertical, horizontal)) {
+        TRACE(REPORT_QUEUED, utils::trace::REPORT_MOUSE);
+        return ;
+    }
+    markMotionReport(x, y, vertical, horizontal);
+    reported(blehid.mouseReport(connectionHandle(), x, y, vertical, horizontal));
 }
 
 
 void ble_hid::mouseMove(const int8_t x, const int8_t y)
 {
-    blehid.mouseMove(x, y);
+    mouseReport(x, y, 0, 0);
 }
 
 
 void ble_hid::mouseHScroll(const int8_t move)
 {
-    blehid.mousePan(move);
+    mouseReport(0, 0, 0, move);
 }
 
 void ble_hid::mouseVScroll(const int8_t move)
 {
-    blehid.mouseScroll(move);
+    mouseReport(0, 0, move, 0);
 }
 
 void ble_hid::mousePress(const MouseButton button)
 {
-    blehid.mouseButtonPress(button);
+    _mouseButtons |= button;
+    mouseButtonReport();
 }
 
 void ble_hid::mouseRelease(const MouseButton button)
 {
-    blehid.mouseButtonRelease(button);
-    blehid.mouseMove(0, 0); // なぜかマウス移動レポートを送らないとRELEASEイベントを送ってくれない
+    _mouseButtons &= ~button;
+    mouseButtonReport();
+}
+
+void ble_hid::mouseMoveAbsolute(const uint16_t x, const uint16_t y)
+{
+    if (isQueueing() && report_queue::pushAbsolute(x, y)) {
+        return ;
+    }
+    reported(blehid.absoluteReport(connectionHandle(), x, y));
 }
 
 void ble_hid::keyPress(const uint8_t scancode, const uint8_t modifierFlag)
 {
     uint8_t scancodes[6] = {scancode, 0, 0, 0, 0, 0};
-    blehid.keyboardReport(modifierFlag, scancodes);
+    keyboardReport(modifierFlag, scancodes);
+}
+
+void ble_hid::keyPress(const uint8_t (&scancodes)[6], const uint8_t modifierFlag)
+{
+    keyboardReport(modifierFlag, scancodes);
 }
 
 void ble_hid::keyRelease(const uint8_t modifierFlag)
 {
     uint8_t scancodes[6] = {0, 0, 0, 0, 0, 0};
-    blehid.keyboardReport(modifierFlag, scancodes);
+    keyboardReport(modifierFlag, scancodes);
 }
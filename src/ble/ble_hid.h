@@ -2,6 +2,8 @@
 
 #include <bluefruit.h>
 #include <ble/ble_common.h>
+#include <ble/hid_device.h>
+#include <ble/ble_link.h>
 
 namespace ble
 {
@@ -31,24 +33,135 @@ namespace ble
             RIGHT_GUI = KEYBOARD_MODIFIER_RIGHTGUI,
         };
 
+        /**
+         * @brief 再接続の経路(どのアドバタイズで接続したか)
+         */
+        enum ReconnectPhase
+        {
+            PHASE_DIRECTED = 0, ///< 指向性アドバタイズ
+            PHASE_FAST,         ///< 通常のアドバタイズ(短い間隔)
+            PHASE_SLOW,         ///< 通常のアドバタイズ(長い間隔)
+            PHASE_COUNT,
+        };
+
+        /**
+         * @brief 最初のレポートまでの時間を計測するきっかけ
+         */
+        enum WakeKind
+        {
+            WAKE_LIGHT_SLEEP = 0, ///< LightSleepからの復帰
+            WAKE_COLD_BOOT,       ///< 起動(Flashから設定を読み込む)
+            WAKE_WARM_BOOT,       ///< DeepSleepからの復帰(保持したRAMから設定を復元する)
+            WAKE_KIND_COUNT,
+        };
+
+        static constexpr uint8_t HOST_COUNT = 2; ///< 同時に接続するホストの数(ホストiはリンクi、アドレスの種i+1)
+
         ble_hid() = delete;
 
         static void init();
-        static bool connect(uint8_t peerId, uint32_t timeoutMs = 0, const ConnectionParam param = ConnectionParam());
-        static void disconnect(const uint32_t timeoutMs = 0);
+        static void begin(const ConnectionParam param = ConnectionParam());
+        static void end();
+        static void setDirectedPeer(const uint8_t host, const ble_gap_id_key_t* peer);
+        static void setActiveHost(const uint8_t host);
         static bool isConnected();
+        static bool isConnected(const uint8_t host);
+        static bool isReportable();
+        static void replay();
+        static void markWake(const WakeKind kind, const uint32_t wakeUs);
+        static bool getPeerIdentity(const uint8_t host, ble_gap_id_key_t& identity);
+        static size_t serializeReconnectStats(char* buffer, const size_t size);
+
+        /**
+         * @brief レポートの送信先のホスト
+         */
+        static uint8_t getActiveHost()
+        {
+            return _activeHost;
+        }
 
         static void mouseMove(const int8_t x, const int8_t y);
         static void mouseHScroll(const int8_t move);
         static void mouseVScroll(const int8_t move);
         static void mousePress(const MouseButton button);
         static void mouseRelease(const MouseButton button);
+        static void mouseMoveAbsolute(const uint16_t x, const uint16_t y);
         
         static void keyPress(const uint8_t scancode, const uint8_t modifierFlag = Modifier::NONE);
+        static void keyPress(const uint8_t (&scancodes)[6], const uint8_t modifierFlag = Modifier::NONE);
         static void keyRelease(const uint8_t modifierFlag = Modifier::NONE);
 
     private:
-        static inline BLEHidAdafruit blehid;
-        static inline uint16_t connectionHandle = BLE_CONN_HANDLE_INVALID;
+        static constexpr uint16_t FAST_TIMEOUT_S = 5; ///< 通常のアドバタイズを短い間隔で行う時間
+        static constexpr uint8_t REPLAY_MAX_REPORTS = 8; ///< replay()1回で送るレポートの上限(送信キューを溢れさせない)
+
+        /**
+         * @brief 経路ごとの再接続時間(アドバタイズ開始から最初のレポート送信まで)
+         */
+        struct ReconnectStats
+        {
+            uint32_t count;
+            uint32_t lastMs;
+            uint32_t maxMs;
+        };
+
+        /**
+         * @brief 復帰/起動から最初のレポートまでの時間
+         */
+        struct WakeStats
+        {
+            uint32_t count;
+            uint32_t lastUs;
+            uint32_t maxUs;
+        };
+
+        /**
+         * @brief ホストごとの状態
+         */
+        struct Host
+        {
+            bool hasDirectedPeer;
+            ble_gap_id_key_t directedPeer;    ///< 前回接続したセントラルの識別情報
+            uint32_t reconnectStartMs;        ///< 切断/begin()後の最初のアドバタイズ開始時刻
+            uint32_t undirectedStartMs;       ///< 通常のアドバタイズの開始時刻
+            bool isDirected;                  ///< 直近のアドバタイズが指向性か
+            bool isAwaitingFirstReport;
+            volatile uint8_t connectedPhase;  ///< 接続した経路(BLEのタスクから書き込まれる)
+        };
+
+        static inline hid_device blehid;
+        static inline ConnectionParam _param{};
+        static inline uint8_t _activeHost = 0;
+        static inline Host _hosts[HOST_COUNT] = {};
+        static inline ReconnectStats _reconnectStats[PHASE_COUNT] = {};
+        static inline uint8_t _mouseButtons = 0; ///< 押下中のマウスボタン(溜めている分を含む)
+        static inline uint32_t _wakeUs = 0;      ///< 復帰/起動した時刻(micros)
+        static inline WakeKind _wakeKind = WAKE_LIGHT_SLEEP;
+        static inline bool _isAwaitingWakeReport = false;
+        static inline WakeStats _wakeStats[WAKE_KIND_COUNT] = {};
+
+        static void setupAdvertising(const uint8_t host);
+        static ble_link::Advertising startAdvertising(const ble_link::Link link, const uint8_t attempt);
+        static void onEvent(ble_evt_t* evt);
+        static void reported(const bool success);
+        static void keyboardReport(const uint8_t modifier, const uint8_t (&scancodes)[6]);
+        static void mouseButtonReport();
+        static void mouseReport(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal);
+        static bool isQueueing();
+        static void markMotionReport(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal);
+
+        static inline ble_link::Link toLink(const uint8_t host)
+        {
+            return static_cast<ble_link::Link>(host);
+        }
+
+        /**
+         * @brief レポートの送信先。アクティブなホストとHIDとして接続していなければ無効なハンドル
+         */
+        static inline uint16_t connectionHandle()
+        {
+            auto link = toLink(_activeHost);
+            return ble_link::isConnected(link, ble_link::HID) ? ble_link::getConnectionHandle(link) : BLE_CONN_HANDLE_INVALID;
+        }
     };
 }
\ No newline at end of file
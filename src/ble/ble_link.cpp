@@ -0,0 +1,540 @@
+#include <ble/ble_link.h>
+#include <utils/timeout.h>
+#include <utils/json_writer.h>
+#include <utils/debug.h>
+#include <utils/energy_meter.h>
+#include <utils/boot_profiler.h>
+
+using namespace ble;
+
+void ble_link::init()
+{
+    auto now = millis();
+    for (auto& ctx : _links) {
+        ctx.state = IDLE;
+        ctx.connectionHandle = BLE_CONN_HANDLE_INVALID;
+        ctx.backoffMs = BACKOFF_MIN_MS;
+        ctx.enteredMs = now;
+        ctx.stats[IDLE].entries++;
+    }
+
+    // 接続はアドバタイズしていたリンクのもの
+    Bluefruit.Periph.setConnectCallback([](uint16_t c) {
+        Link link = _advertisingLink;
+        if (link == LINK_INVALID) {
+            // アドバタイズを止めた直後に来た接続は受け付けない
+            auto connection = Bluefruit.Connection(c);
+            if (connection) {
+                connection->disconnect();
+            }
+            return ;
+        }
+        // アドバタイズ中のリンクはupdate()で接続を処理するまで残す(イベントハンドラが接続先を判別できるように)
+        _links[link].connectionHandle = c;
+        postEvent(link, EVENT_CONNECTED);
+    });
+    Bluefruit.Periph.setDisconnectCallback([](uint16_t c, uint8_t reason) {
+        DEBUG_PRINTF("disconnected reason=0x%02x", reason);
+        auto link = findLink(c);
+        if (link == LINK_INVALID) {
+            return ;
+        }
+        _links[link].connectionHandle = BLE_CONN_HANDLE_INVALID;
+        postEvent(link, EVENT_DISCONNECTED);
+    });
+    Bluefruit.Security.setSecuredCallback([](uint16_t c) {
+        auto link = findLink(c);
+        if (link != LINK_INVALID) {
+            postEvent(link, EVENT_SECURED);
+        }
+    });
+    Bluefruit.Advertising.setStopCallback([]() {
+        Link link = _advertisingLink;
+        if (link != LINK_INVALID) {
+            postEvent(link, EVENT_ADVERTISING_STOPPED);
+        }
+    });
+    Bluefruit.Advertising.restartOnDisconnect(false);
+
+    // S140のアドバタイズセットは1つだけ。Bluefruitは自分で作ったセット(ハンドル0)しか使わないため、
+    // 指向性アドバタイズより先に一度開始/停止して作らせ、以降は両方で同じセットを設定し直して使う。
+    // 作らせる間に接続されないよう、この間だけ接続不可のタイプにしておく
+    Bluefruit.Advertising.setType(BLE_GAP_ADV_TYPE_NONCONNECTABLE_NONSCANNABLE_UNDIRECTED);
+    if (Bluefruit.Advertising.start(0)) {
+        Bluefruit.Advertising.stop();
+    }
+    Bluefruit.Advertising.setType(BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED);
+
+    // その他のイベントは登録されたハンドラに渡す(BLEのタスクから呼ばれる)
+    Bluefruit.setEventCallback([](ble_evt_t* evt) {
+        // 指向性アドバタイズはBluefruitを通さずに開始するため、タイムアウトはここで拾う
+        Link link = _advertisingLink;
+        if (link != LINK_INVALID && _links[link].isDirected
+            && evt->header.evt_id == BLE_GAP_EVT_ADV_SET_TERMINATED
+            && evt->evt.gap_evt.params.adv_set_terminated.reason == BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT) {
+            postEvent(link, EVENT_ADVERTISING_STOPPED);
+        }
+
+        for (auto handler : _eventHandlers) {
+            if (handler) {
+                handler(evt);
+            }
+        }
+    });
+}
+
+
+bool ble_link::addEventHandler(EventHandler handler)
+{
+    for (auto& h : _eventHandlers) {
+        if (!h) {
+            h = handler;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @brief 指向性(High Duty Cycle)アドバタイズを開始する
+ * @details 接続済みのセントラル宛てに約1.28秒間だけ3.75ms以下の間隔でアドバタイズするため、
+ *          通常のアドバタイズより早く再接続できる。アドバタイズデータは載せられない。
+ *          Bluefruitは指向性アドバタイズに対応していないため、SoftDeviceを直接呼ぶ。
+ *
+ *          プライバシーを使うセントラルのアドレス(RPA)は変わるため、宛先はボンディングで受け取った識別アドレスにする。
+ *          IRKがあればデバイス識別リストに登録し、SoftDeviceにIRKから今のRPAを作らせる。
+ * @param [in] peer 接続先の識別情報(IRKと識別アドレス)
+ * @retval true  開始した
+ * @retval false 開始できなかった
+ * @note StartAdvertisingFunctionから呼び、ADVERTISING_DIRECTEDを返すこと
+ */
+bool ble_link::startDirectedAdvertising(const ble_gap_id_key_t& peer)
+{
+    static constexpr ble_gap_irk_t NO_IRK = {};
+    if (memcmp(&peer.id_info, &NO_IRK, sizeof(ble_gap_irk_t)) != 0) {
+        const ble_gap_id_key_t* identities[] = { &peer };
+        auto err = sd_ble_gap_device_identities_set(identities, nullptr, 1);
+        if (err != NRF_SUCCESS) {
+            DEBUG_PRINTF("set device identities failed 0x%x", err);
+            return false;
+        }
+    }
+
+    ble_gap_adv_params_t params = {};
+    params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE;
+    params.p_peer_addr = &peer.id_addr_info;
+    params.duration = BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX;
+    params.filter_policy = BLE_GAP_ADV_FP_ANY;
+    params.primary_phy = BLE_GAP_PHY_1MBPS;
+
+    // Bluefruitが作ったセットを設定し直す(次の通常のアドバタイズではBluefruitが設定し直す)
+    uint8_t handle = ADV_HANDLE;
+    auto err = sd_ble_gap_adv_set_configure(&handle, nullptr, &params);
+    if (err != NRF_SUCCESS) {
+        DEBUG_PRINTF("configure directed advertising failed 0x%x", err);
+        return false;
+    }
+
+    err = sd_ble_gap_adv_start(ADV_HANDLE, CONN_CFG_PERIPHERAL);
+    if (err != NRF_SUCCESS) {
+        DEBUG_PRINTF("start directed advertising failed 0x%x", err);
+        return false;
+    }
+    return true;
+}
+
+
+void ble_link::begin(const Link link, const Role role, StartAdvertisingFunction startAdvertising, const bool requireSecurity)
+{
+    auto& ctx = _links[link];
+    ctx.role = role;
+    ctx.startAdvertising = startAdvertising;
+    ctx.requireSecurity = requireSecurity;
+    ctx.backoffMs = BACKOFF_MIN_MS;
+    ctx.attempt = 0;
+
+    switch (ctx.state) {
+        case ADVERTISING:
+        case BACKOFF:
+        {
+            // 用途が変わるとアドレス/アドバタイズデータも変わるのでやり直す
+            stopAdvertising(link);
+            transition(link, IDLE);
+            break;
+        }
+
+        case CONNECTING:
+        case SECURING:
+        case READY:
+        {
+            // 別の用途で接続中なら切断する(切断イベントでIDLEに戻る)
+            if (ctx.connectedRole != role) {
+                auto connection = Bluefruit.Connection(ctx.connectionHandle);
+                if (connection) {
+                    connection->disconnect();
+                }
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+void ble_link::restart(const Link link)
+{
+    auto& ctx = _links[link];
+    ctx.attempt = 0;
+
+    switch (ctx.state) {
+        case ADVERTISING:
+        case BACKOFF:
+        {
+            stopAdvertising(link);
+            transition(link, IDLE);
+            break;
+        }
+
+        case CONNECTING:
+        case SECURING:
+        case READY:
+        {
+            // 切断イベントでIDLEに戻り、すぐにアドバタイズし直す
+            auto connection = Bluefruit.Connection(ctx.connectionHandle);
+            if (connection) {
+                ctx.isRestarting = true;
+                connection->disconnect();
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+void ble_link::end(const Link link)
+{
+    auto& ctx = _links[link];
+    ctx.role = NONE;
+    ctx.startAdvertising = nullptr;
+
+    if (ctx.state == ADVERTISING) {
+        stopAdvertising(link);
+    }
+
+    auto connection = Bluefruit.Connection(ctx.connectionHandle);
+    if (connection && connection->connected()) {
+        connection->disconnect();
+    }
+
+    if (ctx.state == ADVERTISING || ctx.state == BACKOFF) {
+        transition(link, IDLE);
+    }
+}
+
+
+/**
+ * @brief 全てのリンクを終了する
+ * @param [in] timeoutMs 切断を待つ時間。0なら待たない(DeepSleep前など、切断を待つ必要がある場合のみ指定)
+ */
+void ble_link::endAll(const uint32_t timeoutMs)
+{
+    for (uint8_t i = 0; i < LINK_COUNT; i++) {
+        end(static_cast<Link>(i));
+    }
+
+    if (timeoutMs > 0) {
+        waitCondition([]() {
+            for (auto& ctx : _links) {
+                if (Bluefruit.connected(ctx.connectionHandle)) {
+                    return false;
+                }
+            }
+            return true;
+        }, timeoutMs);
+    }
+}
+
+
+void ble_link::update()
+{
+    for (uint8_t i = 0; i < LINK_COUNT; i++) {
+        updateLink(static_cast<Link>(i));
+    }
+}
+
+
+void ble_link::updateLink(const Link link)
+{
+    auto& ctx = _links[link];
+    auto events = takeEvents(link);
+    auto now = millis();
+
+    // 切断
+    if (events & EVENT_DISCONNECTED) {
+        disconnected(link);
+    }
+
+    // 接続したのでアドバタイズは止まっている
+    if ((events & EVENT_CONNECTED) && _advertisingLink == link) {
+        _advertisingLink = LINK_INVALID;
+    }
+
+    // 接続(切断と同時に来た場合は新しい接続が生きていれば採用)
+    if ((events & EVENT_CONNECTED) && Bluefruit.connected(ctx.connectionHandle)) {
+        ctx.connectedRole = ctx.role;
+        ctx.isDirected = false;
+        transition(link, CONNECTING);
+    }
+
+    switch (ctx.state) {
+        case IDLE:
+        {
+            if (ctx.role == NONE || !ctx.startAdvertising) {
+                break;
+            }
+
+            // アドバタイズは1リンクずつ。切断直後のリンクは再試行中のリンクより優先する
+            Link other = _advertisingLink;
+            if (other != LINK_INVALID && other != link) {
+                if (ctx.attempt > 0 || _links[other].attempt == 0) {
+                    break;
+                }
+                stopAdvertising(other);
+                transition(other, IDLE);
+            }
+
+            startAdvertising(link);
+            break;
+        }
+
+        case ADVERTISING:
+        {
+            // タイムアウトでアドバタイズが止まった
+            if (events & EVENT_ADVERTISING_STOPPED) {
+                if (_advertisingLink == link) {
+                    _advertisingLink = LINK_INVALID;
+                }
+                ctx.attempt++;
+                transition(link, ctx.isDirected ? IDLE : BACKOFF);
+                ctx.isDirected = false;
+            }
+            break;
+        }
+
+        case CONNECTING:
+        {
+            auto connection = Bluefruit.Connection(ctx.connectionHandle);
+            if (connection) {
+                auto s = connection->requestPHY(BLE_GAP_PHY_2MBPS);
+                DEBUG_PRINTF("request ble phy %d", s);
+                s = connection->requestMtuExchange(247);
+                DEBUG_PRINTF("request ble mtu %d", s);
+            }
+
+            if (ctx.requireSecurity && !(connection && connection->secured())) {
+                transition(link, SECURING);
+            } else {
+                transition(link, READY);
+            }
+            break;
+        }
+
+        case SECURING:
+        {
+            // 暗号化されないホストもあるため、一定時間で諦めてREADYにする
+            if ((events & EVENT_SECURED) || (now - ctx.enteredMs) >= SECURING_TIMEOUT_MS) {
+                transition(link, READY);
+            }
+            break;
+        }
+
+        case READY:
+        {
+            ctx.backoffMs = BACKOFF_MIN_MS;
+            break;
+        }
+
+        case BACKOFF:
+        {
+            if ((now - ctx.enteredMs) >= ctx.backoffMs) {
+                ctx.backoffMs = min(ctx.backoffMs * 2, BACKOFF_MAX_MS);
+                transition(link, IDLE);
+            }
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+
+bool ble_link::isConnected(const Link link, const Role role)
+{
+    auto& ctx = _links[link];
+    return (ctx.state == CONNECTING || ctx.state == SECURING || ctx.state == READY)
+        && ctx.connectedRole == role
+        && Bluefruit.connected(ctx.connectionHandle);
+}
+
+
+bool ble_link::isReady(const Link link, const Role role)
+{
+    auto& ctx = _links[link];
+    return ctx.state == READY
+        && ctx.connectedRole == role
+        && Bluefruit.connected(ctx.connectionHandle);
+}
+
+
+size_t ble_link::serializeStats(char* buffer, const size_t size)
+{
+    // [{"s":現在の状態,"n":[状態ごとの遷移回数],"l":[直近の滞在時間ms],"x":[最大滞在時間ms]}, ...] (リンクごと)
+    // 入りきらないリンクは丸ごと出力しない
+    utils::json_writer writer(buffer, size, 1);
+    writer.append("[");
+    const char* keys[] = {"n", "l", "x"};
+    for (int l = 0; l < LINK_COUNT; l++) {
+        auto& ctx = _links[l];
+        auto start = writer.getLength();
+        bool fits = writer.append("%s{\"s\":%d", (l == 0) ? "" : ",", ctx.state);
+        for (int k = 0; k < 3 && fits; k++) {
+            fits = writer.append(",\"%s\":[", keys[k]);
+            for (int i = 0; i < STATE_COUNT && fits; i++) {
+                auto& stats = ctx.stats[i];
+                uint32_t value = (k == 0) ? stats.entries : (k == 1) ? stats.lastMs : stats.maxMs;
+                fits = writer.append("%s%lu", (i == 0) ? "" : ",", (unsigned long)value);
+            }
+            fits = fits && writer.append("]");
+        }
+        fits = fits && writer.append("}");
+        if (!fits) {
+            writer.rollback(start);
+            break;
+        }
+    }
+    writer.close("]");
+    return writer.getLength();
+}
+
+
+void ble_link::startAdvertising(const Link link)
+{
+    auto& ctx = _links[link];
+
+    // 接続コールバックが先に来てもよいように、開始前にアドバタイズ中のリンクにしておく
+    _advertisingLink = link;
+    auto advertising = ctx.startAdvertising(link, ctx.attempt);
+    ctx.isDirected = (advertising == ADVERTISING_DIRECTED);
+    if (advertising != ADVERTISING_FAILED) {
+        transition(link, ADVERTISING);
+    } else {
+        DEBUG_PRINTF("start advertising failed!");
+        _advertisingLink = LINK_INVALID;
+        ctx.attempt++;
+        transition(link, BACKOFF);
+    }
+}
+
+
+void ble_link::stopAdvertising(const Link link)
+{
+    if (_advertisingLink != link) {
+        return ;
+    }
+    _advertisingLink = LINK_INVALID;
+
+    auto& ctx = _links[link];
+    if (ctx.isDirected) {
+        sd_ble_gap_adv_stop(ADV_HANDLE);
+        ctx.isDirected = false;
+    } else {
+        Bluefruit.Advertising.stop();
+    }
+}
+
+
+void ble_link::transition(const Link link, const State next)
+{
+    auto& ctx = _links[link];
+    auto now = millis();
+    auto& stats = ctx.stats[ctx.state];
+    stats.lastMs = now - ctx.enteredMs;
+    if (stats.lastMs > stats.maxMs) {
+        stats.maxMs = stats.lastMs;
+    }
+
+    DEBUG_PRINTF("link%d %d -> %d (%dms)", link, ctx.state, next, stats.lastMs);
+
+    ctx.state = next;
+    ctx.enteredMs = now;
+    ctx.stats[next].entries++;
+
+    // 接続(CONNECTING以降)/アドバタイズの時間を消費電荷の見積もりに数える
+    auto radio = (next == ADVERTISING) ? utils::energy_meter::ADVERTISING
+        : (next == CONNECTING || next == SECURING || next == READY) ? utils::energy_meter::CONNECTED
+        : utils::energy_meter::NONE;
+    utils::energy_meter::setLinkState(link, radio);
+
+    // 起動からHIDのアドバタイズ開始/接続までの時間(最初の1回だけ記録される)
+    if (ctx.role == HID && next == ADVERTISING) {
+        utils::boot_profiler::mark(utils::boot_profiler::ADVERTISING);
+    }
+    if (ctx.role == HID && next == READY) {
+        utils::boot_profiler::mark(utils::boot_profiler::CONNECT);
+    }
+}
+
+
+void ble_link::disconnected(const Link link)
+{
+    auto& ctx = _links[link];
+    auto role = ctx.connectedRole;
+    ctx.connectedRole = NONE;
+
+    if (ctx.state == CONNECTING || ctx.state == SECURING || ctx.state == READY) {
+        // 用途/接続先の切り替えによる切断はすぐにアドバタイズし直す
+        bool isSwitching = ctx.isRestarting || ctx.role == NONE || ctx.role != role;
+        transition(link, isSwitching ? IDLE : BACKOFF);
+    }
+    ctx.isRestarting = false;
+
+    // 切断後は指向性アドバタイズから試す
+    ctx.attempt = 0;
+
+    if (_disconnectCallback && role != NONE) {
+        _disconnectCallback(link, role);
+    }
+}
+
+
+ble_link::Link ble_link::findLink(const uint16_t connectionHandle)
+{
+    if (connectionHandle == BLE_CONN_HANDLE_INVALID) {
+        return LINK_INVALID;
+    }
+    for (uint8_t i = 0; i < LINK_COUNT; i++) {
+        if (_links[i].connectionHandle == connectionHandle) {
+            return static_cast<Link>(i);
+        }
+    }
+    return LINK_INVALID;
+}
+
+
+uint32_t ble_link::takeEvents(const Link link)
+{
+    return __atomic_exchange_n(&_links[link].events, 0, __ATOMIC_SEQ_CST);
+}
+
+
+void ble_link::postEvent(const Link link, const uint32_t event)
+{
+    __atomic_fetch_or(&_links[link].events, event, __ATOMIC_SEQ_CST);
+}
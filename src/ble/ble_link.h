@@ -0,0 +1,190 @@
+#pragma once
+
+#include <bluefruit.h>
+#include <ble/ble_common.h>
+
+namespace ble
+{
+    /**
+     * @brief BLE接続(ペリフェラル側)の状態遷移を管理するクラス
+     * @details 複数の接続(リンク)を同時に扱い、リンクごとに状態遷移する。
+     *          SoftDeviceの接続/切断/暗号化/アドバタイズ停止のコールバックではイベントを記録するだけにし、
+     *          状態遷移はupdate()(メインループのタスク)で行う。待機しないため接続待ちの間も入力処理を止めない。
+     *
+     *          IDLE -> ADVERTISING -> CONNECTING -> SECURING -> READY
+     *            ^          |                                    |
+     *            +------ BACKOFF <-------- (切断/タイムアウト) ----+
+     *
+     *          指向性アドバタイズがタイムアウトした場合はBACKOFFを挟まずに次の試行(通常のアドバタイズ)に進む。
+     *          アドバタイズできるのは同時に1リンクだけなので、他のリンクがアドバタイズ中のIDLEは空くまで待つ。
+     *          ただし切断直後(最初の試行)のリンクは、再試行中のリンクのアドバタイズを止めて先に行う。
+     *          状態ごとに遷移回数/直近の滞在時間/最大滞在時間をリンクごとに計測する。
+     */
+    class ble_link
+    {
+    public:
+        /**
+         * @brief 接続状態
+         */
+        enum State
+        {
+            IDLE = 0,    ///< 未接続。次のupdate()でアドバタイズを開始する
+            ADVERTISING, ///< アドバタイズ中
+            CONNECTING,  ///< 接続済み。PHY/MTUの要求中
+            SECURING,    ///< 暗号化(ペアリング/ボンディング)待ち
+            READY,       ///< 通信可能
+            BACKOFF,     ///< 再アドバタイズまで待機
+            STATE_COUNT,
+        };
+
+        /**
+         * @brief 接続の用途
+         */
+        enum Role
+        {
+            NONE = 0,
+            HID,    ///< HIDデバイス
+            CONFIG, ///< 設定
+        };
+
+        /**
+         * @brief リンク(同時接続の枠)
+         * @note Bluefruit.begin()のペリフェラル接続数と合わせること
+         */
+        enum Link : uint8_t
+        {
+            LINK_HOST_1 = 0, ///< HIDホスト1
+            LINK_HOST_2,     ///< HIDホスト2
+            LINK_CONFIG,     ///< 設定アプリ(HIDの接続と同時に使える)
+            LINK_COUNT,
+            LINK_INVALID = 0xFF,
+        };
+
+        /**
+         * @brief 開始したアドバタイズの種類
+         */
+        enum Advertising
+        {
+            ADVERTISING_FAILED = 0, ///< 開始できなかった
+            ADVERTISING_DIRECTED,   ///< 指向性(接続済みのセントラル宛て。タイムアウトしたらすぐ次を試す)
+            ADVERTISING_UNDIRECTED, ///< 通常
+        };
+
+        /**
+         * @brief アドバタイズ開始処理
+         * @param [in] link    アドバタイズするリンク
+         * @param [in] attempt 切断/begin()からの試行回数(0から)
+         */
+        using StartAdvertisingFunction = Advertising(*)(const Link link, const uint8_t attempt);
+        using DisconnectCallback = void(*)(const Link link, const Role role); ///< 切断コールバック(update()から呼ばれる)
+        using EventHandler = void(*)(ble_evt_t* evt);  ///< BLEイベントハンドラ(BLEのタスクから呼ばれる)
+
+        static constexpr uint16_t ADVERTISING_TIMEOUT_S = 30; ///< 通常のアドバタイズを続ける時間
+
+        ble_link() = delete;
+
+        static void init();
+        static void begin(const Link link, const Role role, StartAdvertisingFunction startAdvertising, const bool requireSecurity);
+        static void restart(const Link link);
+        static void end(const Link link);
+        static void endAll(const uint32_t timeoutMs = 0);
+        static bool addEventHandler(EventHandler handler);
+        static bool startDirectedAdvertising(const ble_gap_id_key_t& peer);
+        static void update();
+
+        static bool isConnected(const Link link, const Role role);
+        static bool isReady(const Link link, const Role role);
+        static size_t serializeStats(char* buffer, const size_t size);
+
+        static State getState(const Link link)
+        {
+            return _links[link].state;
+        }
+
+        static Role getRole(const Link link)
+        {
+            return _links[link].role;
+        }
+
+        static uint16_t getConnectionHandle(const Link link)
+        {
+            return _links[link].connectionHandle;
+        }
+
+        /**
+         * @brief アドバタイズ中のリンク
+         * @return リンク。アドバタイズしていなければLINK_INVALID
+         */
+        static Link getAdvertisingLink()
+        {
+            return _advertisingLink;
+        }
+
+        static void setDisconnectCallback(DisconnectCallback callback)
+        {
+            _disconnectCallback = callback;
+        }
+
+    private:
+        static constexpr size_t MAX_EVENT_HANDLERS = 4;
+        static constexpr uint32_t SECURING_TIMEOUT_MS = 10000; ///< 暗号化されなくてもREADYにするまでの時間
+        static constexpr uint8_t ADV_HANDLE = 0; ///< アドバタイズセットのハンドル(S140は1つだけ。init()でBluefruitに作らせる)
+        static constexpr uint32_t BACKOFF_MIN_MS = 100;        ///< 再アドバタイズまでの待機時間(初回)
+        static constexpr uint32_t BACKOFF_MAX_MS = 30000;      ///< 再アドバタイズまでの待機時間(最大)
+
+        /**
+         * @brief SoftDeviceのコールバックから受け取るイベント(ビット)
+         */
+        enum Event : uint32_t
+        {
+            EVENT_CONNECTED = 1 << 0,
+            EVENT_DISCONNECTED = 1 << 1,
+            EVENT_SECURED = 1 << 2,
+            EVENT_ADVERTISING_STOPPED = 1 << 3,
+        };
+
+        /**
+         * @brief 状態ごとの計測値
+         */
+        struct StateStats
+        {
+            uint32_t entries; ///< 遷移回数
+            uint32_t lastMs;  ///< 直近の滞在時間
+            uint32_t maxMs;   ///< 最大滞在時間
+        };
+
+        /**
+         * @brief リンクごとの状態
+         */
+        struct Context
+        {
+            State state;
+            Role role;               ///< これから接続する用途
+            Role connectedRole;      ///< 接続中の用途
+            StartAdvertisingFunction startAdvertising;
+            bool requireSecurity;
+            uint8_t attempt;         ///< 切断/begin()からのアドバタイズ試行回数
+            bool isDirected;         ///< 指向性アドバタイズ中
+            bool isRestarting;       ///< restart()による切断待ち
+            volatile uint32_t events;
+            volatile uint16_t connectionHandle;
+            uint32_t enteredMs;
+            uint32_t backoffMs;
+            StateStats stats[STATE_COUNT];
+        };
+
+        static inline Context _links[LINK_COUNT] = {};
+        static inline volatile Link _advertisingLink = LINK_INVALID;
+        static inline EventHandler _eventHandlers[MAX_EVENT_HANDLERS] = {};
+        static inline DisconnectCallback _disconnectCallback = nullptr;
+
+        static void updateLink(const Link link);
+        static void startAdvertising(const Link link);
+        static void stopAdvertising(const Link link);
+        static void transition(const Link link, const State next);
+        static void disconnected(const Link link);
+        static Link findLink(const uint16_t connectionHandle);
+        static uint32_t takeEvents(const Link link);
+        static void postEvent(const Link link, const uint32_t event);
+    };
+}
@@ -0,0 +1,150 @@
+#include <ble/conn_param_manager.h>
+#include <utils/debug.h>
+#include <utils/json_writer.h>
+
+using namespace ble;
+
+void conn_param_manager::init()
+{
+    for (auto& ctx : _links) {
+        ctx.connectionHandle = BLE_CONN_HANDLE_INVALID;
+    }
+    ble_link::addEventHandler(onEvent);
+}
+
+
+void conn_param_manager::request(const ble_link::Link link, const Profile profile)
+{
+    // 緩めない設定なら無操作でも操作中のまま
+    _links[link].requested = (_idleLatency == 0) ? ACTIVE : profile;
+}
+
+
+/**
+ * @brief 無操作時のスレーブレイテンシを設定
+ * @param [in] latency スレーブレイテンシ。0なら緩めない
+ * @note 接続中のリンクには次に無操作になって要求するときから反映する
+ */
+void conn_param_manager::setIdleLatency(const uint16_t latency)
+{
+    _idleLatency = latency;
+}
+
+
+void conn_param_manager::reset(const ble_link::Link link, const uint16_t connectionHandle)
+{
+    // 接続直後はセントラルの保護時間が働いているので、その後から要求する
+    auto& ctx = _links[link];
+    auto now = millis();
+
+    // 切断済みのリンクに同じハンドルが残っていたら外す(イベントの振り分けを間違えないように)
+    for (auto& other : _links) {
+        if (other.connectionHandle == connectionHandle) {
+            other.connectionHandle = BLE_CONN_HANDLE_INVALID;
+        }
+    }
+    ctx.connectionHandle = connectionHandle;
+    ctx.current = ACTIVE;
+    ctx.isPending = false;
+    ctx.isUpdated = false;
+    ctx.retryMs = UPDATE_GUARD_MS;
+    ctx.nextRequestMs = now + UPDATE_GUARD_MS;
+}
+
+
+void conn_param_manager::update(const ble_link::Link link)
+{
+    auto& ctx = _links[link];
+    auto now = millis();
+
+    // パラメータ更新イベント(要求の結果 or セントラル主導の変更)
+    if (ctx.isUpdated) {
+        ctx.isUpdated = false;
+        ctx.current = (ctx.updatedLatency > 0) ? IDLE : ACTIVE;
+        ctx.nextRequestMs = now + UPDATE_GUARD_MS;
+
+        if (ctx.isPending) {
+            ctx.isPending = false;
+            if (ctx.current == ctx.sent) {
+                ctx.accepted++;
+                ctx.retryMs = UPDATE_GUARD_MS;
+            } else {
+                // 別の値で更新された=拒否
+                ctx.rejected++;
+                ctx.nextRequestMs = now + ctx.retryMs;
+                ctx.retryMs = min(ctx.retryMs * 2, RETRY_MAX_MS);
+            }
+        }
+        DEBUG_PRINTF("link%d conn param updated latency=%d", link, ctx.updatedLatency);
+    }
+
+    // 応答がない=拒否
+    if (ctx.isPending && (now - ctx.lastRequestMs) >= RESPONSE_TIMEOUT_MS) {
+        ctx.isPending = false;
+        ctx.rejected++;
+        ctx.nextRequestMs = now + ctx.retryMs;
+        ctx.retryMs = min(ctx.retryMs * 2, RETRY_MAX_MS);
+    }
+
+    if (ctx.isPending || ctx.requested == ctx.current || (int32_t)(now - ctx.nextRequestMs) < 0) {
+        return ;
+    }
+
+    auto connection = Bluefruit.Connection(ctx.connectionHandle);
+    if (!connection || !connection->connected()) {
+        return ;
+    }
+
+    // 接続間隔は変えない(変えるとセントラルに拒否されやすい)
+    auto interval = connection->getConnectionInterval();
+    auto success = (ctx.requested == IDLE)
+        ? connection->requestConnectionParameter(interval, _idleLatency, IDLE_SUP_TIMEOUT)
+        : connection->requestConnectionParameter(interval, 0, ACTIVE_SUP_TIMEOUT);
+    DEBUG_PRINTF("link%d request conn param %s %d", link, ctx.requested == IDLE ? "idle" : "active", success);
+
+    ctx.requests++;
+    ctx.lastRequestMs = now;
+    if (success) {
+        ctx.sent = ctx.requested;
+        ctx.isPending = true;
+    } else {
+        // SoftDeviceが受け付けなかった(手続き中など)ら少し待って再要求
+        ctx.nextRequestMs = now + RESPONSE_TIMEOUT_MS;
+    }
+}
+
+
+void conn_param_manager::onEvent(ble_evt_t* evt)
+{
+    if (evt->header.evt_id != BLE_GAP_EVT_CONN_PARAM_UPDATE) {
+        return ;
+    }
+
+    for (auto& ctx : _links) {
+        if (ctx.connectionHandle == evt->evt.gap_evt.conn_handle) {
+            ctx.updatedLatency = evt->evt.gap_evt.params.conn_param_update.conn_params.slave_latency;
+            ctx.isUpdated = true;
+            break;
+        }
+    }
+}
+
+
+size_t conn_param_manager::serializeStats(char* buffer, const size_t size)
+{
+    // [{"p":現在,"q":要求,"n":要求回数,"a":受理回数,"r":拒否回数}, ...] (リンクごと)
+    utils::json_writer writer(buffer, size, 1);
+    writer.append("[");
+    for (int i = 0; i < ble_link::LINK_COUNT; i++) {
+        auto& ctx = _links[i];
+        writer.append("%s{\"p\":%d,\"q\":%d,\"n\":%lu,\"a\":%lu,\"r\":%lu}",
+            (i == 0) ? "" : ",",
+            ctx.current,
+            ctx.requested,
+            (unsigned long)ctx.requests,
+            (unsigned long)ctx.accepted,
+            (unsigned long)ctx.rejected);
+    }
+    writer.close("]");
+    return writer.getLength();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <bluefruit.h>
+#include <ble/ble_common.h>
+#include <ble/ble_link.h>
+
+namespace ble
+{
+    /**
+     * @brief 接続パラメータ(スレーブレイテンシ)を操作状況に応じて切り替えるクラス
+     * @details 無操作時はスレーブレイテンシを上げて接続イベントを間引き、操作があれば0に戻す。
+     *          セントラル側には接続パラメータ更新の保護時間(約30秒)があり、その間の要求は拒否されるため、
+     *          要求は保護時間を空けて送り、拒否されたら間隔を倍々にして再要求する。
+     *          接続間隔は変えると拒否されやすいので、接続中の値をそのまま使う。
+     *          リンクごとに独立して管理する。
+     * @note スレーブレイテンシはペリフェラルが送るデータを遅らせない(送るデータがあれば次の接続イベントで送信する)ため、
+     *       無操作からの最初のレポートも1接続間隔以内に届く。
+     *       無操作時のスレーブレイテンシはsetIdleLatency()で変えられる(0なら緩めない)。
+     */
+    class conn_param_manager
+    {
+    public:
+        static constexpr uint16_t DEFAULT_IDLE_LATENCY = 30; ///< 無操作時のスレーブレイテンシの既定値(7.5ms間隔で約230ms)
+
+        /**
+         * @brief 接続パラメータの組み合わせ
+         */
+        enum Profile
+        {
+            ACTIVE = 0, ///< 操作中(スレーブレイテンシ0)
+            IDLE,       ///< 無操作(スレーブレイテンシ大)
+        };
+
+        conn_param_manager() = delete;
+
+        static void init();
+        static void request(const ble_link::Link link, const Profile profile);
+        static void update(const ble_link::Link link);
+        static void reset(const ble_link::Link link, const uint16_t connectionHandle);
+        static void setIdleLatency(const uint16_t latency);
+        static size_t serializeStats(char* buffer, const size_t size);
+
+        static Profile getProfile(const ble_link::Link link)
+        {
+            return _links[link].current;
+        }
+
+    private:
+        static constexpr uint16_t ACTIVE_SUP_TIMEOUT = 200;      ///< 操作中の監視タイムアウト(10ms単位)
+        static constexpr uint16_t IDLE_SUP_TIMEOUT = 400;        ///< 無操作時の監視タイムアウト(10ms単位)
+        static constexpr uint32_t UPDATE_GUARD_MS = 30000;       ///< 接続/更新後にセントラルが更新を拒否する時間
+        static constexpr uint32_t RESPONSE_TIMEOUT_MS = 5000;    ///< 要求の応答(更新イベント)待ち時間
+        static constexpr uint32_t RETRY_MAX_MS = 5 * 60 * 1000;  ///< 再要求までの最大間隔
+
+        /**
+         * @brief リンクごとの状態
+         */
+        struct Context
+        {
+            Profile requested;
+            Profile current;
+            Profile sent;            ///< 応答待ちの要求
+            bool isPending;          ///< 要求の応答待ち
+            uint32_t lastRequestMs;
+            uint32_t nextRequestMs;  ///< 次に要求してよい時刻
+            uint32_t retryMs;
+
+            volatile uint16_t connectionHandle;
+            volatile bool isUpdated;
+            volatile uint16_t updatedLatency;
+
+            uint32_t requests;
+            uint32_t accepted;
+            uint32_t rejected;
+        };
+
+        static inline Context _links[ble_link::LINK_COUNT] = {};
+        static inline uint16_t _idleLatency = DEFAULT_IDLE_LATENCY;
+
+        static void onEvent(ble_evt_t* evt);
+    };
+}
@@ -0,0 +1,143 @@
+#include <ble/hid_device.h>
+
+using namespace ble;
+
+namespace
+{
+    /**
+     * @brief レポートマップ(キーボード/コンシューマ/マウスはBLEHidAdafruitと同じ構成)
+     */
+    const uint8_t REPORT_MAP[] =
+    {
+        TUD_HID_REPORT_DESC_KEYBOARD( HID_REPORT_ID(hid_device::REPORT_ID_KEYBOARD) ),
+        TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(hid_device::REPORT_ID_CONSUMER_CONTROL) ),
+        TUD_HID_REPORT_DESC_MOUSE   ( HID_REPORT_ID(hid_device::REPORT_ID_MOUSE) ),
+
+#if ENABLE_ABSOLUTE_POINTER
+        // 絶対座標ポインタ(ボタン5個 + X/Y 16bit)
+        HID_USAGE_PAGE ( HID_USAGE_PAGE_DESKTOP     ),
+        HID_USAGE      ( HID_USAGE_DESKTOP_MOUSE    ),
+        HID_COLLECTION ( HID_COLLECTION_APPLICATION ),
+          HID_REPORT_ID( hid_device::REPORT_ID_ABSOLUTE )
+          HID_USAGE      ( HID_USAGE_DESKTOP_POINTER ),
+          HID_COLLECTION ( HID_COLLECTION_PHYSICAL   ),
+            HID_USAGE_PAGE   ( HID_USAGE_PAGE_BUTTON ),
+              HID_USAGE_MIN    ( 1 ),
+              HID_USAGE_MAX    ( 5 ),
+              HID_LOGICAL_MIN  ( 0 ),
+              HID_LOGICAL_MAX  ( 1 ),
+              HID_REPORT_COUNT ( 5 ),
+              HID_REPORT_SIZE  ( 1 ),
+              HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+              HID_REPORT_COUNT ( 1 ),
+              HID_REPORT_SIZE  ( 3 ),
+              HID_INPUT        ( HID_CONSTANT ),
+            HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+              HID_USAGE        ( HID_USAGE_DESKTOP_X ),
+              HID_USAGE        ( HID_USAGE_DESKTOP_Y ),
+              HID_LOGICAL_MIN  ( 0 ),
+              HID_LOGICAL_MAX_N( hid_device::ABSOLUTE_MAX, 2 ),
+              HID_REPORT_SIZE  ( 16 ),
+              HID_REPORT_COUNT ( 2 ),
+              HID_INPUT        ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+          HID_COLLECTION_END,
+        HID_COLLECTION_END,
+#endif
+    };
+}
+
+
+#if ENABLE_ABSOLUTE_POINTER
+hid_device::hid_device() : BLEHidGeneric(4, 1, 0) {}
+#else
+hid_device::hid_device() : BLEHidGeneric(3, 1, 0) {}
+#endif
+
+
+err_t hid_device::begin()
+{
+    uint16_t inputLen[] = {
+        sizeof(hid_keyboard_report_t),
+        sizeof(hid_consumer_control_report_t),
+        sizeof(hid_mouse_report_t),
+#if ENABLE_ABSOLUTE_POINTER
+        sizeof(absolute_report_t),
+#endif
+    };
+    uint16_t outputLen[] = { 1 };
+
+    setReportLen(inputLen, outputLen, NULL);
+    enableKeyboard(true);
+    enableMouse(true);
+    setReportMap(REPORT_MAP, sizeof(REPORT_MAP));
+
+    return BLEHidGeneric::begin();
+}
+
+
+bool hid_device::keyboardReport(const uint16_t connHandle, const uint8_t modifier, const uint8_t keycode[6])
+{
+    hid_keyboard_report_t report = { .modifier = modifier, .reserved = 0, .keycode = {} };
+    memcpy(report.keycode, keycode, sizeof(report.keycode));
+
+    if (isBootMode()) {
+        return bootKeyboardReport(connHandle, &report, sizeof(report));
+    }
+    return inputReport(connHandle, REPORT_ID_KEYBOARD, &report, sizeof(report));
+}
+
+
+bool hid_device::mouseReport(const uint16_t connHandle, const int8_t x, const int8_t y, const int8_t wheel, const int8_t pan)
+{
+    hid_mouse_report_t report = {
+        .buttons = _mouseButtons,
+        .x = x,
+        .y = y,
+        .wheel = wheel,
+        .pan = pan
+    };
+
+    if (isBootMode()) {
+        return bootMouseReport(connHandle, &report, sizeof(report));
+    }
+    return inputReport(connHandle, REPORT_ID_MOUSE, &report, sizeof(report));
+}
+
+
+bool hid_device::mouseButtonPress(const uint16_t connHandle, const uint8_t buttons)
+{
+    _mouseButtons |= buttons;
+    return mouseReport(connHandle, 0, 0, 0, 0);
+}
+
+
+bool hid_device::mouseButtonRelease(const uint16_t connHandle, const uint8_t buttons)
+{
+    _mouseButtons &= ~buttons;
+    return mouseReport(connHandle, 0, 0, 0, 0);
+}
+
+
+/**
+ * @brief 押下中のマウスボタン全体を指定して送信
+ */
+bool hid_device::mouseButtonReport(const uint16_t connHandle, const uint8_t buttons)
+{
+    _mouseButtons = buttons;
+    return mouseReport(connHandle, 0, 0, 0, 0);
+}
+
+
+bool hid_device::absoluteReport(const uint16_t connHandle, const uint16_t x, const uint16_t y)
+{
+#if ENABLE_ABSOLUTE_POINTER
+    absolute_report_t report = {
+        .buttons = _mouseButtons,
+        .x = x,
+        .y = y,
+    };
+    return inputReport(connHandle, REPORT_ID_ABSOLUTE, &report, sizeof(report));
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <bluefruit.h>
+
+#define ENABLE_ABSOLUTE_POINTER (1) ///< 絶対座標ポインタのレポートを持たせるか(変更時はホスト側で再ペアリングが必要)
+
+namespace ble
+{
+    /**
+     * @brief キーボード/マウス/絶対座標ポインタを持つHIDデバイス
+     * @details BLEHidAdafruitはレポート構成が固定のため、絶対座標ポインタを追加した独自のレポートマップで構成する。
+     *          レポートは全て接続ハンドルを指定して送信する。
+     */
+    class hid_device : public BLEHidGeneric
+    {
+    public:
+        enum ReportId
+        {
+            REPORT_ID_KEYBOARD = 1,
+            REPORT_ID_CONSUMER_CONTROL,
+            REPORT_ID_MOUSE,
+            REPORT_ID_ABSOLUTE,
+        };
+
+        /**
+         * @brief 絶対座標ポインタのレポート
+         */
+        struct __attribute__((packed)) absolute_report_t
+        {
+            uint8_t buttons;
+            uint16_t x; ///< 0 - ABSOLUTE_MAX
+            uint16_t y; ///< 0 - ABSOLUTE_MAX
+        };
+
+        static constexpr uint16_t ABSOLUTE_MAX = 0x7FFF; ///< 絶対座標の最大値
+
+        hid_device();
+
+        err_t begin();
+
+        bool keyboardReport(const uint16_t connHandle, const uint8_t modifier, const uint8_t keycode[6]);
+
+        bool mouseReport(const uint16_t connHandle, const int8_t x, const int8_t y, const int8_t wheel, const int8_t pan);
+        bool mouseButtonPress(const uint16_t connHandle, const uint8_t buttons);
+        bool mouseButtonRelease(const uint16_t connHandle, const uint8_t buttons);
+        bool mouseButtonReport(const uint16_t connHandle, const uint8_t buttons);
+        bool absoluteReport(const uint16_t connHandle, const uint16_t x, const uint16_t y);
+
+        /**
+         * @brief 押下中のマウスボタン
+         */
+        uint8_t getMouseButtons() const
+        {
+            return _mouseButtons;
+        }
+
+    private:
+        uint8_t _mouseButtons = 0;
+    };
+}
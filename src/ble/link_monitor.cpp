@@ -0,0 +1,230 @@
+#include <ble/link_monitor.h>
+#include <utils/debug.h>
+#include <utils/json_writer.h>
+
+using namespace ble;
+
+void link_monitor::init()
+{
+    for (auto& ctx : _links) {
+        ctx.connectionHandle = BLE_CONN_HANDLE_INVALID;
+    }
+    ble_link::addEventHandler(onEvent);
+}
+
+
+/**
+ * @brief 送信電力の範囲と目標RSSIを設定
+ * @param [in] minTxPower 最小送信電力(dBm)
+ * @param [in] maxTxPower 最大送信電力(dBm)。接続直後はこの値で送信する
+ * @param [in] targetRssi 目標RSSI(dBm)
+ * @param [in] isAdaptive falseなら常に最大送信電力
+ */
+void link_monitor::configure(const int8_t minTxPower, const int8_t maxTxPower, const int8_t targetRssi, const bool isAdaptive)
+{
+    _maxLevel = toLevel(maxTxPower);
+    _minLevel = min(toLevel(minTxPower), _maxLevel);
+    _targetRssi = targetRssi;
+    _isAdaptive = isAdaptive;
+
+    for (auto& ctx : _links) {
+        if (!ctx.isActive) {
+            continue;
+        }
+        ctx.txLevel = isAdaptive ? constrain(ctx.txLevel, _minLevel, _maxLevel) : _maxLevel;
+        applyTxPower(ctx);
+    }
+}
+
+
+/**
+ * @brief 接続の監視を開始
+ */
+void link_monitor::begin(const ble_link::Link link, const uint16_t connectionHandle)
+{
+    auto& ctx = _links[link];
+    ctx = Context{};
+    ctx.connectionHandle = connectionHandle;
+    ctx.txLevel = _maxLevel;
+    ctx.rssiX16 = _targetRssi * RSSI_SCALE;
+    ctx.lastEvaluateMs = millis();
+
+    auto connection = Bluefruit.Connection(connectionHandle);
+    if (connection) {
+        ctx.intervalUs = connection->getConnectionInterval() * 1250;
+        connection->monitorRssi();
+    }
+    applyTxPower(ctx);
+    ctx.isActive = true;
+}
+
+
+/**
+ * @brief 接続の監視を終了(切断時)
+ */
+void link_monitor::end(const ble_link::Link link)
+{
+    auto& ctx = _links[link];
+    ctx.isActive = false;
+    ctx.connectionHandle = BLE_CONN_HANDLE_INVALID;
+}
+
+
+void link_monitor::update(const ble_link::Link link)
+{
+    auto& ctx = _links[link];
+    if (!ctx.isActive) {
+        return ;
+    }
+
+    auto connection = Bluefruit.Connection(ctx.connectionHandle);
+    if (!connection || !connection->connected()) {
+        return ;
+    }
+
+    // RSSIは指数移動平均(1/4)でならす(端数を残すため固定小数点で持つ)
+    int16_t rssi = connection->getRssi();
+    if (rssi != 0) {
+        ctx.rssiX16 += (rssi * RSSI_SCALE - ctx.rssiX16) / 4;
+    }
+    ctx.intervalUs = connection->getConnectionInterval() * 1250;
+
+    auto now = millis();
+    if (!_isAdaptive || (now - ctx.lastEvaluateMs) < EVALUATE_PERIOD_MS) {
+        return ;
+    }
+    ctx.lastEvaluateMs = now;
+
+    uint32_t late = ctx.late;
+    auto newLate = late - ctx.lastLate;
+    auto newStalls = ctx.stalls - ctx.lastStalls;
+    ctx.lastLate = late;
+    ctx.lastStalls = ctx.stalls;
+
+    auto level = ctx.txLevel;
+    if (ctx.rssiX16 < (_targetRssi - RSSI_HYSTERESIS) * RSSI_SCALE || newLate > LATE_LIMIT || newStalls > 0) {
+        // 余裕がない
+        if (level < _maxLevel) {
+            level++;
+        }
+    } else if (ctx.rssiX16 > (_targetRssi + RSSI_HYSTERESIS) * RSSI_SCALE && newLate == 0) {
+        // 余裕がある
+        if (level > _minLevel) {
+            level--;
+        }
+    }
+
+    if (level != ctx.txLevel) {
+        ctx.txLevel = level;
+        applyTxPower(ctx);
+        DEBUG_PRINTF("link%d tx power %d dBm (rssi %d, late %d, stalls %d)", link, TX_LEVELS[level], getRssi(ctx), newLate, newStalls);
+    }
+}
+
+
+/**
+ * @brief 通知(レポート)を送信キューに積んだ結果を記録
+ * @param [in] link    リンク
+ * @param [in] success 積めたか
+ */
+void link_monitor::onSent(const ble_link::Link link, const bool success)
+{
+    auto& ctx = _links[link];
+    if (!ctx.isActive) {
+        return ;
+    }
+
+    if (!success) {
+        ctx.stalls++;
+        return ;
+    }
+
+    // BLEのタスクと共有するため割り込みを止めて更新
+    taskENTER_CRITICAL();
+    if (ctx.outstanding == 0) {
+        ctx.pendingSinceUs = micros();
+    }
+    ctx.outstanding++;
+    taskEXIT_CRITICAL();
+}
+
+
+size_t link_monitor::serializeStats(char* buffer, const size_t size)
+{
+    // [{"r":RSSI,"t":送信電力,"c":送信完了数,"l":遅れ回数,"s":詰まり回数}, ...] (リンクごと。未接続はnull)
+    utils::json_writer writer(buffer, size, 1);
+    writer.append("[");
+    for (int i = 0; i < ble_link::LINK_COUNT; i++) {
+        auto& ctx = _links[i];
+        if (!ctx.isActive) {
+            writer.append("%snull", (i == 0) ? "" : ",");
+            continue;
+        }
+        writer.append("%s{\"r\":%d,\"t\":%d,\"c\":%lu,\"l\":%lu,\"s\":%lu}",
+            (i == 0) ? "" : ",",
+            getRssi(ctx),
+            TX_LEVELS[ctx.txLevel],
+            (unsigned long)ctx.completed,
+            (unsigned long)ctx.late,
+            (unsigned long)ctx.stalls);
+    }
+    writer.close("]");
+    return writer.getLength();
+}
+
+
+/**
+ * @brief BLEイベント(BLEのタスクから呼ばれる)
+ */
+void link_monitor::onEvent(ble_evt_t* evt)
+{
+    if (evt->header.evt_id != BLE_GATTS_EVT_HVN_TX_COMPLETE) {
+        return ;
+    }
+
+    auto handle = evt->evt.gatts_evt.conn_handle;
+    for (auto& ctx : _links) {
+        if (!ctx.isActive || ctx.connectionHandle != handle) {
+            continue;
+        }
+
+        // 最も古い通知が完了するまでに接続間隔を何回も跨いだ=再送した(接続イベントを逃した)とみなす
+        auto now = micros();
+        if (ctx.outstanding > 0 && (now - ctx.pendingSinceUs) > (uint32_t)ctx.intervalUs * LATE_INTERVALS) {
+            ctx.late++;
+        }
+
+        auto count = evt->evt.gatts_evt.params.hvn_tx_complete.count;
+        ctx.completed += count;
+        ctx.outstanding = (ctx.outstanding > count) ? ctx.outstanding - count : 0;
+        ctx.pendingSinceUs = now;
+        break;
+    }
+}
+
+
+void link_monitor::applyTxPower(Context& ctx)
+{
+    if (ctx.connectionHandle == BLE_CONN_HANDLE_INVALID) {
+        return ;
+    }
+    auto err = sd_ble_gap_tx_power_set(BLE_GAP_TX_POWER_ROLE_CONN, ctx.connectionHandle, TX_LEVELS[ctx.txLevel]);
+    if (err != NRF_SUCCESS) {
+        DEBUG_PRINTF("set tx power failed 0x%x", err);
+    }
+}
+
+
+/**
+ * @brief 送信電力(dBm)をTX_LEVELSの添字に変換(指定値以下で最も近いもの)
+ */
+uint8_t link_monitor::toLevel(const int8_t dbm)
+{
+    uint8_t level = 0;
+    for (uint8_t i = 0; i < sizeof(TX_LEVELS) / sizeof(TX_LEVELS[0]); i++) {
+        if (TX_LEVELS[i] <= dbm) {
+            level = i;
+        }
+    }
+    return level;
+}
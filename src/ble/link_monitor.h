@@ -0,0 +1,80 @@
+#pragma once
+
+#include <bluefruit.h>
+#include <ble/ble_common.h>
+#include <ble/ble_link.h>
+
+namespace ble
+{
+    /**
+     * @brief 接続品質を監視して送信電力を調整するクラス
+     * @details 接続ごとにRSSI、通知の送信完了までの遅れ(再送で接続イベントを跨いだもの)、
+     *          送信キューの詰まり(通知を積めなかった回数)を集計する。
+     *          一定時間ごとに、RSSIが目標より十分高く遅れも詰まりもなければ送信電力を1段下げ、
+     *          RSSIが目標を下回るか遅れ/詰まりがあれば1段上げる(設定した範囲内)。
+     * @note RSSIはホストからの受信強度なので経路損失の目安として使う(送受の対称性を仮定)。
+     *       自分の送信電力を下げた影響は遅れ/詰まりの増加として戻ってくる。
+     *       接続間隔はconn_param_managerが管理しており、変更はセントラルに拒否されやすいのでここでは変えない。
+     */
+    class link_monitor
+    {
+    public:
+        link_monitor() = delete;
+
+        static void init();
+        static void configure(const int8_t minTxPower, const int8_t maxTxPower, const int8_t targetRssi, const bool isAdaptive);
+        static void begin(const ble_link::Link link, const uint16_t connectionHandle);
+        static void end(const ble_link::Link link);
+        static void update(const ble_link::Link link);
+        static void onSent(const ble_link::Link link, const bool success);
+        static size_t serializeStats(char* buffer, const size_t size);
+
+    private:
+        static constexpr uint32_t EVALUATE_PERIOD_MS = 2000; ///< 送信電力を見直す間隔
+        static constexpr int8_t RSSI_HYSTERESIS = 6;          ///< 目標RSSIからの不感帯(dB)
+        static constexpr uint8_t LATE_LIMIT = 2;              ///< 見直し間隔あたりに許容する遅れの回数
+        static constexpr uint8_t LATE_INTERVALS = 2;          ///< この接続間隔数を超えて完了した通知を遅れとする
+        static constexpr int8_t TX_LEVELS[] = {-40, -20, -16, -12, -8, -4, 0, 2, 3, 4, 5, 6, 7, 8}; ///< nRF52840の送信電力(dBm)
+
+        /**
+         * @brief 接続ごとの状態
+         */
+        struct Context
+        {
+            bool isActive;
+            volatile uint16_t connectionHandle;
+            volatile uint16_t intervalUs;       ///< 接続間隔(BLEのタスクから参照する)
+            volatile uint8_t outstanding;       ///< 送信完了待ちの通知数
+            volatile uint32_t pendingSinceUs;   ///< 最も古い送信完了待ちの通知を積んだ時刻
+            volatile uint32_t completed;        ///< 送信完了した通知数
+            volatile uint32_t late;             ///< 遅れて完了した回数
+            uint32_t stalls;                    ///< 送信キューに積めなかった回数
+            int16_t rssiX16;                    ///< RSSI(dBm×RSSI_SCALE、指数移動平均)
+            uint8_t txLevel;                    ///< 送信電力(TX_LEVELSの添字)
+            uint32_t lastEvaluateMs;
+            uint32_t lastLate;
+            uint32_t lastStalls;
+        };
+
+        static constexpr int16_t RSSI_SCALE = 16; ///< 平均の端数を残す倍率(整数で1/4ずつ近づけると最大3dB手前で止まるため)
+
+        static inline Context _links[ble_link::LINK_COUNT] = {};
+        static inline uint8_t _minLevel = 0;
+        static inline uint8_t _maxLevel = 0;
+        static inline int8_t _targetRssi = -70;
+        static inline bool _isAdaptive = true;
+
+        static void onEvent(ble_evt_t* evt);
+        static void applyTxPower(Context& ctx);
+        static uint8_t toLevel(const int8_t dbm);
+
+        /**
+         * @brief 平均したRSSI(dBm、四捨五入)
+         */
+        static int16_t getRssi(const Context& ctx)
+        {
+            auto half = (ctx.rssiX16 < 0) ? -RSSI_SCALE / 2 : RSSI_SCALE / 2;
+            return (ctx.rssiX16 + half) / RSSI_SCALE;
+        }
+    };
+}
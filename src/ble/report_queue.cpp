@@ -0,0 +1,207 @@
+#include <ble/report_queue.h>
+#include <utils/debug.h>
+#include <utils/json_writer.h>
+
+using namespace ble;
+
+/**
+ * @brief 保持時間を設定
+ * @param [in] keyKeepMs    キー/ボタンのレポートを保持する時間(0なら溜めない)
+ * @param [in] motionKeepMs カーソル移動/スクロールを保持する時間(0なら溜めない)
+ */
+void report_queue::configure(const uint16_t keyKeepMs, const uint16_t motionKeepMs)
+{
+    _keyKeepMs = keyKeepMs;
+    _motionKeepMs = motionKeepMs;
+}
+
+
+/**
+ * @brief キーボードのレポートを溜める
+ * @retval false 溜めない設定
+ */
+bool report_queue::pushKeyboard(const uint8_t modifier, const uint8_t (&scancodes)[6])
+{
+    auto entry = push(KEYBOARD);
+    if (!entry) {
+        return false;
+    }
+    entry->keyboard.modifier = modifier;
+    memcpy(entry->keyboard.scancodes, scancodes, sizeof(scancodes));
+    return true;
+}
+
+
+/**
+ * @brief マウスボタンのレポートを溜める
+ * @param [in] buttons 押下中のボタン全体
+ * @retval false 溜めない設定
+ */
+bool report_queue::pushButtons(const uint8_t buttons)
+{
+    auto entry = push(BUTTONS);
+    if (!entry) {
+        return false;
+    }
+    entry->buttons = buttons;
+    return true;
+}
+
+
+/**
+ * @brief カーソル移動/スクロールを溜める(末尾が移動なら積算)
+ * @retval false 溜めない設定
+ */
+bool report_queue::pushMotion(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal)
+{
+    if (_motionKeepMs == 0) {
+        return false;
+    }
+
+    auto entry = back();
+    if (entry && entry->type == MOTION) {
+        entry->timeMs = millis();
+    } else {
+        entry = push(MOTION);
+        if (!entry) {
+            return false;
+        }
+        entry->motion = {};
+    }
+
+    auto add = [](int16_t& total, const int8_t value) {
+        total = constrain(total + value, INT16_MIN, INT16_MAX);
+    };
+    add(entry->motion.x, x);
+    add(entry->motion.y, y);
+    add(entry->motion.vertical, vertical);
+    add(entry->motion.horizontal, horizontal);
+    _queued++;
+    return true;
+}
+
+
+/**
+ * @brief 絶対座標を溜める(末尾が絶対座標なら上書き)
+ * @retval false 溜めない設定
+ */
+bool report_queue::pushAbsolute(const uint16_t x, const uint16_t y)
+{
+    if (_motionKeepMs == 0) {
+        return false;
+    }
+
+    auto entry = back();
+    if (entry && entry->type == ABSOLUTE) {
+        entry->timeMs = millis();
+    } else {
+        entry = push(ABSOLUTE);
+        if (!entry) {
+            return false;
+        }
+    }
+    entry->absolute.x = x;
+    entry->absolute.y = y;
+    _queued++;
+    return true;
+}
+
+
+/**
+ * @brief 先頭のレポート(保持時間を過ぎたものは捨てる)
+ * @return レポート。空ならnullptr
+ * @note 移動は送信した分を差し引いて、残りがあればpop()せずにおく
+ */
+report_queue::Entry* report_queue::front()
+{
+    discardExpired();
+    return _count ? &_entries[_head] : nullptr;
+}
+
+
+void report_queue::pop()
+{
+    if (_count == 0) {
+        return ;
+    }
+    _head = (_head + 1) % CAPACITY;
+    _count--;
+}
+
+
+void report_queue::clear()
+{
+    _dropped += _count;
+    _head = 0;
+    _count = 0;
+}
+
+
+/**
+ * @brief 計測値をJSONにシリアライズ
+ * @details {"n":溜めた数,"r":再生した数,"d":捨てた数,"q":残り}
+ * @return 書き込んだサイズ(終端文字を含まない)
+ */
+size_t report_queue::serializeStats(char* buffer, const size_t size)
+{
+    utils::json_writer writer(buffer, size, 0);
+    writer.append("{\"n\":%lu,\"r\":%lu,\"d\":%lu,\"q\":%u}",
+        (unsigned long)_queued,
+        (unsigned long)_replayed,
+        (unsigned long)_dropped,
+        (unsigned)_count);
+    return writer.getLength();
+}
+
+
+/**
+ * @brief 末尾に1件追加する(満杯なら先頭を捨てる)
+ * @return 追加した件。溜めない設定ならnullptr
+ */
+report_queue::Entry* report_queue::push(const Type type)
+{
+    auto keepMs = isMotion(type) ? _motionKeepMs : _keyKeepMs;
+    if (keepMs == 0) {
+        return nullptr;
+    }
+
+    discardExpired();
+    if (_count == CAPACITY) {
+        pop();
+        _dropped++;
+    }
+
+    auto& entry = _entries[(_head + _count) % CAPACITY];
+    _count++;
+    entry.timeMs = millis();
+    entry.type = type;
+    if (!isMotion(type)) {
+        _queued++;
+    }
+    return &entry;
+}
+
+
+report_queue::Entry* report_queue::back()
+{
+    return _count ? &_entries[(_head + _count - 1) % CAPACITY] : nullptr;
+}
+
+
+/**
+ * @brief 保持時間を過ぎたレポートを先頭から捨てる
+ * @details 積んだ順に古いので、先頭が保持時間内になったところでやめる
+ */
+void report_queue::discardExpired()
+{
+    auto now = millis();
+    while (_count) {
+        auto& entry = _entries[_head];
+        auto keepMs = isMotion(entry.type) ? _motionKeepMs : _keyKeepMs;
+        if ((now - entry.timeMs) <= keepMs) {
+            break;
+        }
+        pop();
+        _dropped++;
+    }
+}
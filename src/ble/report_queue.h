@@ -0,0 +1,92 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace ble
+{
+    /**
+     * @brief 未接続の間のレポートを溜めておく固定長のキュー
+     * @details キーボード/マウスボタンのレポートは押下状態全体をそのまま1件ずつ、
+     *          カーソル移動/スクロールは末尾の1件に積算して溜める(キー/ボタンのレポートを挟むと次の件になるため順序は保つ)。
+     *          満杯なら古いものから捨てる。レポートは押下状態全体なので、古い側を捨てても最後の状態は正しい。
+     *          種類ごとの保持時間を過ぎたものは積むとき/取り出すときに捨てる。
+     */
+    class report_queue
+    {
+    public:
+        /**
+         * @brief レポートの種類
+         */
+        enum Type : uint8_t
+        {
+            KEYBOARD = 0, ///< キーボード(修飾キー+キーコード6個)
+            BUTTONS,      ///< マウスボタン(押下中のボタン全体)
+            MOTION,       ///< カーソル移動/スクロール(積算)
+            ABSOLUTE,     ///< 絶対座標(最後の値)
+        };
+
+        /**
+         * @brief 溜めたレポート
+         */
+        struct Entry
+        {
+            uint32_t timeMs; ///< 最後に積んだ時刻
+            Type type;
+            union
+            {
+                struct { uint8_t modifier; uint8_t scancodes[6]; } keyboard;
+                uint8_t buttons;
+                struct { int16_t x; int16_t y; int16_t vertical; int16_t horizontal; } motion;
+                struct { uint16_t x; uint16_t y; } absolute;
+            };
+        };
+
+        static constexpr size_t CAPACITY = 64;
+
+        report_queue() = delete;
+
+        static void configure(const uint16_t keyKeepMs, const uint16_t motionKeepMs);
+        static bool pushKeyboard(const uint8_t modifier, const uint8_t (&scancodes)[6]);
+        static bool pushButtons(const uint8_t buttons);
+        static bool pushMotion(const int8_t x, const int8_t y, const int8_t vertical, const int8_t horizontal);
+        static bool pushAbsolute(const uint16_t x, const uint16_t y);
+        static Entry* front();
+        static void pop();
+        static void clear();
+
+        static bool isEmpty()
+        {
+            return _count == 0;
+        }
+
+        /**
+         * @brief 再生したレポート数を記録
+         */
+        static void replayed()
+        {
+            _replayed++;
+        }
+
+        static size_t serializeStats(char* buffer, const size_t size);
+
+    private:
+        static inline Entry _entries[CAPACITY] = {};
+        static inline size_t _head = 0;
+        static inline size_t _count = 0;
+        static inline uint16_t _keyKeepMs = 0;
+        static inline uint16_t _motionKeepMs = 0;
+
+        static inline uint32_t _queued = 0;   ///< 溜めたレポート数
+        static inline uint32_t _replayed = 0; ///< 再生したレポート数
+        static inline uint32_t _dropped = 0;  ///< 満杯/保持時間切れで捨てたレポート数
+
+        static Entry* push(const Type type);
+        static Entry* back();
+        static void discardExpired();
+
+        static bool isMotion(const Type type)
+        {
+            return type == MOTION || type == ABSOLUTE;
+        }
+    };
+}
@@ -18,6 +18,74 @@
  */
 
 
+/**
+ * @brief ジャンプモードで使う画面上の領域(絶対座標 0 - 32767)
+ */
+struct JumpRegion
+{
+    uint16_t x = 0;
+    uint16_t y = 0;
+    uint16_t width = 32767;
+    uint16_t height = 32767;
+};
+
+
+/**
+ * @brief スキャン/レポート周期の段階切り替え設定(NORMALの周期はrepo_ms)
+ */
+struct RateGovernorConfig
+{
+    uint16_t burstMs = 5;          ///< BURST(操作中)の周期
+    uint16_t idleMs = 50;          ///< IDLE(しばらく操作なし)の周期
+    uint16_t burstQuietMs = 200;   ///< BURSTからNORMALに下げるまでの無操作時間
+    uint16_t normalQuietMs = 2000; ///< NORMALからIDLEに下げるまでの無操作時間
+};
+
+
+/**
+ * @brief 接続品質に応じた送信電力の調整設定(最大はtx_power)
+ */
+struct LinkMonitorConfig
+{
+    int8_t minTxPower = -20; ///< 最小送信電力(dBm)
+    int8_t targetRssi = -70; ///< 目標RSSI(dBm)
+    uint8_t isAdaptive = 1;  ///< 0なら常にtx_powerで送信
+};
+
+
+/**
+ * @brief 未接続(再接続/復帰中)の入力を溜めておく設定
+ */
+struct ReportBufferConfig
+{
+    uint16_t keyKeepMs = 10000;  ///< キー/ボタンを保持する時間(0なら溜めない)
+    uint16_t motionKeepMs = 300; ///< カーソル移動/スクロールを保持する時間(0なら溜めない)
+};
+
+
+/**
+ * @brief 無操作時間の傾向からスリープを決める設定
+ */
+struct SleepPolicyConfig
+{
+    uint8_t isAdaptive = 1;        ///< 0ならlightsleep_timeoutとスレーブレイテンシ30で固定
+    uint16_t latencyWeight = 100;  ///< 遅延1msを何uA・sとみなすか(大きいほど遅延を避ける)
+};
+
+
+/**
+ * @brief 消費電荷の見積もりに使う電流(モデル値)
+ */
+struct PowerModelConfig
+{
+    uint16_t activeUa = 1000;      ///< 起動中の平均電流(uA)
+    uint16_t lightSleepUa = 20;    ///< LightSleep中の電流(uA)
+    uint16_t advertisingUa = 300;  ///< アドバタイズ1本の平均電流(uA)
+    uint16_t connectedUa = 300;    ///< 接続1本を維持する平均電流(uA)
+    uint16_t reportNc = 2000;      ///< 1レポートの電荷(nC = uA・ms)
+};
+
+
 /**
  * @brief グローバル設定を保持するクラス。設定値はFlashから読み込む
  *
@@ -80,6 +148,14 @@ public:
         return _lightSleepTimeoutMs;
     }
 
+    /**
+     * @brief LEDの明るさ(%)
+     */
+    uint8_t inline getLedBrightness() const
+    {
+        return _ledBrightness;
+    }
+
     int8_t inline getTxPower() const
     {
         return _txPower;
@@ -100,6 +176,78 @@ public:
         return _mouseReportIntervalMs;
     }
 
+    /**
+     * @brief 回転ホイールの1周あたりのスクロール量。0なら従来の倒し量によるスクロール
+     */
+    uint16_t inline getWheelUnitsPerRevolution() const
+    {
+        return _wheelUnitsPerRevolution;
+    }
+
+    /**
+     * @brief ジャンプモード(絶対座標)にするボタン(Input)。0なら無効
+     */
+    uint16_t inline getJumpButton() const
+    {
+        return _jumpButton;
+    }
+
+    /**
+     * @brief キーボードレイヤでナビゲーションモードを切り替える同時押し(Input)。0なら無効
+     */
+    uint16_t inline getNavigationChord() const
+    {
+        return _navigationChord;
+    }
+
+    /**
+     * @brief ジャンプモードでジョイスティックの可動範囲を割り当てる画面上の領域
+     */
+    const JumpRegion& getJumpRegion() const
+    {
+        return _jumpRegion;
+    }
+
+    /**
+     * @brief スキャン/レポート周期の段階切り替え設定
+     */
+    const RateGovernorConfig& getRateGovernor() const
+    {
+        return _rateGovernor;
+    }
+
+    /**
+     * @brief 接続品質に応じた送信電力の調整設定
+     */
+    const LinkMonitorConfig& getLinkMonitor() const
+    {
+        return _linkMonitor;
+    }
+
+    /**
+     * @brief 未接続の入力を溜めておく設定
+     */
+    const ReportBufferConfig& getReportBuffer() const
+    {
+        return _reportBuffer;
+    }
+
+    /**
+     * @brief 無操作時間の傾向からスリープを決める設定
+     */
+    const SleepPolicyConfig& getSleepPolicy() const
+    {
+        return _sleepPolicy;
+    }
+
+    /**
+     * @brief 消費電荷の見積もりに使う電流
+     */
+    const PowerModelConfig& getPowerModel() const
+    {
+        return _powerModel;
+    }
+
     
     uint16_t inline serialize(uint8_t *buffer) const
     {
@@ -138,7 +286,8 @@ public:
 
 private:
     constexpr static int CONFIG_VERSION = 1;
-    constexpr static int BUFSIZE = 512; /// < 設定が増えてきたら調整
+    constexpr static uint16_t DEFAULT_NAVIGATION_CHORD = 0x1F; ///< B1-B2-B3-B4-MB1(全ボタン同時押し)
+    constexpr static int BUFSIZE = 768; /// < 設定が増えてきたら調整
 
     uint32_t _version = CONFIG_VERSION;
     uint32_t _chordScanTimeoutMs = 150;
@@ -148,10 +297,20 @@ private:
     uint8_t _joystickYDeadband = 5;
     uint8_t _mouseNegativeGain = 2;
     int8_t _txPower = 4;
+    uint8_t _ledBrightness = 8;
     uint16_t _connectionIntervalMin = 6;
     uint16_t _connectionIntervalMax = 9;
     uint32_t _mouseReportIntervalMs = 10;
     float  _mickeyScale = 0.045f;
+    uint16_t _wheelUnitsPerRevolution = 0;
+    uint16_t _jumpButton = 0;
+    JumpRegion _jumpRegion;
+    uint16_t _navigationChord = DEFAULT_NAVIGATION_CHORD;
+    RateGovernorConfig _rateGovernor;
+    LinkMonitorConfig _linkMonitor;
+    ReportBufferConfig _reportBuffer;
+    SleepPolicyConfig _sleepPolicy;
+    PowerModelConfig _powerModel;
 
     void toJson(JsonVariant j) const
     {
@@ -164,9 +323,39 @@ private:
         j["mouse_negative_gain"] = _mouseNegativeGain;
         j["mickey_scale"] = _mickeyScale;
         j["tx_power"] = _txPower;
+        j["led_bri"] = _ledBrightness;
         j["conn_interval_min"] = _connectionIntervalMin;
         j["conn_interval_max"] = _connectionIntervalMax;
         j["repo_ms"] = _mouseReportIntervalMs;
+        j["wheel_upr"] = _wheelUnitsPerRevolution;
+        j["jump_btn"] = _jumpButton;
+        j["nav_chord"] = _navigationChord;
+        auto region = j.createNestedArray("jump_rgn");
+        region.add(_jumpRegion.x);
+        region.add(_jumpRegion.y);
+        region.add(_jumpRegion.width);
+        region.add(_jumpRegion.height);
+        auto gov = j.createNestedArray("gov");
+        gov.add(_rateGovernor.burstMs);
+        gov.add(_rateGovernor.idleMs);
+        gov.add(_rateGovernor.burstQuietMs);
+        gov.add(_rateGovernor.normalQuietMs);
+        auto lnk = j.createNestedArray("lnk");
+        lnk.add(_linkMonitor.minTxPower);
+        lnk.add(_linkMonitor.targetRssi);
+        lnk.add(_linkMonitor.isAdaptive);
+        auto buf = j.createNestedArray("buf");
+        buf.add(_reportBuffer.keyKeepMs);
+        buf.add(_reportBuffer.motionKeepMs);
+        auto slp = j.createNestedArray("slp");
+        slp.add(_sleepPolicy.isAdaptive);
+        slp.add(_sleepPolicy.latencyWeight);
+        auto pwr = j.createNestedArray("pwr");
+        pwr.add(_powerModel.activeUa);
+        pwr.add(_powerModel.lightSleepUa);
+        pwr.add(_powerModel.advertisingUa);
+        pwr.add(_powerModel.connectedUa);
+        pwr.add(_powerModel.reportNc);
     }
 
     void fromJson(JsonVariantConst j)
@@ -180,8 +369,38 @@ private:
         _mouseNegativeGain = j["mouse_negative_gain"].as<uint8_t>();
         _mickeyScale = j["mickey_scale"].as<float>();
         _txPower = j["tx_power"].as<int8_t>();
+        _ledBrightness = j["led_bri"] | 8;
         _connectionIntervalMin = j["conn_interval_min"].as<uint16_t>();
         _connectionIntervalMax = j["conn_interval_max"].as<uint16_t>();
         _mouseReportIntervalMs = j["repo_ms"].as<uint32_t>();
+        _wheelUnitsPerRevolution = j["wheel_upr"].as<uint16_t>();
+        _jumpButton = j["jump_btn"].as<uint16_t>();
+        _navigationChord = j["nav_chord"] | DEFAULT_NAVIGATION_CHORD;
+        JumpRegion region;
+        _jumpRegion.x = j["jump_rgn"][0] | region.x;
+        _jumpRegion.y = j["jump_rgn"][1] | region.y;
+        _jumpRegion.width = j["jump_rgn"][2] | region.width;
+        _jumpRegion.height = j["jump_rgn"][3] | region.height;
+        RateGovernorConfig gov;
+        _rateGovernor.burstMs = j["gov"][0] | gov.burstMs;
+        _rateGovernor.idleMs = j["gov"][1] | gov.idleMs;
+        _rateGovernor.burstQuietMs = j["gov"][2] | gov.burstQuietMs;
+        _rateGovernor.normalQuietMs = j["gov"][3] | gov.normalQuietMs;
+        LinkMonitorConfig lnk;
+        _linkMonitor.minTxPower = j["lnk"][0] | lnk.minTxPower;
+        _linkMonitor.targetRssi = j["lnk"][1] | lnk.targetRssi;
+        _linkMonitor.isAdaptive = j["lnk"][2] | lnk.isAdaptive;
+        ReportBufferConfig buf;
+        _reportBuffer.keyKeepMs = j["buf"][0] | buf.keyKeepMs;
+        _reportBuffer.motionKeepMs = j["buf"][1] | buf.motionKeepMs;
+        SleepPolicyConfig slp;
+        _sleepPolicy.isAdaptive = j["slp"][0] | slp.isAdaptive;
+        _sleepPolicy.latencyWeight = j["slp"][1] | slp.latencyWeight;
+        PowerModelConfig pwr;
+        _powerModel.activeUa = j["pwr"][0] | pwr.activeUa;
+        _powerModel.lightSleepUa = j["pwr"][1] | pwr.lightSleepUa;
+        _powerModel.advertisingUa = j["pwr"][2] | pwr.advertisingUa;
+        _powerModel.connectedUa = j["pwr"][3] | pwr.connectedUa;
+        _powerModel.reportNc = j["pwr"][4] | pwr.reportNc;
     }
 };
\ No newline at end of file
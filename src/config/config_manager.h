@@ -1,10 +1,15 @@
 #pragma once
 
 #include <utils/internal_fs.h>
+#include <utils/retained_ram.h>
+#include <utils/energy_meter.h>
+#include <type_traits>
 
 #include <config/config.h>
 #include <config/key_profile.h>
 #include <config/calibration.h>
+#include <config/peer_table.h>
+#include <config/idle_histogram.h>
 #include <alias.h>
 #include <utils/debug.h>
 
@@ -29,6 +34,16 @@ public:
         return _calibration;
     }
 
+    static inline const peer_table& getPeerTable()
+    {
+        return _peerTable;
+    }
+
+    static inline const idle_histogram& getIdleHistogram()
+    {
+        return _idleHistogram;
+    }
+
     static inline void init()
     {
         // 初回は失敗するのでデフォルト値を設定して保存しておく
@@ -51,16 +66,179 @@ public:
             calibration calib {{}, joystick::getX(), joystick::getY()};
             saveCalibration(calib);
         }
+
+        // 接続先は接続したときに登録する
+        if (!loadFrom(PEER_TABLE_FILENAME, _peerTable))
+        {
+            _peerTable = peer_table{};
+        }
+
+        // 無操作時間は使いながら記録する
+        if (!loadFrom(IDLE_HISTOGRAM_FILENAME, _idleHistogram))
+        {
+            _idleHistogram = idle_histogram{};
+        }
+    }
+
+    /**
+     * @brief DeepSleep前に保持したRAMから設定を復元する(Flashを読まない)
+     * @param [out] layer DeepSleep前のレイヤ
+     * @retval true  復元した
+     * @retval false 保持した内容がない/壊れている(init()で読み込むこと)
+     * @note 一度復元したら無効にする(次のDeepSleep前にretain()で保持し直す)
+     */
+    static inline bool restore(uint8_t& layer)
+    {
+        const uint8_t* p;
+        auto size = utils::retained_ram::read(p);
+        utils::retained_ram::invalidate();
+        if (size == 0) {
+            return false;
+        }
+        if (!restoreFrom(p, size, layer)) {
+            // 設定などはinit()でFlashから読み直すが、消費電荷の積算値は読み直さないので途中まで上書きした値を捨てる
+            utils::energy_meter::reset();
+            return false;
+        }
+        return true;
+    }
+
+
+    /**
+     * @brief 設定をDeepSleep中も保持するRAMに書き込む
+     * @param [in] layer 現在のレイヤ
+     * @note 未保存の設定はflush()してから呼ぶこと(復帰後は保持した内容を正とする)
+     */
+    static inline void retain(const uint8_t layer)
+    {
+        // 設定はJSONにせずそのままコピーする(復帰時にパースしない)
+        static_assert(std::is_trivially_copyable<config>::value, "config must be trivially copyable");
+
+        uint8_t buffer[utils::retained_ram::CAPACITY];
+        size_t size = sizeof(uint8_t) + sizeof(config) + _calibration.getSerializedSize()
+            + _peerTable.getSerializedSize() + _idleHistogram.getSerializedSize() + utils::energy_meter::getSerializedSize()
+            + _keyProfiles.getSerializedSize();
+        if (size > sizeof(buffer)) {
+            DEBUG_PRINTF("retain too large %d", size);
+            utils::retained_ram::invalidate();
+            return ;
+        }
+
+        uint8_t* p = buffer;
+        *p++ = layer;
+        memcpy(p, &_config, sizeof(config));
+        p += sizeof(config);
+        p += _calibration.serialize(p);
+        p += _peerTable.serialize(p);
+        p += _idleHistogram.serialize(p);
+        p += utils::energy_meter::serialize(p);
+        p += _keyProfiles.serialize(p);
+        utils::retained_ram::write(buffer, p - buffer);
     }
 
     static inline void saveConfig(const config& config) { saveTo(CONFIG_FILENAME, config, _config); }
     static inline void saveKeyProfiles(const key_profiles& profs)  { saveTo(KEY_PROFILE_FILENAME, profs, _keyProfiles); }
     static inline void saveCalibration(const calibration& calib) { saveTo(CALIBRATION_FILENAME, calib, _calibration); } 
 
+    /**
+     * @brief 設定をメモリ上だけ更新する
+     * @note Flashへの書き込みはflush()で行う
+     */
+    static inline void updateConfig(const config& config) { _config = config; _isConfigDirty = true; }
+    static inline void updateKeyProfiles(const key_profiles& profs) { _keyProfiles = profs; _isKeyProfilesDirty = true; }
+
+    /**
+     * @brief 接続先の識別情報をメモリ上だけ更新する
+     * @retval true  変更した(flush()で保存される)
+     * @retval false 登録済みと同じ
+     */
+    static inline bool updatePeer(const uint8_t seed, const ble_gap_id_key_t& identity)
+    {
+        auto changed = _peerTable.update(seed, identity);
+        _isPeerTableDirty |= changed;
+        return changed;
+    }
+
+    /**
+     * @brief 無操作時間をメモリ上のヒストグラムに記録する
+     * @note Flashへの書き込みはflush()でIDLE_HISTOGRAM_SAVE_SAMPLES回分ごとにまとめて行う
+     */
+    static inline void recordIdleGap(const uint32_t gapMs)
+    {
+        if (_idleHistogram.record(gapMs)) {
+            _idleHistogramUnsaved++;
+        }
+    }
+
+    /**
+     * @brief 未保存の設定をFlashに書き込む
+     * @param [in] force 無操作時間のヒストグラムも溜まった回数に関わらず書き込む
+     */
+    static inline void flush(const bool force=false)
+    {
+        if (_isConfigDirty) {
+            _isConfigDirty = false;
+            fs::save(CONFIG_FILENAME, _config);
+        }
+        if (_isKeyProfilesDirty) {
+            _isKeyProfilesDirty = false;
+            fs::save(KEY_PROFILE_FILENAME, _keyProfiles);
+        }
+        if (_isPeerTableDirty) {
+            _isPeerTableDirty = false;
+            fs::save(PEER_TABLE_FILENAME, _peerTable);
+        }
+        if (_idleHistogramUnsaved >= (force ? 1 : IDLE_HISTOGRAM_SAVE_SAMPLES)) {
+            _idleHistogramUnsaved = 0;
+            fs::save(IDLE_HISTOGRAM_FILENAME, _idleHistogram);
+        }
+    }
+
 private:
+    /**
+     * @brief 保持したRAMの内容を展開する
+     * @retval false 途中で足りなくなった(展開済みの分は上書きされている)
+     */
+    static inline bool restoreFrom(const uint8_t* p, const size_t size, uint8_t& layer)
+    {
+        auto end = p + size;
+
+        // [レイヤ][設定][キャリブレーション][接続先][無操作時間][消費電荷の積算値][キープロファイル]
+        layer = *p++;
+        if ((size_t)(end - p) < sizeof(config)) {
+            return false;
+        }
+        memcpy(&_config, p, sizeof(config));
+        p += sizeof(config);
+        if (!_calibration.deserialize(p, end - p)) {
+            return false;
+        }
+        p += _calibration.getSerializedSize();
+        if (!_peerTable.deserialize(p, end - p)) {
+            return false;
+        }
+        p += _peerTable.getSerializedSize();
+        if (!_idleHistogram.deserialize(p, end - p)) {
+            return false;
+        }
+        p += _idleHistogram.getSerializedSize();
+        if (!utils::energy_meter::deserialize(p, end - p)) {
+            return false;
+        }
+        p += utils::energy_meter::getSerializedSize();
+        return _keyProfiles.deserialize(p, end - p);
+    }
+
     static inline config _config{};
     static inline key_profiles _keyProfiles{};
     static inline calibration _calibration{{}, 0, 0};
+    static inline bool _isConfigDirty = false;
+    static inline peer_table _peerTable{};
+    static inline bool _isKeyProfilesDirty = false;
+    static inline bool _isPeerTableDirty = false;
+    static inline idle_histogram _idleHistogram{};
+    static inline uint8_t _idleHistogramUnsaved = 0;
+    static constexpr uint8_t IDLE_HISTOGRAM_SAVE_SAMPLES = 16; ///< 無操作時間をこの回数記録するごとに保存する(Flashの書き換えを減らす)
 
     static config DEFAULT_CONFIG;
     static key_profile DEFAULT_KEY_PROFILES[2];
@@ -68,6 +246,8 @@ private:
     constexpr static char CONFIG_FILENAME[] = "/config";
     constexpr static char CALIBRATION_FILENAME[] = "/calib";
     constexpr static char KEY_PROFILE_FILENAME[] = "/key_profiles";
+    constexpr static char PEER_TABLE_FILENAME[] = "/peers";
+    constexpr static char IDLE_HISTOGRAM_FILENAME[] = "/idle_hist";
 
     template <typename T>
     static inline bool loadFrom(const char* filename, T& out)
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <utils/serializable.h>
+
+/**
+ * @brief 無操作時間(操作と操作の間隔)のヒストグラム
+ * @details 区間は対数的に取り、最後の区間は上限なし。
+ *          合計がDECAY_TOTALに達したら全区間を半分にして、最近の使い方を重く見る。
+ */
+struct idle_histogram : serializable<idle_histogram>
+{
+    static constexpr size_t BIN_COUNT = 12;
+    static constexpr uint32_t MIN_GAP_MS = 1000;  ///< これより短い間隔は連続した操作として数えない
+    static constexpr uint32_t DECAY_TOTAL = 1000;
+
+    /// 区間の上限(ms)。最後の区間は上限なし
+    static constexpr uint32_t BIN_UPPER_MS[BIN_COUNT] = {
+        2000, 5000, 10000, 20000, 30000, 60000, 120000, 300000, 600000, 1200000, 1800000, UINT32_MAX
+    };
+
+    uint16_t counts[BIN_COUNT] = {};
+
+
+    /**
+     * @brief 無操作時間を記録する
+     * @param [in] gapMs 無操作時間(ms)
+     * @retval true  記録した
+     * @retval false 短すぎるので記録しない
+     */
+    bool record(const uint32_t gapMs)
+    {
+        if (gapMs < MIN_GAP_MS) {
+            return false;
+        }
+
+        size_t bin = 0;
+        while (bin < BIN_COUNT - 1 && gapMs >= BIN_UPPER_MS[bin]) {
+            bin++;
+        }
+        counts[bin]++;
+
+        if (total() >= DECAY_TOTAL) {
+            for (auto& count : counts) {
+                count /= 2;
+            }
+        }
+        return true;
+    }
+
+
+    uint32_t total() const
+    {
+        uint32_t sum = 0;
+        for (auto count : counts) {
+            sum += count;
+        }
+        return sum;
+    }
+
+
+    /**
+     * @brief 区間の代表値(ms)
+     * @details 区間の中央。上限なしの区間は下限の2倍
+     */
+    static uint32_t representativeMs(const size_t bin)
+    {
+        uint32_t lower = (bin == 0) ? MIN_GAP_MS : BIN_UPPER_MS[bin - 1];
+        if (bin == BIN_COUNT - 1) {
+            return lower * 2;
+        }
+        return lower + (BIN_UPPER_MS[bin] - lower) / 2;
+    }
+
+
+    /**
+     * @brief シリアライズ時のサイズを取得
+     * @return サイズ
+     */
+    uint16_t inline getSerializedSize() const
+    {
+        return sizeof(idle_histogram);
+    }
+
+    /**
+     * @brief シリアライズする
+     * @param [out] buffer 出力バッファ
+     * @note 出力バッファのサイズはgetSerializedSize()で取得
+     */
+    uint16_t inline serialize(uint8_t *buffer) const
+    {
+        auto size = getSerializedSize();
+        memcpy(buffer, this, size);
+        return size;
+    }
+
+
+    /**
+     * @brief デシリアライズする
+     * @param [in] buffer 入力バッファ
+     */
+    bool inline deserialize(const uint8_t *buffer, const uint16_t buffSize)
+    {
+        auto size = getSerializedSize();
+        if (buffSize < size) {
+            return false;
+        }
+
+        idle_histogram histogram;
+        memcpy(&histogram, buffer, size);
+        *this = histogram;
+        return true;
+    }
+};
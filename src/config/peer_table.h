@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <bluefruit.h>
+#include <utils/serializable.h>
+
+/**
+ * @brief 接続先(セントラル)のアドレス表
+ * @details 自分のアドレスの種(接続先の番号)ごとに、最後に接続したセントラルの識別情報(IRKと識別アドレス)を覚えておく。
+ *          再接続時の指向性アドバタイズの宛先に使う(RPAは変わるので接続時のアドレスは覚えない)。
+ */
+struct peer_table : serializable<peer_table>
+{
+    static constexpr size_t MAX_PEERS = 4;
+
+    struct Peer
+    {
+        uint8_t seed;           ///< 自分のアドレスの種
+        bool isValid;
+        ble_gap_id_key_t identity; ///< セントラルの識別情報
+    };
+
+    Peer peers[MAX_PEERS] = {};
+
+
+    /**
+     * @brief 接続先の識別情報を探す
+     * @param [in] seed 自分のアドレスの種
+     * @return 識別情報。なければnullptr
+     */
+    const ble_gap_id_key_t* find(const uint8_t seed) const
+    {
+        for (auto& peer : peers) {
+            if (peer.isValid && peer.seed == seed) {
+                return &peer.identity;
+            }
+        }
+        return nullptr;
+    }
+
+
+    /**
+     * @brief 接続先の識別情報を登録する
+     * @details 空きがなければ先頭のエントリを上書きする
+     * @param [in] seed     自分のアドレスの種
+     * @param [in] identity セントラルの識別情報
+     * @retval true  変更した(保存が必要)
+     * @retval false 登録済みと同じ
+     */
+    bool update(const uint8_t seed, const ble_gap_id_key_t& identity)
+    {
+        Peer* target = nullptr;
+        for (auto& peer : peers) {
+            if (peer.isValid && peer.seed == seed) {
+                target = &peer;
+                break;
+            }
+            if (!peer.isValid && !target) {
+                target = &peer;
+            }
+        }
+        if (!target) {
+            target = &peers[0];
+        }
+
+        if (target->isValid && target->seed == seed && memcmp(&target->identity, &identity, sizeof(ble_gap_id_key_t)) == 0) {
+            return false;
+        }
+        *target = Peer{seed, true, identity};
+        return true;
+    }
+
+
+    /**
+     * @brief シリアライズ時のサイズを取得
+     * @return サイズ
+     */
+    uint16_t inline getSerializedSize() const
+    {
+        return sizeof(peer_table);
+    }
+
+    /**
+     * @brief シリアライズする
+     * @param [out] buffer 出力バッファ
+     * @note 出力バッファのサイズはgetSerializedSize()で取得
+     */
+    uint16_t inline serialize(uint8_t *buffer) const
+    {
+        auto size = getSerializedSize();
+        memcpy(buffer, this, size);
+        return size;
+    }
+
+
+    /**
+     * @brief デシリアライズする
+     * @param [in] buffer 入力バッファ
+     */
+    bool inline deserialize(const uint8_t *buffer, const uint16_t buffSize)
+    {
+        auto size = getSerializedSize();
+        if (buffSize < size) {
+            return false;
+        }
+
+        peer_table table;
+        memcpy(&table, buffer, size);
+        *this = table;
+        return true;
+    }
+};
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <utils/debug.h>
+#include <utils/trace.h>
+#include <utils/latency_monitor.h>
 
 #include <stdint.h>
 #include <utility>
@@ -12,6 +14,8 @@
 #include <config/calibration.h>
 #include <utils/edge_detector.h>
 #include <utils/axis_detector.h>
+#include <utils/direction_detector.h>
+#include <utils/typematic.h>
 
 #include <ble/ble_hid.h>
 
@@ -35,73 +39,90 @@ namespace layer
     }
 
 
+    /**
+     * @brief 指定したボタンを次のスキャンで押下とみなす(スリープ復帰の押下を取りこぼさないため)
+     * @param [in] inputs ボタン(Inputの組み合わせ)
+     */
+    void inline latch(const uint16_t inputs)
+    {
+      if (inputs & Input::BUTTON_1) _button1.latch();
+      if (inputs & Input::BUTTON_2) _button2.latch();
+      if (inputs & Input::BUTTON_3) _button3.latch();
+      if (inputs & Input::BUTTON_4) _button4.latch();
+      if (inputs & Input::MIDDLE_BUTTON_1) _middle_button1.latch();
+    }
+
+
     /**
      * @brief  Chord入力をスキャンする
      * @param timeoutMs スキャンのタイムアウト時間
-     * @return [入力ソース,イベント].発生イベントを全て組み合わせた値を返す
-     * @note ワンショットだとChord入力(同時押し)を検知できないことがあるので、タイムアウトまで繰り返しスキャンする
+     * @return [入力ソース,イベント].発生イベントを全て組み合わせた値を返す。確定していなければ{0, 0}
+     * @note ワンショットだとChord入力(同時押し)を検知できないことがあるので、最初の押下からタイムアウトまで押下を積算する。
+     *       積算中もブロックせずに返るため、ループから繰り返し呼び出すこと
      */
     std::pair<uint16_t, uint16_t> inline scanChord(uint32_t timeoutMs)
     {
-      auto start = millis();
-
-      uint16_t chord = 0;
-      uint16_t event = 0;
-
       _button1.update();
       _button2.update();
       _button3.update();
       _button4.update();
       _middle_button1.update();
-      
 
-      // タイムアウトするまで繰り返しスキャンする
-      while (millis() - start < timeoutMs)
+      // ボタンリリースされたらchord無効で即時返却
+      if (_button1.isFalling() || _button2.isFalling() || _button3.isFalling() || _button4.isFalling() || _middle_button1.isFalling())
+      {
+        // 確定前に離した同時押しはレポートにならない
+        utils::latency_monitor::cancel(utils::latency_monitor::KEY_CHORD);
+        utils::latency_monitor::clearEdge();
+
+        uint16_t chord = _chord;
+        bool wasScanning = _chordState != ChordState::IDLE;
+        _chordState = ChordState::IDLE;
+        _chord = 0;
+        return wasScanning ? std::pair<uint16_t, uint16_t>{chord, Event::RELEASE} : std::pair<uint16_t, uint16_t>{0, 0};
+      }
+
+      // chord判定
+      uint16_t pressed = 0;
+      if (_button1.isPressed())        pressed |= Input::BUTTON_1;
+      if (_button2.isPressed())        pressed |= Input::BUTTON_2;
+      if (_button3.isPressed())        pressed |= Input::BUTTON_3;
+      if (_button4.isPressed())        pressed |= Input::BUTTON_4;
+      if (_middle_button1.isPressed()) pressed |= Input::MIDDLE_BUTTON_1;
+
+      switch (_chordState)
       {
+        case ChordState::IDLE:
+          if (pressed != 0) {
+            _chordState = ChordState::SCANNING;
+            _chordStartMs = millis();
+            _chord = pressed;
+            utils::latency_monitor::markInput(utils::latency_monitor::KEY_CHORD, utils::latency_monitor::takeEdgeUs());
+          }
+          break;
+
+        case ChordState::SCANNING:
+          _chord |= pressed;
+          if (millis() - _chordStartMs >= timeoutMs) {
+            _chordState = ChordState::HELD;
+            DEBUG_PRINTF("chord: 0x%04x", _chord);
+            TRACE(CHORD, _chord);
+            return {_chord, Event::PRESS};
+          }
+          break;
 
-        // ボタンリリースされたらchord無効で即時返却
-        if (_button1.isFalling() || _button2.isFalling() || _button3.isFalling() || _button4.isFalling() || _middle_button1.isFalling())
-        {
-          return {chord, Event::RELEASE};
-        }
-
-        // chord判定
-        if (_button1.isPressed())
-        {
-          chord |= Input::BUTTON_1;
-          event = Event::PRESS;
-        }
-        if (_button2.isPressed())
-        {
-          chord |= Input::BUTTON_2;
-          event = Event::PRESS;
-        }
-        if (_button3.isPressed())
-        {
-          chord |= Input::BUTTON_3;
-          event = Event::PRESS;
-        }
-        if (_button4.isPressed())
-        {
-          chord |= Input::BUTTON_4;
-          event = Event::PRESS;
-        }
-        if (_middle_button1.isPressed())
-        {
-          chord |= Input::MIDDLE_BUTTON_1;
-          event = Event::PRESS;
-        }
-
-        // ボタン更新
-        _button1.update();
-        _button2.update();
-        _button3.update();
-        _button4.update();
-        _middle_button1.update();
+        case ChordState::HELD:
+          // 押したまま別のボタンが追加されたら再度積算する
+          if ((pressed & ~_chord) != 0) {
+            _chordState = ChordState::SCANNING;
+            _chordStartMs = millis();
+            _chord |= pressed;
+            utils::latency_monitor::markInput(utils::latency_monitor::KEY_CHORD, utils::latency_monitor::takeEdgeUs());
+          }
+          break;
       }
 
-      DEBUG_PRINTF("chord: 0x%04x, event: 0x%04x", chord, event);
-      return {chord, event};
+      return {0, 0};
     }
 
 
@@ -113,26 +134,47 @@ namespace layer
      */
     bool inline action(const uint16_t chord, const uint16_t event)
     {
+      // ナビゲーションモード切り替え(キープロファイルに割り当てがあればそちらを優先する)
+      if (event == Event::PRESS && _navigationChord != 0 && chord == _navigationChord && !_profiles[0].exists(chord))
+      {
+        _isNavigation = !_isNavigation;
+        _typematic.stop();
+        _heldScancode = 0;
+        _previous_modifier = 0;
+        ble::ble_hid::keyRelease();
+        return true;
+      }
+
       bool wasAction = false;
-      auto modifier = scanModifier();
-      int layer = _joystick_x.isUp() ? 1 : 0; // FnキーONなら1
+      uint8_t modifier = 0;
+      int layer = 0;
+      if (_isNavigation) {
+        wasAction = navigate();
+      }
+      else {
+        modifier = scanModifier();
+        layer = _joystick_x.isUp() ? 1 : 0; // FnキーONなら1
+      }
       auto& profile = _profiles[layer];
       
       if (event == Event::RELEASE)
       {
         ble::ble_hid::keyRelease(modifier);
+        _heldScancode = 0;
         wasAction = true;
         goto FINALIZE;
       }
 
-      if (profile.exists(chord))
+      if (event == Event::PRESS && profile.exists(chord))
       {
-        ble::ble_hid::keyPress(profile.getScancode(chord), modifier);
+        _heldScancode = profile.getScancode(chord);
+        ble::ble_hid::keyPress(_heldScancode, modifier);
         wasAction = true;
       }
       else if(_previous_modifier != modifier)
       {
-        ble::ble_hid::keyPress(0, modifier);
+        // 押下中のキーは維持したままModifierだけ更新
+        ble::ble_hid::keyPress(_heldScancode, modifier);
         wasAction = true;
       }
 
@@ -142,12 +184,31 @@ namespace layer
     }
 
 
+    /**
+     * @brief ナビゲーションモード(ジョイスティックで矢印キー入力)か
+     */
+    bool inline isNavigation() const
+    {
+      return _isNavigation;
+    }
+
+
     void inline setKeyProfiles(const key_profiles& profiles)
     {
       _profiles = profiles;
     }
 
 
+    /**
+     * @brief ナビゲーションモードを切り替える同時押しを設定する
+     * @param chord Chord入力(0なら切り替えない)
+     */
+    void inline setNavigationChord(const uint16_t chord)
+    {
+      _navigationChord = chord;
+    }
+
+
   private:
     key_profiles _profiles;
     edge_detector<button1> _button1;
@@ -161,6 +222,63 @@ namespace layer
     axis_detector<typename joystick::yAxis> _joystick_y;
 
     uint8_t _previous_modifier = 0;
+    uint8_t _heldScancode = 0; ///< 押下中のキー
+
+    enum class ChordState
+    {
+      IDLE,     ///< 未押下
+      SCANNING, ///< 同時押しを積算中
+      HELD,     ///< 確定して押下中
+    };
+    ChordState _chordState = ChordState::IDLE;
+    uint16_t _chord = 0;
+    uint32_t _chordStartMs = 0;
+
+    /// ナビゲーションモードの切り替え(既定は全ボタン同時押し)
+    uint16_t _navigationChord = Input::BUTTON_1 | Input::BUTTON_2 | Input::BUTTON_3 | Input::BUTTON_4 | Input::MIDDLE_BUTTON_1;
+    bool _isNavigation = false;
+    direction_detector _direction;
+    typematic _typematic{400, 200, 25}; ///< 最初のリピートまで400ms、倒し量に応じて200ms～25ms間隔
+
+    /**
+     * @brief ジョイスティックの方向を矢印キーとして送信する
+     * @return 打鍵したか
+     */
+    bool navigate()
+    {
+      _joystick_y.update();
+      _joystick_x.update();
+      _direction.update(_joystick_x.getMove(), _joystick_y.getMove());
+
+      // 方向が変わったら押し始めからやり直す
+      if (_direction.isChanged()) {
+        _typematic.stop();
+      }
+
+      auto direction = _direction.getDirection();
+      if (!_typematic.poll(direction != direction_detector::NONE, _direction.getStrength())) {
+        return false;
+      }
+
+      // 右から時計回りに8方向。斜めは2キー同時押し
+      static constexpr uint8_t ARROWS[8][2] = {
+        {HID_KEY_ARROW_RIGHT, 0},
+        {HID_KEY_ARROW_DOWN,  HID_KEY_ARROW_RIGHT},
+        {HID_KEY_ARROW_DOWN,  0},
+        {HID_KEY_ARROW_DOWN,  HID_KEY_ARROW_LEFT},
+        {HID_KEY_ARROW_LEFT,  0},
+        {HID_KEY_ARROW_UP,    HID_KEY_ARROW_LEFT},
+        {HID_KEY_ARROW_UP,    0},
+        {HID_KEY_ARROW_UP,    HID_KEY_ARROW_RIGHT},
+      };
+      uint8_t scancodes[6] = {ARROWS[direction][0], ARROWS[direction][1], _heldScancode, 0, 0, 0};
+
+      // ホスト側のキーリピートに頼らないよう、打鍵ごとに押下→解放する
+      ble::ble_hid::keyPress(scancodes);
+      uint8_t held[6] = {_heldScancode, 0, 0, 0, 0, 0};
+      ble::ble_hid::keyPress(held);
+      return true;
+    }
 
     /**
      * @brief Modifierキーをスキャンする
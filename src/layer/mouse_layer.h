@@ -6,9 +6,13 @@
 #include <modules/joystick.h>
 
 #include <config/calibration.h>
+#include <config/config.h>
+#include <layer/event.h>
 #include <utils/edge_detector.h>
 #include <utils/axis_detector.h>
 #include <utils/cursor_strategy.h>
+#include <utils/wheel_detector.h>
+#include <utils/latency_monitor.h>
 
 #include <ble/ble_hid.h>
 
@@ -39,18 +43,48 @@ namespace layer
             _joystick_y.cariblate(calib.centerY);
         }
 
-        void inline configure(const uint8_t gain, const float scale, const uint32_t reportIntervalMs)
+        void inline configure(const uint8_t gain, const float scale, const uint32_t reportIntervalMs, const uint16_t wheelUnitsPerRevolution)
         {
             auto& strategy = _sampler.getStorategy();
             strategy.setGain(gain);
             strategy.setMickeyScale(scale);
             _sampler.setInterval(reportIntervalMs);
             _sampler.reset();
+            _wheel.setUnitsPerRevolution(wheelUnitsPerRevolution);
+            _pendingScroll = 0;
         }
 
 
         /**
-         * @brief ボタン/ジョイスティックをスキャンしBLE HIDマウスレポートを送信
+         * @brief ジャンプモード(絶対座標)を設定する
+         * @param [in] button ジャンプモードにするボタン(Input)。0なら無効
+         * @param [in] region ジョイスティックの可動範囲を割り当てる画面上の領域
+         */
+        void inline configureJump(const uint16_t button, const JumpRegion& region)
+        {
+            _jumpButton = button;
+            _jumpRegion = region;
+            _isJumping = false;
+        }
+
+
+        /**
+         * @brief 指定したボタンを次のスキャンで押下とみなす(スリープ復帰の押下を取りこぼさないため)
+         * @param [in] inputs ボタン(Inputの組み合わせ)
+         */
+        void inline latch(const uint16_t inputs)
+        {
+            if (inputs & Input::BUTTON_1) _button1.latch();
+            if (inputs & Input::BUTTON_2) _button2.latch();
+            if (inputs & Input::BUTTON_3) _button3.latch();
+            if (inputs & Input::BUTTON_4) _button4.latch();
+            if (inputs & Input::MIDDLE_BUTTON_1) _middle_button1.latch();
+        }
+
+
+        /**
+         * @brief ボタン/ジョイスティックをスキャンする
+         * @details ボタンのクリックは即時送信し、カーソル移動/スクロール/ジャンプは積算だけしてflush()でまとめて送信する
          * @return イベントが発生したか
          */
         bool inline action()
@@ -65,69 +99,143 @@ namespace layer
             
             //debugPrintf("x:%04d, y:%04d, ", _joystick_x.getValue(), _joystick_y.getValue());
 
+            auto x = _joystick_x.getMove();
+            auto y = _joystick_y.getMove();
+
+            // ジャンプモード
+            // ボタン押下中はジョイスティックの倒し量を画面上の絶対位置に変換する
+            if (isJumpHeld())
+            {
+                jump(x, y);
+                wasAction = true;
+            }
             // マウス/ホイール移動
+            else
             {
-                auto x = _joystick_x.getMove();
-                auto y = _joystick_y.getMove();
-                auto [moveX, moveY] = _sampler.getMoveCursor(x, y);
+                // ジャンプ終了直後は相対移動の積算をやり直す
+                if (_isJumping) {
+                    _isJumping = false;
+                    _sampler.reset();
+                }
 
-                DEBUG_PRINTF("moveX: %d, moveY: %d", moveX, moveY);
+                // 移動量を積算
+                _sampler.update(x, y);
+                if (isMoving()) {
+                    utils::latency_monitor::markInput(_middle_button1.isPressed() ? utils::latency_monitor::SCROLL : utils::latency_monitor::MOTION);
+                }
 
-                static uint32_t lastSendScrollMs = 0;
+                // ホイール移動(回転操作)
+                // 倒したまま回した角度をスクロール量に変換する
+                if (_middle_button1.isPressed() && _wheel.isEnabled())
+                {
+                    _pendingScroll += _wheel.update(x, y);
+                }
+                else if (_middle_button1.isFalling())
+                {
+                    _wheel.reset();
+                    _pendingScroll = 0;
+                    utils::latency_monitor::cancel(utils::latency_monitor::SCROLL);
+                }
 
-                // ホイール移動
-                // 500msに一回送信するようにしてみる
+                // スクロール中はクリックしない
                 if (_middle_button1.isPressed())
                 {
-                    // TODO: 効きすぎなので暫定で抑えてみる
-                    // 送信レートが100hzだから動きすぎるように感じるのかも？
-                    // レート下げる工夫が必要かもしれない・・
-                    if ((millis() - lastSendScrollMs) >= 150) {
-                        #if 0
-                        int8_t scrollX = (int8_t)map(x, -512, 512, 5, -5);
-                        int8_t scrollY = (int8_t)map(y, -512, 512, 5, -5);
-                        if (_joystick_x.isMoving()) ble::ble_hid::mouseHScroll(scrollX);
-                        if (_joystick_y.isMoving()) ble::ble_hid::mouseVScroll(scrollY);
-                        #endif
-                        //if (_joystick_x.isMoving()) ble::ble_hid::mouseHScroll(-moveX);
-                        if (abs(moveY) > 0) {
-                            ble::ble_hid::mouseVScroll(-moveY);
-                            lastSendScrollMs = millis();
-                        }
-                    }
-                    
                     return true;
                 }
-                // マウス移動
-                else if(moveX != 0 || moveY != 0) {
-                    ble::ble_hid::mouseMove(moveX, moveY);
-                    wasAction = true; 
-                }
             }
 
             // 左クリック
-            _button1.update();
-            if (_button1.isRising())  { ble::ble_hid::mousePress(ble::ble_hid::MouseButton::LEFT); wasAction = true; }
-            if (_button1.isFalling()) { ble::ble_hid::mouseRelease(ble::ble_hid::MouseButton::LEFT); wasAction = true; }
+            wasAction |= click(_button1, Input::BUTTON_1, ble::ble_hid::MouseButton::LEFT);
 
             // 右クリック
-            _button2.update();
-            if (_button2.isRising())  { ble::ble_hid::mousePress(ble::ble_hid::MouseButton::RIGHT); wasAction = true; }
-            if (_button2.isFalling()) { ble::ble_hid::mouseRelease(ble::ble_hid::MouseButton::RIGHT); wasAction = true; }
+            wasAction |= click(_button2, Input::BUTTON_2, ble::ble_hid::MouseButton::RIGHT);
 
             // 戻る
-            _button3.update();
-            if (_button3.isRising())  { ble::ble_hid::mousePress(ble::ble_hid::MouseButton::BACKWARD); wasAction = true; }
-            if (_button3.isFalling()) { ble::ble_hid::mouseRelease(ble::ble_hid::MouseButton::BACKWARD); wasAction = true; }
+            wasAction |= click(_button3, Input::BUTTON_3, ble::ble_hid::MouseButton::BACKWARD);
 
             // 進む
-            _button4.update();
-            if (_button4.isRising())  { ble::ble_hid::mousePress(ble::ble_hid::MouseButton::FORWARD); wasAction = true; }
-            if (_button4.isFalling()) { ble::ble_hid::mouseRelease(ble::ble_hid::MouseButton::FORWARD); wasAction = true; }
+            wasAction |= click(_button4, Input::BUTTON_4, ble::ble_hid::MouseButton::FORWARD);
 
             return wasAction;
         }
 
+
+        /**
+         * @brief 積算したカーソル移動/スクロール/ジャンプ位置をBLE HIDマウスレポートとして送信
+         * @note レポート間隔ごとに呼び出すこと
+         * @return レポートを送信したか
+         */
+        bool inline flush()
+        {
+            // ジャンプ
+            if (_isJumping)
+            {
+                ble::ble_hid::mouseMoveAbsolute(
+                    constrain(_jumpX, 0, (int32_t)ble::hid_device::ABSOLUTE_MAX),
+                    constrain(_jumpY, 0, (int32_t)ble::hid_device::ABSOLUTE_MAX)
+                );
+                return true;
+            }
+
+            auto [moveX, moveY] = _sampler.take();
+            DEBUG_PRINTF("moveX: %d, moveY: %d", moveX, moveY);
+
+            // ホイール移動(回転操作)
+            if (_middle_button1.isPressed() && _wheel.isEnabled())
+            {
+                if (_pendingScroll != 0) {
+                    auto scroll = constrain(_pendingScroll, -127, 127);
+                    ble::ble_hid::mouseVScroll(-scroll); // 時計回りで下スクロール
+                    _pendingScroll -= scroll;
+                }
+                return true;
+            }
+
+            // ホイール移動
+            // 500msに一回送信するようにしてみる
+            if (_middle_button1.isPressed())
+            {
+                // TODO: 効きすぎなので暫定で抑えてみる
+                // 送信レートが100hzだから動きすぎるように感じるのかも？
+                // レート下げる工夫が必要かもしれない・・
+                if ((millis() - _lastSendScrollMs) >= 150) {
+                    #if 0
+                    int8_t scrollX = (int8_t)map(x, -512, 512, 5, -5);
+                    int8_t scrollY = (int8_t)map(y, -512, 512, 5, -5);
+                    if (_joystick_x.isMoving()) ble::ble_hid::mouseHScroll(scrollX);
+                    if (_joystick_y.isMoving()) ble::ble_hid::mouseVScroll(scrollY);
+                    #endif
+                    //if (_joystick_x.isMoving()) ble::ble_hid::mouseHScroll(-moveX);
+                    if (abs(moveY) > 0) {
+                        ble::ble_hid::mouseVScroll(-moveY);
+                        _lastSendScrollMs = millis();
+                    }
+                }
+                
+                return true;
+            }
+
+            // マウス移動
+            if (moveX != 0 || moveY != 0) {
+                ble::ble_hid::mouseMove(moveX, moveY);
+                return true;
+            }
+            if (!isMoving()) {
+                utils::latency_monitor::cancel(utils::latency_monitor::MOTION);
+            }
+
+            return false;
+        }
+
+
+        /**
+         * @brief ジョイスティックが倒されているか(直近のaction()時点)
+         */
+        bool inline isMoving()
+        {
+            return _joystick_x.isMoving() || _joystick_y.isMoving();
+        }
+
     private:
         edge_detector<button1> _button1;
         edge_detector<button2> _button2;
@@ -141,6 +249,76 @@ namespace layer
         //linear_strategy _move_strategy;
         //negative_inertia_strategy _move_strategy;
         sampler<negative_inertia_strategy> _sampler{10};
+        wheel_detector _wheel;
+        int32_t _pendingScroll = 0; ///< 未送信のスクロール量
+
+        uint16_t _jumpButton = 0; ///< ジャンプモードのボタン(Input)
+        JumpRegion _jumpRegion;
+        bool _isJumping = false;
+        uint32_t _lastSendScrollMs = 0;
+        int32_t _jumpX = 0; ///< 平滑化した絶対座標X
+        int32_t _jumpY = 0; ///< 平滑化した絶対座標Y
+
+
+        /**
+         * @brief ボタンのクリックをBLE HIDマウスレポートとして送信
+         * @param [in] button      ボタン
+         * @param [in] input       ボタンを表すInput
+         * @param [in] mouseButton 送信するマウスボタン
+         * @return イベントが発生したか
+         */
+        template <typename detector>
+        bool inline click(detector& button, const uint16_t input, const ble::ble_hid::MouseButton mouseButton)
+        {
+            button.update();
+
+            // ジャンプモードに割り当てたボタンはクリックとして扱わない
+            if (_jumpButton & input) {
+                return false;
+            }
+
+            if (button.isRising() || button.isFalling()) {
+                utils::latency_monitor::markInput(utils::latency_monitor::MOUSE_BUTTON, utils::latency_monitor::takeEdgeUs());
+            }
+            if (button.isRising())  { ble::ble_hid::mousePress(mouseButton); return true; }
+            if (button.isFalling()) { ble::ble_hid::mouseRelease(mouseButton); return true; }
+            return false;
+        }
+
+
+        /**
+         * @brief ジャンプモードのボタンが押下されているか
+         */
+        bool inline isJumpHeld() const
+        {
+            return ((_jumpButton & Input::BUTTON_1) && button1::isPressed())
+                || ((_jumpButton & Input::BUTTON_2) && button2::isPressed())
+                || ((_jumpButton & Input::BUTTON_3) && button3::isPressed())
+                || ((_jumpButton & Input::BUTTON_4) && button4::isPressed())
+                || ((_jumpButton & Input::MIDDLE_BUTTON_1) && middle_button1::isPressed());
+        }
+
+
+        /**
+         * @brief ジョイスティックの倒し量を絶対座標に変換する
+         * @param [in] x 中心からのX軸の差(-512～+512)
+         * @param [in] y 中心からのY軸の差(-512～+512)
+         */
+        void inline jump(const int32_t x, const int32_t y)
+        {
+            constexpr int32_t RAW_MAX = 512;
+            int32_t targetX = _jumpRegion.x + (((constrain(x, -RAW_MAX, RAW_MAX) + RAW_MAX) * _jumpRegion.width) / (RAW_MAX * 2));
+            int32_t targetY = _jumpRegion.y + (((constrain(y, -RAW_MAX, RAW_MAX) + RAW_MAX) * _jumpRegion.height) / (RAW_MAX * 2));
+
+            // 押した瞬間は目標位置から開始し、以降はADCのノイズで震えないよう平滑化する
+            if (!_isJumping) {
+                _isJumping = true;
+                _jumpX = targetX;
+                _jumpY = targetY;
+            }
+            _jumpX += (targetX - _jumpX) / 4;
+            _jumpY += (targetY - _jumpY) / 4;
+        }
     };
 
 }
\ No newline at end of file
@@ -5,9 +5,24 @@
 #include <alias.h>
 #include <ble/ble_hid.h>
 #include <ble/ble_config.h>
+#include <ble/conn_param_manager.h>
+#include <ble/link_monitor.h>
+#include <ble/report_queue.h>
+#include <ble/ble_battery.h>
 
 #include <config/config_manager.h>
 #include <utils/internal_fs.h>
+#include <utils/scheduler.h>
+#include <utils/rate_governor.h>
+#include <utils/sleep_policy.h>
+#include <utils/power_manager.h>
+#include <utils/fuel_gauge.h>
+#include <utils/edge_detector.h>
+#include <utils/trace.h>
+#include <utils/latency_monitor.h>
+#include <utils/energy_meter.h>
+#include <utils/boot_profiler.h>
+#include <utils/retained_ram.h>
 
 enum Mode {
   CONFIG,
@@ -19,11 +34,54 @@ static constexpr module::Color LAYER_COLORS[2] = {
   module::Color::GREEN
 };
 
+static constexpr uint32_t BATTERY_SAMPLE_PERIOD_MS = 60000; ///< バッテリー電圧を測る周期
+static constexpr uint32_t PERSIST_DELAY_MS = 500; ///< BLEから設定を受け取ってからFlashに書き込むまでの時間(連続書き込みをまとめる)
+
 static click_detector joystick_button;
+static edge_detector<mode_sw> modeSwitch;
 static keyboard_layer keyboardLayer;
 static key_profile profile;
 static mouse_layer mouseLayer;
 static int currentLayer = 0;
+static Mode mode = Mode::DEVICE;
+static bool wasAction = false; ///< スリープを遅らせる操作/接続があった
+static bool wasInput = false;  ///< ユーザーの入力があった(無操作時間の記録用。接続などは含めない)
+static volatile bool isConfigUpdated = false; ///< BLEから設定を受け取った(BLEのタスクから書き込まれる)
+static volatile bool isLatencyResetRequested = false; ///< BLEから遅延の計測値のリセットを要求された(BLEのタスクから書き込まれる)
+
+static utils::scheduler<10> taskScheduler;
+static utils::scheduler<10>::TaskId scanTask = utils::scheduler<10>::INVALID_TASK;
+static utils::scheduler<10>::TaskId reportTask = utils::scheduler<10>::INVALID_TASK;
+static utils::scheduler<10>::TaskId persistTask = utils::scheduler<10>::INVALID_TASK;
+static utils::rate_governor governor;
+static utils::sleep_policy sleepPolicy;
+static utils::fuel_gauge fuelGauge;
+static uint32_t lastBatterySampleMs = 0;
+static uint32_t lastActionMs = 0; ///< 最後に入力があった時刻(無操作時間の記録用)
+static uint32_t cpuBusyPermille = 0; ///< 直近のstatsタスクの周期でのCPU稼働率(‰)
+
+void beginHid();
+void requestConnParams();
+void publishStats();
+
+/**
+ * @brief 無操作時間のヒストグラムからスリープの方針を選び直して反映
+ */
+void applySleepPolicy()
+{
+  sleepPolicy.evaluate(config_manager::getIdleHistogram());
+  ble::conn_param_manager::setIdleLatency(sleepPolicy.getIdleLatency());
+}
+
+/**
+ * @brief 現在の段階の周期をスキャン/レポートタスクに反映
+ */
+void applyRate()
+{
+  auto periodUs = governor.getPeriodUs();
+  taskScheduler.setPeriod(scanTask, periodUs, 1000);
+  taskScheduler.setPeriod(reportTask, periodUs, 1000);
+}
 
 /**
  * @brief 設定を反映
@@ -33,12 +91,33 @@ void applyConfig()
   // config
   {
     auto& cfg = config_manager::getGlobalConfig();
-    mouseLayer.configure(cfg.getMouseNegativeGain(), cfg.getMickeyScale(), cfg.getMouseReportIntervalMs());
+    mouseLayer.configure(cfg.getMouseNegativeGain(), cfg.getMickeyScale(), cfg.getMouseReportIntervalMs(), cfg.getWheelUnitsPerRevolution());
+    mouseLayer.configureJump(cfg.getJumpButton(), cfg.getJumpRegion());
+    led_indicator::setBrightness(cfg.getLedBrightness());
+
+    auto& pwr = cfg.getPowerModel();
+    utils::energy_meter::configure(pwr.activeUa, pwr.lightSleepUa, pwr.advertisingUa, pwr.connectedUa, pwr.reportNc);
+
+    auto& gov = cfg.getRateGovernor();
+    governor.configure(gov.burstMs, cfg.getMouseReportIntervalMs(), gov.idleMs, gov.burstQuietMs, gov.normalQuietMs);
+    applyRate();
+
+    auto& lnk = cfg.getLinkMonitor();
+    ble::link_monitor::configure(lnk.minTxPower, cfg.getTxPower(), lnk.targetRssi, lnk.isAdaptive != 0);
+
+    auto& buf = cfg.getReportBuffer();
+    ble::report_queue::configure(buf.keyKeepMs, buf.motionKeepMs);
+
+    // 無操作のスレーブレイテンシはスキャンがIDLEの段階になってから要求する
+    auto& slp = cfg.getSleepPolicy();
+    sleepPolicy.configure(slp.isAdaptive != 0, slp.latencyWeight, cfg.getLightSleepTimeoutMs(), ble::conn_param_manager::DEFAULT_IDLE_LATENCY, gov.burstQuietMs + gov.normalQuietMs);
+    applySleepPolicy();
   }
 
   // keyprof
   {
     keyboardLayer.setKeyProfiles(config_manager::getKeyProfiles());
+    keyboardLayer.setNavigationChord(config_manager::getGlobalConfig().getNavigationChord());
   }
 
   // calibration
@@ -46,15 +125,507 @@ void applyConfig()
     auto& calib = config_manager::getCalibration();
     mouseLayer.cariblate(calib);
     keyboardLayer.cariblate(calib);
+    sleep_controller::setJoystickCenter(calib.centerX, calib.centerY);
+  }
+}
+
+/**
+ * @brief モード/接続状態に応じたLED表示にする
+ * @param [in] force 表示が変わらなくても再設定する(スリープ復帰時など)
+ * @note 表示が変わるときだけLEDを操作する
+ */
+void updateIndicator(const bool force=false)
+{
+  enum Indicator { NONE, CONFIG_BLINK, CONNECT_BLINK, LAYER_0, LAYER_1 };
+  static Indicator current = NONE;
+
+  Indicator desired;
+  if (mode == Mode::CONFIG) {
+    desired = CONFIG_BLINK;
+  } else if (!ble::ble_hid::isConnected()) {
+    desired = CONNECT_BLINK;
+  } else {
+    desired = currentLayer == 0 ? LAYER_0 : LAYER_1;
+  }
+
+  if (desired == current && !force) {
+    return ;
+  }
+  current = desired;
+
+  switch (desired) {
+    case CONFIG_BLINK:  led_indicator::startBreath(module::Color::PURPLE, 2000); break;
+    case CONNECT_BLINK: led_indicator::startBlink(module::Color::BLUE, 500); break;
+    default:            led_indicator::turnOnWith(LAYER_COLORS[currentLayer]); break;
+  }
+}
+
+
+/**
+ * @brief 入力スキャン(モード切り替え/レイヤ処理)
+ * @return 操作(ジョイスティックの移動/ボタンのエッジ)があったか
+ */
+bool scanInput()
+{
+  // モードトグル
+  joystick_button.update();
+  if (joystick_button.isLongPressed()) {
+    joystick_button.reset();
+
+    switch(mode) {
+      case DEVICE:
+      {
+        mode = Mode::CONFIG;
+        DEBUG_PRINTF("start advertising ble config");
+        ble::ble_config::begin(config_manager::getGlobalConfig(), config_manager::getKeyProfiles());
+        break;
+      }
+        
+      case CONFIG:
+      {
+        mode = Mode::DEVICE;
+        ble::ble_config::end();
+        break;
+      }
+    }
+    updateIndicator();
+    return true;
+  }
+
+  // 送信先ホストの切り替え(両方のホストと接続したまま送信先だけ変える)
+  modeSwitch.update();
+  if (modeSwitch.isRising() || modeSwitch.isFalling()) {
+    ble::ble_hid::setActiveHost(modeSwitch.isPressed() ? 1 : 0);
+    requestConnParams();
+    updateIndicator();
+    return true;
+  }
+
+  // 設定モード中もHIDとしての操作は続けられる(設定の変更をその場で試せる)
+  // 再接続中の操作は溜めておき、接続したら送る
+  if (!ble::ble_hid::isReportable()) {
+    return false;
+  }
+
+  // 入力処理
+  bool isActive = false;
+  switch (currentLayer)
+  {
+    case 0: // mouse layer
+    {
+      if (joystick_button.isClicked()) {
+        currentLayer = 1;
+        updateIndicator();
+        isActive = true;
+        break;
+      }
+      isActive = mouseLayer.action() || mouseLayer.isMoving();
+      wasAction |= isActive;
+      wasInput |= isActive;
+      break;
+    }
+
+    case 1: // keyboard layer
+    {
+      if (joystick_button.isClicked()) {
+        currentLayer = 0;
+        updateIndicator();
+
+        // 全てボタン離す
+        // TODO: 無理やりやってるので後でコード整理
+        ble::ble_hid::keyRelease();
+        applyConfig(); // TODO: リセット処理は別にしたい
+
+        isActive = true;
+        break;
+      }
+      auto [chord, event] = keyboardLayer.scanChord(config_manager::getGlobalConfig().getChordScanTimeoutMs());
+      isActive = keyboardLayer.action(chord, event) || (chord != 0);
+      wasAction |= isActive;
+      wasInput |= isActive;
+      break;
+    }
+  }
+  return isActive;
+}
+
+
+/**
+ * @brief 入力スキャンして操作状況に応じて周期を切り替える
+ */
+void scan()
+{
+  TRACE(SCAN_BEGIN, governor.getTier());
+  auto isActive = scanInput();
+  TRACE(SCAN_END, isActive);
+  if (governor.update(isActive)) {
+    applyRate();
+
+    requestConnParams();
+  }
+}
+
+
+/**
+ * @brief ホストごとの接続パラメータを要求
+ * @details 無操作ならスレーブレイテンシを上げて接続を維持したまま省電力にする。
+ *          送信先でないホストは常に無操作扱い。
+ */
+void requestConnParams()
+{
+  auto activeProfile = (governor.getTier() == utils::rate_governor::IDLE)
+    ? ble::conn_param_manager::IDLE
+    : ble::conn_param_manager::ACTIVE;
+
+  for (uint8_t host = 0; host < ble::ble_hid::HOST_COUNT; host++) {
+    ble::conn_param_manager::request(static_cast<ble::ble_link::Link>(host),
+      host == ble::ble_hid::getActiveHost() ? activeProfile : ble::conn_param_manager::IDLE);
+  }
+}
+
+
+/**
+ * @brief マウスレポート送信(レポート間隔ごと)
+ */
+void flushTask()
+{
+  if (currentLayer != 0 || !ble::ble_hid::isReportable()) {
+    return ;
+  }
+  auto isFlushed = mouseLayer.flush();
+  wasAction |= isFlushed;
+  wasInput |= isFlushed;
+}
+
+
+/**
+ * @brief HIDデバイスとしての接続を開始(接続処理はlinkTaskで進む)
+ * @details 全てのホストと接続し、MODEスイッチで選んだホストにレポートを送る。
+ *          前回の接続先が分かっているホストは指向性アドバタイズから始める。
+ */
+void beginHid()
+{
+  auto& peers = config_manager::getPeerTable();
+  for (uint8_t host = 0; host < ble::ble_hid::HOST_COUNT; host++) {
+    ble::ble_hid::setDirectedPeer(host, peers.find(host + 1));
+  }
+  ble::ble_hid::setActiveHost(mode_sw::isPressed() ? 1 : 0);
+
+  auto& cfg = config_manager::getGlobalConfig();
+  ble::ble_hid::begin(ble::ConnectionParam{
+    .connectionIntervalMin = cfg.getConnectionIntervalMin(),
+    .connectionIntervalMax = cfg.getConnectionIntervalMax(),
+    .slaveLatency = 0,
+    .timeout = 2000,
+    .txPower = cfg.getTxPower()
+  });
+}
+
+
+/**
+ * @brief BLE接続管理
+ * @note 接続/切断はSoftDeviceのイベントで状態が進むため待機しない
+ */
+void linkTask()
+{
+  static bool wasConnected[ble::ble_hid::HOST_COUNT] = {};
+
+  ble::ble_link::update();
+
+  // 設定モード中はスリープしない
+  if (mode == Mode::CONFIG) {
+    wasAction = true;
+  }
+
+  for (uint8_t host = 0; host < ble::ble_hid::HOST_COUNT; host++) {
+    auto link = static_cast<ble::ble_link::Link>(host);
+
+    // HID接続完了
+    auto connected = ble::ble_hid::isConnected(host);
+    if (connected && !wasConnected[host]) {
+      DEBUG_PRINTF("connected hid host=%d", host);
+      updateIndicator();
+      ble::conn_param_manager::reset(link, ble::ble_link::getConnectionHandle(link));
+      ble::link_monitor::begin(link, ble::ble_link::getConnectionHandle(link));
+      requestConnParams();
+
+      // 次回の指向性アドバタイズの宛先として覚えておく(アドレスの種はホスト+1)
+      ble_gap_id_key_t peer;
+      if (ble::ble_hid::getPeerIdentity(host, peer) && config_manager::updatePeer(host + 1, peer)) {
+        taskScheduler.trigger(persistTask, PERSIST_DELAY_MS * 1000);
+      }
+
+      if (host == ble::ble_hid::getActiveHost()) {
+        auto& cfg = config_manager::getGlobalConfig();
+        mouseLayer.configure(cfg.getMouseNegativeGain(), cfg.getMickeyScale(), cfg.getMouseReportIntervalMs(), cfg.getWheelUnitsPerRevolution());
+      }
+
+      wasAction = true;
+    }
+    if (!connected && wasConnected[host]) {
+      ble::link_monitor::end(link);
+    }
+    wasConnected[host] = connected;
+
+    if (connected) {
+      ble::conn_param_manager::update(link);
+      ble::link_monitor::update(link);
+    }
+  }
+
+  // 再接続中に溜めた操作を送る
+  if (ble::ble_hid::isConnected()) {
+    ble::ble_hid::replay();
   }
 }
 
+
+/**
+ * @brief LED表示
+ */
+void ledTask()
+{
+  updateIndicator();
+}
+
+
+/**
+ * @brief スリープ判定
+ */
+void sleepTask()
+{
+  // 操作ありならスリープカウントリセット
+  auto now = millis();
+  if (wasAction)
+  {
+    wasAction = false;
+    sleep_controller::resetSleepCount();
+  }
+
+  // 前の入力からの無操作時間を学習する(LightSleepを挟んでもmillis()は進む)
+  // 接続や設定モードはスリープを遅らせるが、ユーザーの操作の間隔ではないので記録しない
+  if (wasInput)
+  {
+    wasInput = false;
+    config_manager::recordIdleGap(now - lastActionMs);
+    lastActionMs = now;
+    applySleepPolicy();
+  }
+
+  if (!sleep_controller::shouldEnterSleep(sleepPolicy.getLightSleepTimeoutMs()))
+  {
+    return ;
+  }
+
+  // LED/ボタン割り込みなどスリープ中に要らないものを止める
+  utils::power_manager::suspend(utils::power_manager::LIGHT_SLEEP);
+
+  // 未保存の設定があれば書き込んでおく
+  config_manager::flush();
+  
+  // SystemONSleepでタイムアウトした場合はDeepSleepに移行
+  TRACE(SLEEP_ENTER, 0, config_manager::getGlobalConfig().getDeepSleepTimeoutMs());
+  auto wasTimeout = sleep_controller::enterLightSleep(config_manager::getGlobalConfig().getDeepSleepTimeoutMs());
+  if (wasTimeout) {
+    // DeepSleepに入るまでの時間を無操作時間の下限として記録し、ヒストグラムも書き込んでおく
+    config_manager::recordIdleGap(millis() - lastActionMs);
+    // 復帰時にFlashを読まずに済むよう設定を保持するRAMに書いておく
+    config_manager::flush(true);
+    utils::energy_meter::onSystemOff();
+    config_manager::retain(currentLayer);
+    sleep_controller::enterDeepSleep();
+    // ここからは復帰しない→setup()に戻る
+  }
+
+  // lightsleep通常復帰
+  utils::power_manager::resume();
+  updateIndicator(true);
+  sleep_controller::resetSleepCount();
+
+  // 設定は変わっていないので反映し直さない(検出器の状態を保つ)。眠っている間にBLEで受け取った設定はconfigTaskで反映する
+  // 復帰させたボタンは最初のスキャンまでに離されていても押下として扱う
+  auto wakeInputs = sleep_controller::getWakeInputs();
+  utils::trace::sync(); // 復帰の記録をmillis()に合わせておく
+  if (wakeInputs != 0) {
+    utils::latency_monitor::onEdge(sleep_controller::getWakeUs()); // 復帰させたボタンは復帰した時刻に押された
+  }
+  TRACE(SLEEP_WAKE, sleep_controller::getWakeSource(), wakeInputs);
+  if (currentLayer == 0) {
+    mouseLayer.latch(wakeInputs);
+  } else {
+    keyboardLayer.latch(wakeInputs);
+  }
+  ble::ble_hid::markWake(ble::ble_hid::WAKE_LIGHT_SLEEP, sleep_controller::getWakeUs());
+
+  // スリープ中は意図的に止めていたのでミスとして数えない
+  taskScheduler.resync();
+  taskScheduler.trigger(scanTask);
+}
+
+
+/**
+ * @brief BLEから受け取った設定を反映
+ */
+void configTask()
+{
+  // 設定アプリが計測値の種類を選んだらstatsタスクの周期を待たずに反映する
+  if (ble::ble_config::takeStatsRequest()) {
+    publishStats();
+  }
+
+  if (!isConfigUpdated) {
+    return ;
+  }
+  isConfigUpdated = false;
+
+  applyConfig();
+  updateIndicator(true); // 明るさを反映
+
+  // 連続で書き込まれた場合は最後の書き込みからPERSIST_DELAY_MS後にまとめて保存
+  taskScheduler.trigger(persistTask, PERSIST_DELAY_MS * 1000);
+}
+
+
+/**
+ * @brief 設定の保存
+ */
+void persistConfigTask()
+{
+  config_manager::flush();
+}
+
+
+/**
+ * @brief バッテリー電圧を測って残量を更新
+ */
+void sampleBattery()
+{
+  auto loadUa = utils::fuel_gauge::estimateLoadUa(ble::ble_hid::isConnected(), led_indicator::getDutyPermille());
+  fuelGauge.update(battery::readMilliVolts(), loadUa);
+  ble::ble_battery::update(fuelGauge.getPercent());
+  lastBatterySampleMs = millis();
+}
+
+
+/**
+ * @brief バッテリー残量の更新(BATTERY_SAMPLE_PERIOD_MSごと、無線が止まっている間に測る)
+ */
+void batteryTask()
+{
+  if (millis() - lastBatterySampleMs < BATTERY_SAMPLE_PERIOD_MS) {
+    return ;
+  }
+  // 無線の動作中は電源が揺れるので次の周期で測り直す
+  if (!ble::ble_battery::isRadioIdle()) {
+    return ;
+  }
+  sampleBattery();
+}
+
+
+/**
+ * @brief 計測値をJSONにシリアライズ
+ * @param [in] stats 種類
+ * @return 書き込んだサイズ(終端文字を含まない)
+ */
+size_t serializeStats(const ble::ble_config::Stats stats, char* buffer, const size_t size)
+{
+  using ble::ble_config;
+  switch (stats) {
+    case ble_config::STATS_SCHEDULER:    return taskScheduler.serializeStats(buffer, size);
+    case ble_config::STATS_GOVERNOR:     return governor.serializeStats(buffer, size);
+    case ble_config::STATS_LINK:         return ble::ble_link::serializeStats(buffer, size);
+    case ble_config::STATS_CONN_PARAM:   return ble::conn_param_manager::serializeStats(buffer, size);
+    case ble_config::STATS_RECONNECT:    return ble::ble_hid::serializeReconnectStats(buffer, size);
+    case ble_config::STATS_LINK_QUALITY: return ble::link_monitor::serializeStats(buffer, size);
+    case ble_config::STATS_SLEEP_POLICY: return sleepPolicy.serializeStats(config_manager::getIdleHistogram(), buffer, size);
+    case ble_config::STATS_POWER:        return utils::power_manager::serializeStats(buffer, size);
+    case ble_config::STATS_BATTERY:      return fuelGauge.serializeStats(buffer, size);
+    case ble_config::STATS_LATENCY:      return utils::latency_monitor::serializeStats(buffer, size);
+    case ble_config::STATS_ENERGY:       return utils::energy_meter::serializeStats(buffer, size);
+    case ble_config::STATS_BOOT:         return utils::boot_profiler::serializeStats(buffer, size);
+    case ble_config::STATS_CPU:          return min((size_t)snprintf(buffer, size, "{\"b\":%lu}", (unsigned long)cpuBusyPermille), size - 1);
+    default:                             return 0;
+  }
+}
+
+
+/**
+ * @brief 設定アプリが選んだ計測値を設定用Characteristicに反映
+ */
+void publishStats()
+{
+  if (isLatencyResetRequested) {
+    isLatencyResetRequested = false;
+    utils::latency_monitor::reset();
+  }
+
+  char buffer[ble::ble_config::STATS_MAX_SIZE - 1];
+  auto stats = ble::ble_config::getSelectedStats();
+  auto len = serializeStats(stats, buffer, sizeof(buffer));
+  ble::ble_config::updateStats(stats, buffer, len);
+}
+
+
+/**
+ * @brief 計測値の更新(設定アプリの接続中のみ)
+ */
+void statsTask()
+{
+  utils::trace::sync();
+
+  // 値を取り出すと計測をやり直すので、ビルドの種類によらず毎周期取り出す
+  cpuBusyPermille = active_idle::takeBusyPermille();
+  DEBUG_PRINTF("cpu busy %lu permille", (unsigned long)cpuBusyPermille);
+
+  // 読み出す設定アプリがいなければシリアライズしない
+  if (!ble::ble_config::isConnected()) {
+    return ;
+  }
+  publishStats();
+}
+
+
+/**
+ * @brief トレースの送出
+ * @details 設定アプリが購読していればBLEの通知で、そうでなければUSB CDCが開いているときにSerialへ送る。
+ *          どちらもなければ溜めたままにする(古いものから上書きされる)。
+ */
+void traceTask()
+{
+#if ENABLE_TRACE
+  uint8_t buffer[ble::ble_config::TRACE_MAX_SIZE];
+  if (ble::ble_config::isTraceSubscribed()) {
+    auto len = utils::trace::drain(buffer, sizeof(buffer));
+    if (len > 0) {
+      ble::ble_config::notifyTrace(buffer, len);
+    }
+    return ;
+  }
+
+#if !__DEBUG__
+  // デバッグ出力とは混ぜない
+  if (Serial && Serial.availableForWrite() >= (int)sizeof(buffer)) {
+    auto len = utils::trace::drain(buffer, sizeof(buffer));
+    if (len > 0) {
+      Serial.write(buffer, len);
+    }
+  }
+#endif
+#endif
+}
+
+
 /**
  * @brief 初期化処理
  */
 void setup()
 {
+  // 起動の段階ごとの時間を記録する(Serialを使わないので常に有効)
+  utils::boot_profiler::begin(readResetReason());
+
   debugInit();
+  utils::trace::begin();
   stopwatch_ms();
 
 #if 0
@@ -66,11 +637,20 @@ void setup()
   }
 #endif
 
-  // 外部Flashは使わないので停止
-  {
+  // DeepSleepからの復帰なら保持したRAMから設定を復元する
+  uint8_t retainedLayer = 0;
+  auto isRestored = config_manager::restore(retainedLayer);
+  auto isWarmBoot = isRestored && (readResetReason() & POWER_RESETREAS_OFF_Msk);
+  utils::boot_profiler::setRetainedStatus(utils::retained_ram::getStatus());
+  utils::energy_meter::begin(); // 復元した積算値に続けて数える
+  utils::boot_profiler::mark(utils::boot_profiler::RESTORE);
+
+  // 外部Flashは使わないので停止(DeepSleepからの復帰なら停止したまま)
+  if (!isWarmBoot) {
     stopwatch_ms();
     sleep_controller::enterSleepQSPIFlash();
   }
+  utils::boot_profiler::mark(utils::boot_profiler::QSPI_SLEEP);
   
 
   // ピン初期設定
@@ -82,21 +662,71 @@ void setup()
   mode_sw::assign();
   joystick::assign();
   led_indicator::assign();
+  battery::assign();
+
+  // スリープ前に止める周辺機能
+  led_indicator::registerPeripherals();
+  active_idle::registerPeripherals();
+  sleep_controller::registerPeripherals();
 
   // 未使用ピン
   pinMode(gpio::UNUSED_1, OUTPUT); 
   digitalWrite(gpio::UNUSED_1, LOW);
   pinMode(gpio::UNUSED_2, OUTPUT); 
   digitalWrite(gpio::UNUSED_2, LOW);
+  utils::boot_profiler::mark(utils::boot_profiler::PIN_ASSIGN);
 
   // 設定値読み込み
-  config_manager::init();
+  if (isWarmBoot) {
+    currentLayer = (retainedLayer < 2) ? retainedLayer : 0;
+    DEBUG_PRINTF("restored from retained ram");
+  } else {
+    config_manager::init();
+  }
+  utils::boot_profiler::mark(utils::boot_profiler::CONFIG_LOAD);
   applyConfig();
+  utils::boot_profiler::mark(utils::boot_profiler::APPLY_CONFIG);
 
   // BLE初期化
   ble::init();
+  utils::power_manager::begin();
+  ble::ble_link::init();
   ble::ble_hid::init();
-  ble::ble_config::init();
+  ble::ble_battery::init();
+  if (!ble::ble_config::init()) {
+    DEBUG_PRINTF("config service is incomplete");
+  }
+  ble::conn_param_manager::init();
+  ble::link_monitor::init();
+  utils::boot_profiler::mark(utils::boot_profiler::BLE_INIT);
+
+  // アドバタイズ前(無線が止まっている間)に最初の残量を測っておく
+  sampleBattery();
+  utils::boot_profiler::mark(utils::boot_profiler::BATTERY);
+
+  ble::ble_config::setUpdateConfigCallback([](const config& cfg) {
+    DEBUG_PRINTF("config updated by ble %f", cfg.getMickeyScale());
+    config_manager::updateConfig(cfg);
+    isConfigUpdated = true;
+  });
+  ble::ble_config::setUpdateKeyProfCallback([](const key_profiles& profs) {
+    DEBUG_PRINTF("updated key profiles ");
+    config_manager::updateKeyProfiles(profs);
+    isConfigUpdated = true;
+  });
+  ble::ble_config::setResetLatencyCallback([]() {
+    isLatencyResetRequested = true;
+  });
+  ble::ble_link::setDisconnectCallback([](ble::ble_link::Link link, ble::ble_link::Role role) {
+    // 設定アプリから切断されたらデバイスモードに戻る
+    if (role == ble::ble_link::CONFIG && mode == Mode::CONFIG) {
+      mode = Mode::DEVICE;
+      ble::ble_config::end();
+    }
+  });
+  modeSwitch.update();
+  beginHid();
+  ble::ble_hid::markWake(isWarmBoot ? ble::ble_hid::WAKE_WARM_BOOT : ble::ble_hid::WAKE_COLD_BOOT, 0);
 
 #if 0
   Bluefruit.Periph.clearBonds();
@@ -105,8 +735,25 @@ void setup()
   // セットアップ済み
   led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
 
+  // タスク登録(周期/デッドラインはus)
+  // スキャン/レポートは操作状況に応じた周期(ボタンのエッジでは割り込みで即時スキャン)
+  scanTask = taskScheduler.addPeriodic("scan", scan, governor.getPeriodUs(), 1000);
+  reportTask = taskScheduler.addPeriodic("report", flushTask, governor.getPeriodUs(), 1000);
+  taskScheduler.addPeriodic("link", linkTask, 20000);
+  taskScheduler.addPeriodic("led", ledTask, 20000);
+  taskScheduler.addPeriodic("sleep", sleepTask, 100000);
+  taskScheduler.addPeriodic("config", configTask, 20000);
+  persistTask = taskScheduler.addOneShot("persist", persistConfigTask, 100000);
+  taskScheduler.addPeriodic("stats", statsTask, 1000000);
+  taskScheduler.addPeriodic("battery", batteryTask, 1000000);
+  taskScheduler.addPeriodic("trace", traceTask, 50000);
+
+  // タスク間の待機中にボタンのエッジで起床する(setupとloopは同じタスクで動く)
+  active_idle::enable();
+
   // スリープカウンタリセット
   sleep_controller::resetSleepCount();
+  utils::boot_profiler::mark(utils::boot_profiler::HID_BEGIN);
 }
 
 
@@ -115,162 +762,13 @@ void setup()
  */
 void loop()
 {
-  static Mode mode = Mode::DEVICE;
-  bool wasAction = false;
-  stopwatch_ms();
-
-  // モードトグル
-  joystick_button.update();
-  if (joystick_button.isLongPressed()) {
-    joystick_button.reset();
-
-    switch(mode) {
-      case DEVICE:
-      {
-        mode = Mode::CONFIG;
-        led_indicator::startBlink(module::Color::PURPLE, 500);
-        ble::ble_hid::disconnect();
-        break;
-      }
-        
-      case CONFIG:
-      {
-        mode = Mode::DEVICE;
-        led_indicator::stopBlink(); 
-        ble::ble_config::disconnect();
-        led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
-        break;
-      }
-    }
-  }
-
-  // メイン処理
-  switch(mode) {
-
-    // 設定モード
-    case Mode::CONFIG:
-    {
-      {
-        if (!ble::ble_config::isConnected()) {
-          DEBUG_PRINTF("start advertising ble config");
-
-          ble::ble_config::setUpdateConfigCallback([](const config& cfg) {
-            DEBUG_PRINTF("config updated by ble %f", cfg.getMickeyScale());
-            config_manager::saveConfig(cfg);
-            applyConfig();
-          });
-          ble::ble_config::setUpdateKeyProfCallback([](const key_profiles& profs) {
-            DEBUG_PRINTF("updated key profiles ");
-            config_manager::saveKeyProfiles(profs);
-            applyConfig();
-          });
-          ble::ble_config::setDisconnectCallback([](){
-            mode = Mode::DEVICE;
-          });
-
-          ble::ble_config::connect(config_manager::getGlobalConfig(), config_manager::getKeyProfiles(), 5000);
-        }
-      }
-    }
-    break;
-
-
-    // デバイスモード
-    case Mode::DEVICE:
-    {
-      // BLEアドバタイズ(完了まで待機)
-      // TODO: ボタン切り替え未実装のためとりあえず固定
-      //ble::begin(mode_sw::isPressed() ? 0 : 1);
-      if (!ble::ble_hid::isConnected()){
-        stopwatch_ms("ble connect");
-        auto& cfg = config_manager::getGlobalConfig();
-        led_indicator::startBlink(module::Color::BLUE, 500);
-        bool connected = ble::ble_hid::connect(1, 5000, ble::ConnectionParam{
-          .connectionIntervalMin = cfg.getConnectionIntervalMin(),
-          .connectionIntervalMax = cfg.getConnectionIntervalMax(),
-          .slaveLatency = 0,
-          .timeout = 2000,
-          .txPower = cfg.getTxPower()
-        });
-
-        if (connected) {
-          DEBUG_PRINTF("connected hid!");
-          led_indicator::stopBlink();
-          led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
-
-          {
-            mouseLayer.configure(cfg.getMouseNegativeGain(), cfg.getMickeyScale(), cfg.getMouseReportIntervalMs());
-          }
-
-          wasAction = true;
-        }
-        
-        goto FINALIZE;
-      }
-
-      // 入力処理
-      switch (currentLayer)
-      {
-        case 0: // mouse layer
-        {
-          if (joystick_button.isClicked()) {
-            currentLayer = 1;
-            led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
-            break;
-          }
-          wasAction = mouseLayer.action();
-          break;
-        }
-
-        case 1: // keyboard layer
-        {
-          if (joystick_button.isClicked()) {
-            currentLayer = 0;
-            led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
-
-            // 全てボタン離す
-            // TODO: 無理やりやってるので後でコード整理
-            ble::ble_hid::keyRelease();
-            applyConfig(); // TODO: リセット処理は別にしたい
-
-            break;
-          }
-          auto [chord, event] = keyboardLayer.scanChord(config_manager::getGlobalConfig().getChordScanTimeoutMs());
-          wasAction = keyboardLayer.action(chord, event);
-          break;
-        }
-      }
-    }
-
-    break;
+  if (taskScheduler.runOnce()) {
+    return ;
   }
 
-FINALIZE:
-
-  // 操作ありならスリープカウントリセット
-  if (wasAction || mode==Mode::CONFIG)
-  {
-    sleep_controller::resetSleepCount();
-  }
-
-  // スリープ処理
-  if (sleep_controller::shouldEnterSleep(config_manager::getGlobalConfig().getLightSleepTimeoutMs()))
-  {
-    led_indicator::turnOff();
-    led_indicator::stopBlink();
-    
-    // SystemONSleepでタイムアウトした場合はDeepSleepに移行
-    auto wasTimeout = sleep_controller::enterLightSleep(config_manager::getGlobalConfig().getDeepSleepTimeoutMs());
-    if (wasTimeout) {
-      sleep_controller::enterDeepSleep();
-      // ここからは復帰しない→setup()に戻る
-    }
-
-    // lightsleep通常復帰
-    led_indicator::turnOnWith(LAYER_COLORS[currentLayer]);
-    applyConfig();
-    sleep_controller::resetSleepCount();
+  // 次のリリースまで待機(アイドルタスクがsd_app_evt_wait()で眠る)
+  if (active_idle::wait(taskScheduler.getNextReleaseUs())) {
+    // ボタンのエッジは周期を待たずにスキャン
+    taskScheduler.trigger(scanTask);
   }
-  //delayMicroseconds(500);
-  //yield();
 }
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+#include <utils/saadc_input.h>
+
+namespace module
+{
+    /**
+     * @brief バッテリー電圧(VBAT)の測定クラス
+     * @details XIAO nRF52840のVBATは1MΩ/510kΩの分圧でAIN7に入り、分圧の下側はenableピンをLOWにしたときだけつながる。
+     *          enableピンは常にLOWを出力して分圧をつないだままにする(約3uA流れる)。
+     *          切り離すと分圧の下側が浮き、AIN7(P0.31)に1MΩを通してVBATがそのままかかる(VDDを超えるため定格外)。
+     *          分圧の出力インピーダンスが高い(約340kΩ)ため、analogRead()(取り込み3us)ではなく取り込み40usで変換する。
+     * @tparam pin       VBATのピン番号
+     * @tparam pinEnable 分圧を有効にするピン番号(LOWで有効)
+     * @note enableピンはHIGHを出力しないこと(充電中にVBATがピンにかかる)。入力(ハイインピーダンス)にもしないこと
+     * @note analogRead()と同じタスクから呼ぶ前提(SAADCのチャネル0を使い、終わったら未接続に戻す)
+     */
+    template <uint8_t pin, uint8_t pinEnable>
+    class battery
+    {
+    public:
+        battery() = delete;
+
+
+        /**
+         * @brief ピンをアサインする(分圧はつないだままにする)
+         */
+        static void assign()
+        {
+            pinMode(pinEnable, OUTPUT);
+            digitalWrite(pinEnable, LOW);
+            pinMode(pin, INPUT);
+        }
+
+
+        /**
+         * @brief VBATを測る
+         * @return 電圧(mV)
+         * @note 8回のオーバーサンプリングで約350us間CPUを止める
+         */
+        static uint32_t readMilliVolts()
+        {
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+            NRF_SAADC->RESOLUTION = SAADC_RESOLUTION_VAL_12bit;
+            NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Over8x;
+            NRF_SAADC->SAMPLERATE = SAADC_SAMPLERATE_MODE_Task << SAADC_SAMPLERATE_MODE_Pos;
+            NRF_SAADC->CH[0].CONFIG = (SAADC_CH_CONFIG_RESP_Bypass << SAADC_CH_CONFIG_RESP_Pos)
+                                    | (SAADC_CH_CONFIG_RESN_Bypass << SAADC_CH_CONFIG_RESN_Pos)
+                                    | (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos)
+                                    | (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos)
+                                    | (SAADC_CH_CONFIG_TACQ_40us << SAADC_CH_CONFIG_TACQ_Pos)
+                                    | (SAADC_CH_CONFIG_MODE_SE << SAADC_CH_CONFIG_MODE_Pos)
+                                    | (SAADC_CH_CONFIG_BURST_Enabled << SAADC_CH_CONFIG_BURST_Pos); // 1回のSAMPLEでオーバーサンプリング分変換
+            NRF_SAADC->CH[0].PSELP = utils::toAnalogInput(pin);
+            NRF_SAADC->CH[0].PSELN = SAADC_CH_PSELN_PSELN_NC;
+
+            volatile int16_t result = 0;
+            NRF_SAADC->RESULT.PTR = (uint32_t)&result;
+            NRF_SAADC->RESULT.MAXCNT = 1;
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+
+            NRF_SAADC->EVENTS_STARTED = 0;
+            NRF_SAADC->TASKS_START = 1;
+            while (NRF_SAADC->EVENTS_STARTED == 0);
+            NRF_SAADC->EVENTS_STARTED = 0;
+
+            NRF_SAADC->EVENTS_END = 0;
+            NRF_SAADC->TASKS_SAMPLE = 1;
+            while (NRF_SAADC->EVENTS_END == 0);
+            NRF_SAADC->EVENTS_END = 0;
+
+            NRF_SAADC->EVENTS_STOPPED = 0;
+            NRF_SAADC->TASKS_STOP = 1;
+            while (NRF_SAADC->EVENTS_STOPPED == 0);
+            NRF_SAADC->EVENTS_STOPPED = 0;
+
+            // analogRead()が設定し直せるよう戻す
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+            NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Bypass;
+            NRF_SAADC->CH[0].CONFIG = 0x00020000; // リセット値
+            NRF_SAADC->CH[0].PSELP = SAADC_CH_PSELP_PSELP_NC;
+
+            // 12bit、3.6V基準。分圧(1000k + 510k) / 510k を戻す
+            int32_t raw = max((int16_t)0, (int16_t)result);
+            return (uint64_t)raw * FULL_SCALE_MV * (DIVIDER_HIGH_KOHM + DIVIDER_LOW_KOHM) / (4096 * DIVIDER_LOW_KOHM);
+        }
+
+    private:
+        static constexpr uint32_t FULL_SCALE_MV = 3600; ///< 内部0.6V基準でゲイン1/6
+        static constexpr uint32_t DIVIDER_HIGH_KOHM = 1000;
+        static constexpr uint32_t DIVIDER_LOW_KOHM = 510;
+    };
+}
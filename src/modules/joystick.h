@@ -29,6 +29,15 @@ namespace module
         }
 
 
+        /**
+         * @brief 数値を反転させるか
+         */
+        constexpr static bool isInverse()
+        {
+            return inverse;
+        }
+
+
         /**
          * @brief ピンをアサインする
          */
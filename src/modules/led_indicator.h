@@ -1,6 +1,8 @@
 #pragma once
 
 #include <Arduino.h>
+#include <utils/power_manager.h>
+#include <utils/hw_resources.h>
 
 
 namespace module
@@ -10,6 +12,7 @@ namespace module
      */
     enum Color
     {
+        OFF = 0x00,
         RED = 0x04,
         GREEN = 0x02,
         BLUE = 0x01,
@@ -22,32 +25,85 @@ namespace module
 
     /**
      * @brief LEDインジケータの制御クラス。アノードコモン
+     * @details PWM3のEasyDMAシーケンスで明るさ/点滅/呼吸/色の切り替えを再生する。再生中にCPUは関与しない。
+     *          点灯中もPWMで明るさ(デューティ比)を下げて光らせる。消灯中はPWMを止め、GPIOはHIGH(消灯)のまま。
      * @tparam pinRed   赤のピン番号
      * @tparam pinGreen 緑のピン番号
      * @tparam pinBlue  青のピン番号
+     * @note PWM3はanalogWrite()/tone()と共用しない前提
      */
     template <uint8_t pinRed, uint8_t pinGreen, uint8_t pinBlue>
     class led_indicator
     {
     public:
+        static constexpr uint8_t DEFAULT_BRIGHTNESS = 8; ///< 明るさの既定値(%)
+
+        /// 使うハードウェア資源
+        using resources = utils::hw_resources<0, 0, 0, 0, utils::hw_bits(3)>;
+
         led_indicator() = default;
 
 
         /**
          * @brief ピンをアサイン
          */
-        constexpr static void assign()
+        static void assign()
         {
             pinMode(pinRed, OUTPUT);
             pinMode(pinGreen, OUTPUT);
             pinMode(pinBlue, OUTPUT);
+            turnOff();
+        }
+
+
+        /**
+         * @brief 使う周辺機能をpower_managerに登録
+         * @details スリープ前にPWMを止める。再開は呼び出し側で表示し直す
+         */
+        static void registerPeripherals()
+        {
+            utils::power_manager::add("led", "PWM3", isActive, turnOff, nullptr);
+        }
+
+
+        /**
+         * @brief PWMで再生中(点灯/点滅)か
+         */
+        static inline bool isActive()
+        {
+            return PWM->ENABLE != 0;
+        }
+
+
+        /**
+         * @brief 点灯中の全チャネルのデューティの合計(‰)
+         * @note 点滅/呼吸も点灯時の値(電流の見積もり用)
+         */
+        static inline uint32_t getDutyPermille()
+        {
+            if (!isActive()) {
+                return 0;
+            }
+            uint32_t channels = ((_color & RED) ? 1 : 0) + ((_color & GREEN) ? 1 : 0) + ((_color & BLUE) ? 1 : 0);
+            return channels * _brightness * 10;
+        }
+
+
+        /**
+         * @brief 明るさを設定する
+         * @param [in] percent 明るさ(%)
+         * @note 次に点灯/点滅を開始したときから反映する
+         */
+        static inline void setBrightness(const uint8_t percent)
+        {
+            _brightness = min(percent, (uint8_t)100);
         }
 
 
         /**
          * @brief 色を設定する
          * @param [in] color 色
-         * 
+         *
          * @note 指定した色で点灯させるにはturnOnをコール
          */
         static inline void setColor(const Color color)
@@ -60,12 +116,11 @@ namespace module
          * @brief 点灯します
          * @note setColorで設定した色になります
          */
-        constexpr static void turnOn()
+        static void turnOn()
         {
-            // アノードコモンのため、LOWで点灯
-            digitalWrite(pinRed,   !((_color & RED)   >> 2));
-            digitalWrite(pinGreen, !((_color & GREEN) >> 1));
-            digitalWrite(pinBlue,  !((_color & BLUE)  ));
+            stop();
+            setStep(0, _color, duty());
+            play(1, 1, false);
         }
 
 
@@ -73,9 +128,8 @@ namespace module
          * @brief 指定した色で点灯します
          * @param [in] color 色
          */
-        constexpr static void turnOnWith(const Color color)
+        static void turnOnWith(const Color color)
         {
-            turnOff();
             setColor(color);
             turnOn();
         }
@@ -84,157 +138,169 @@ namespace module
         /**
          * @brief 消灯します
          */
-        constexpr static void turnOff()
+        static void turnOff()
         {
+            stop();
             digitalWrite(pinRed, HIGH);
             digitalWrite(pinGreen, HIGH);
             digitalWrite(pinBlue, HIGH);
         }
 
 
-        constexpr static void startBlink(const Color color, const uint32_t intervalMs)
+        static void startBlink(const Color color, const uint32_t intervalMs)
         {
-            turnOff();
             setColor(color);
             startBlink(intervalMs);
         }
 
         /**
          * @brief 点滅を開始します
-         * @param interval 点滅間隔(ms)
-         * @note 色はsetRGBで設定した色になります
+         * @param interval 点滅間隔(ms)。点灯と消灯をそれぞれこの時間続ける
+         * @note 色はsetColorで設定した色になります
          */
-        static inline void startBlink(const uint32_t intervalMs)
+        static void startBlink(const uint32_t intervalMs)
         {
-            if (_isBlinking) {
-                return ;
-            }
+            const Color colors[] = {_color, Color::OFF};
+            startPattern(colors, 2, intervalMs);
+        }
 
-            // タイマーカウント値を計算（31.25kHz で interval_ms 毎に割り込み）
-            uint32_t ticks = 31250 * intervalMs / 1000;
-
-            NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
-            
-            // -----------------------------
-            // GPIOTE 設定（色ごとに設定）
-            // 各ピンを「トグルするタスク」に割り当てる
-            // -----------------------------
-
-            if (_color & RED)
-            {
-                NRF_GPIOTE->CONFIG[GPIOTE_RED_CH] =
-                    (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos) |
-                    (g_ADigitalPinMap[pinRed] << GPIOTE_CONFIG_PSEL_Pos) |
-                    (GPIOTE_CONFIG_POLARITY_Toggle << GPIOTE_CONFIG_POLARITY_Pos) |
-                    (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos); // 初期値LOW
-            }
 
-            if (_color & GREEN)
-            {
-                NRF_GPIOTE->CONFIG[GPIOTE_GREEN_CH] =
-                    (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos) |
-                    (g_ADigitalPinMap[pinGreen] << GPIOTE_CONFIG_PSEL_Pos) |
-                    (GPIOTE_CONFIG_POLARITY_Toggle << GPIOTE_CONFIG_POLARITY_Pos) |
-                    (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
-            }
+        /**
+         * @brief 呼吸(ゆっくり明るくなって暗くなる)を開始します
+         * @param [in] color    色
+         * @param [in] periodMs 1周期(ms)
+         */
+        static void startBreath(const Color color, const uint32_t periodMs)
+        {
+            stop();
+            setColor(color);
 
-            if (_color & BLUE)
-            {
-                NRF_GPIOTE->CONFIG[GPIOTE_BLUE_CH] =
-                    (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos) |
-                    (g_ADigitalPinMap[pinBlue] << GPIOTE_CONFIG_PSEL_Pos) |
-                    (GPIOTE_CONFIG_POLARITY_Toggle << GPIOTE_CONFIG_POLARITY_Pos) |
-                    (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
+            // 明るさは2乗で変える(暗い側で変化が見えるように)
+            constexpr size_t half = MAX_STEPS / 2;
+            uint32_t peak = duty();
+            for (size_t i = 0; i < half; i++) {
+                uint16_t value = (peak * i * i) / ((half - 1) * (half - 1));
+                setStep(i, color, value);
+                setStep(MAX_STEPS - 1 - i, color, value);
             }
+            play(MAX_STEPS, periodMs / MAX_STEPS, true);
+        }
 
-            // -----------------------------
-            // TIMER1 設定
-            // -----------------------------
-
-            NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer << TIMER_MODE_MODE_Pos; // タイマーモード
-            NRF_TIMER1->PRESCALER = 9;                                       // 16MHz / 2^9 = 31.25kHz
-            NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit << TIMER_BITMODE_BITMODE_Pos;
-            NRF_TIMER1->CC[0] = ticks;                                                                   // 指定間隔のカウント値設定
-            NRF_TIMER1->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos; // 自動リセット
-            NRF_TIMER1->TASKS_START = 1;                                                                 // タイマー開始
-
-            // -----------------------------
-            // PPI 設定：タイマーイベント → GPIOTE タスクを接続
-            // -----------------------------
-
-            if (_color & RED)
-            {
-                NRF_PPI->CH[PPI_RED_CH].EEP = (uint32_t)&NRF_TIMER1->EVENTS_COMPARE[0];        // イベント：タイマー0一致
-                NRF_PPI->CH[PPI_RED_CH].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[GPIOTE_RED_CH]; // タスク：GPIOTEで出力トグル
-                NRF_PPI->CHENSET = (1 << PPI_RED_CH);                                          // PPIチャネル有効化
-            }
 
-            if (_color & GREEN)
-            {
-                NRF_PPI->CH[PPI_GREEN_CH].EEP = (uint32_t)&NRF_TIMER1->EVENTS_COMPARE[0];
-                NRF_PPI->CH[PPI_GREEN_CH].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[GPIOTE_GREEN_CH];
-                NRF_PPI->CHENSET = (1 << PPI_GREEN_CH);
+        /**
+         * @brief 色の並びを繰り返し再生します
+         * @param [in] colors 色の並び(OFFは消灯)
+         * @param [in] count  色の数(MAX_STEPSまで)
+         * @param [in] stepMs 1色を表示する時間(ms)
+         */
+        static void startPattern(const Color* colors, const size_t count, const uint32_t stepMs)
+        {
+            stop();
+            auto steps = min(count, MAX_STEPS);
+            for (size_t i = 0; i < steps; i++) {
+                setStep(i, colors[i], duty());
             }
+            play(steps, stepMs, true);
+        }
 
-            if (_color & BLUE)
-            {
-                NRF_PPI->CH[PPI_BLUE_CH].EEP = (uint32_t)&NRF_TIMER1->EVENTS_COMPARE[0];
-                NRF_PPI->CH[PPI_BLUE_CH].TEP = (uint32_t)&NRF_GPIOTE->TASKS_OUT[GPIOTE_BLUE_CH];
-                NRF_PPI->CHENSET = (1 << PPI_BLUE_CH);
-            }
 
-            _isBlinking = true;
+        /**
+         * @brief 点滅を停止します(消灯)
+         */
+        static void stopBlink()
+        {
+            turnOff();
         }
 
-        
+    private:
+        inline static NRF_PWM_Type* const PWM = NRF_PWM3;
+
+        static constexpr size_t MAX_STEPS = 64;
+        static constexpr uint16_t COUNTER_TOP = 1000;         ///< 1MHz / 1000 = 1kHz(1周期1ms)
+        static constexpr uint32_t STOP_TIMEOUT_US = 2000;     ///< 停止待ち(1周期の終わりで止まる)
+
+        inline static Color _color  = Color::GREEN;
+        inline static uint8_t _brightness = DEFAULT_BRIGHTNESS;
+        inline static uint16_t _sequence[MAX_STEPS][4] = {};  ///< EasyDMAの読み出し元(RGB+未使用)。再生中は書き換えない
+
+
         /**
-         * @brief 点滅を停止します
+         * @brief 明るさに応じたデューティ(カウント)
          */
-        static inline void stopBlink()
+        static inline uint16_t duty()
         {
-            if (!_isBlinking) {
-                return ;
-            }
+            return (uint32_t)COUNTER_TOP * _brightness / 100;
+        }
 
-            // タイマー停止＆リセット
-            NRF_TIMER1->TASKS_STOP = 1;
-            NRF_TIMER1->TASKS_CLEAR = 1;
 
-            // GPIOTE設定解除 & LED OFF
-            if (_color & RED)
-            {
-                NRF_PPI->CHENCLR = (1 << PPI_RED_CH);
-                NRF_GPIOTE->CONFIG[GPIOTE_RED_CH] = 0;
-                digitalWrite(pinRed, HIGH);
-            }
+        /**
+         * @brief シーケンスの1段を設定
+         * @details 極性0(最初がLOW)でカウントが比較値に達するまでLOW=点灯
+         */
+        static inline void setStep(const size_t step, const Color color, const uint16_t value)
+        {
+            _sequence[step][0] = (color & RED)   ? value : 0;
+            _sequence[step][1] = (color & GREEN) ? value : 0;
+            _sequence[step][2] = (color & BLUE)  ? value : 0;
+            _sequence[step][3] = 0;
+        }
 
-            if (_color & GREEN)
-            {
-                NRF_PPI->CHENCLR = (1 << PPI_GREEN_CH);
-                NRF_GPIOTE->CONFIG[GPIOTE_GREEN_CH] = 0;
-                digitalWrite(pinGreen, HIGH);
-            }
 
-            if (_color & BLUE)
-            {
-                NRF_PPI->CHENCLR = (1 << PPI_BLUE_CH);
-                NRF_GPIOTE->CONFIG[GPIOTE_BLUE_CH] = 0;
-                digitalWrite(pinBlue, HIGH);
+        /**
+         * @brief シーケンスを再生する
+         * @param [in] steps  段数
+         * @param [in] stepMs 1段の時間(ms)
+         * @param [in] isLoop 繰り返すか。繰り返さない場合は最後の段を保つ
+         */
+        static void play(const size_t steps, const uint32_t stepMs, const bool isLoop)
+        {
+            PWM->PSEL.OUT[0] = g_ADigitalPinMap[pinRed];
+            PWM->PSEL.OUT[1] = g_ADigitalPinMap[pinGreen];
+            PWM->PSEL.OUT[2] = g_ADigitalPinMap[pinBlue];
+            PWM->PSEL.OUT[3] = PWM_PSEL_OUT_CONNECT_Disconnected << PWM_PSEL_OUT_CONNECT_Pos;
+
+            PWM->ENABLE = PWM_ENABLE_ENABLE_Enabled << PWM_ENABLE_ENABLE_Pos;
+            PWM->MODE = PWM_MODE_UPDOWN_Up << PWM_MODE_UPDOWN_Pos;
+            PWM->PRESCALER = PWM_PRESCALER_PRESCALER_DIV_16 << PWM_PRESCALER_PRESCALER_Pos; // 16MHz / 16 = 1MHz
+            PWM->COUNTERTOP = COUNTER_TOP;
+            PWM->DECODER = (PWM_DECODER_LOAD_Individual << PWM_DECODER_LOAD_Pos)
+                         | (PWM_DECODER_MODE_RefreshCount << PWM_DECODER_MODE_Pos);
+
+            // 1段をstepMs周期(1周期1ms)続ける
+            auto refresh = (stepMs > 0) ? min(stepMs - 1, (uint32_t)PWM_SEQ_REFRESH_CNT_Msk) : 0;
+            for (int i = 0; i < 2; i++) {
+                PWM->SEQ[i].PTR = (uint32_t)_sequence;
+                PWM->SEQ[i].CNT = steps * 4;
+                PWM->SEQ[i].REFRESH = refresh;
+                PWM->SEQ[i].ENDDELAY = 0;
             }
 
-            _isBlinking = false;
+            // 繰り返す場合はSEQ[0]->SEQ[1]->SEQ[0]...とショートで続ける
+            PWM->LOOP = isLoop ? 1 : 0;
+            PWM->SHORTS = isLoop ? (PWM_SHORTS_LOOPSDONE_SEQSTART0_Enabled << PWM_SHORTS_LOOPSDONE_SEQSTART0_Pos) : 0;
+            PWM->EVENTS_STOPPED = 0;
+            PWM->TASKS_SEQSTART[0] = 1;
         }
 
-    private:
-        inline static Color _color  = Color::GREEN;
-        inline static bool _isBlinking = false;
 
-        constexpr static int GPIOTE_RED_CH = 0;
-        constexpr static int GPIOTE_GREEN_CH = 1;
-        constexpr static int GPIOTE_BLUE_CH = 2;
+        /**
+         * @brief 再生を止めてPWMを無効にする(ピンはGPIOに戻る)
+         */
+        static void stop()
+        {
+            if (!isActive()) {
+                return ;
+            }
 
-        constexpr static int PPI_RED_CH = 0;
-        constexpr static int PPI_GREEN_CH = 1;
-        constexpr static int PPI_BLUE_CH = 2;
+            PWM->SHORTS = 0;
+            PWM->TASKS_STOP = 1;
+            auto t0 = micros();
+            while (PWM->EVENTS_STOPPED == 0 && (micros() - t0) < STOP_TIMEOUT_US);
+            PWM->EVENTS_STOPPED = 0;
+            PWM->ENABLE = PWM_ENABLE_ENABLE_Disabled << PWM_ENABLE_ENABLE_Pos;
+            for (int i = 0; i < 4; i++) {
+                PWM->PSEL.OUT[i] = PWM_PSEL_OUT_CONNECT_Disconnected << PWM_PSEL_OUT_CONNECT_Pos;
+            }
+        }
     };
 }
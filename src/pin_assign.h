@@ -17,6 +17,9 @@ namespace gpio {
     //constexpr int MODE          =  D2; ///< BLE接続先切り替え(HIGH: PC, LOW: スマホ)
     constexpr int MODE          =  D5; ///< BLE接続先切り替え(HIGH: PC, LOW: スマホ)
     
+    constexpr int BATTERY        = PIN_VBAT;    ///< VBAT(分圧)
+    constexpr int BATTERY_ENABLE = VBAT_ENABLE; ///< VBATの分圧を有効にする(LOWで有効。HIGHは出力しない)
+
     constexpr int UNUSED_1     =  D3; ///< 未使用
     constexpr int UNUSED_2     =  D4; ///< 未使用
 }
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <Arduino.h>
+#include <utils/debug.h>
+#include <utils/power_manager.h>
+#include <utils/hw_resources.h>
+#include <utils/latency_monitor.h>
+
+namespace utils
+{
+    /**
+     * @brief 起動中(アクティブ)のアイドル待機を管理するクラス
+     * @details 次のタスクのリリースまでFreeRTOSのタスクをブロックする。
+     *          ループタスクがブロックするとアイドルタスクのtickless idleがRTCのコンペアを設定してsd_app_evt_wait()で眠るため、
+     *          CPUはサンプリング周期でだけ起きるようになる。
+     *          ボタンのエッジはGPIOTEの割り込みで待機を打ち切り、周期を待たずにスキャンさせる。
+     * @tparam wakeButtons 待機を打ち切るボタン
+     * @note GPIOTEのINチャネルをボタンの数だけ使う(attachInterruptは空いている若い番号から割り当てる)
+     */
+    template <typename... wakeButtons>
+    class active_idle
+    {
+    public:
+        /// 使うハードウェア資源(attachInterruptが空いている若い番号からGPIOTEを割り当てる)
+        using resources = hw_resources<0, (uint8_t)((1u << sizeof...(wakeButtons)) - 1)>;
+
+        active_idle() = delete;
+
+        /**
+         * @brief ボタン割り込みを有効化する
+         * @note 待機するタスク(loop)から呼ぶこと
+         */
+        static void enable()
+        {
+            _waitingTask = xTaskGetCurrentTaskHandle();
+            (attachInterrupt(wakeButtons::getPin(), onEdge, CHANGE), ...);
+            _isEnabled = true;
+        }
+
+
+        /**
+         * @brief ボタン割り込みを無効化する
+         * @note LightSleep中は別の方法(SENSE)で復帰するため無効にしておく
+         */
+        static void disable()
+        {
+            (detachInterrupt(wakeButtons::getPin()), ...);
+            _isEnabled = false;
+        }
+
+
+        /**
+         * @brief 使う周辺機能(GPIOTEのINチャネル)をpower_managerに登録
+         * @note 再開(enable())は待機するタスクから呼ばれる前提(スリープはloopから入る)
+         */
+        static void registerPeripherals()
+        {
+            utils::power_manager::add("active_idle", "GPIOTE IN", isEnabled, disable, enable);
+        }
+
+
+        static bool isEnabled()
+        {
+            return _isEnabled;
+        }
+
+
+        /**
+         * @brief 指定時間が経過するかボタンのエッジがあるまで待機する
+         * @param [in] timeoutUs 最大待機時間(us)
+         * @retval true  ボタンのエッジで起床した
+         * @retval false タイムアウトした
+         * @note tick単位に切り上げて待つため、最大1tick(約976us)遅れて起きる。
+         *       切り捨てると1tick未満の待機や端数がloop()の空回りになり、1ms周期では常にCPUが回り続ける。
+         *       遅れはスキャンのデッドラインの余裕(1000us)に収まる
+         */
+        static bool wait(const uint32_t timeoutUs)
+        {
+            if (timeoutUs == 0) {
+                return false;
+            }
+            uint64_t ticks = ((uint64_t)timeoutUs * configTICK_RATE_HZ + 999999) / 1000000;
+            if (ticks > portMAX_DELAY - 1) {
+                ticks = portMAX_DELAY - 1;
+            }
+
+            auto t0 = micros();
+            auto notified = ulTaskNotifyTake(pdTRUE, (TickType_t)ticks);
+            _idleUs += micros() - t0;
+            return notified > 0;
+        }
+
+
+        /**
+         * @brief 前回の呼び出しからのCPU稼働率を取得
+         * @return 稼働率(‰)
+         */
+        static uint32_t takeBusyPermille()
+        {
+            auto now = micros();
+            auto totalUs = now - _lastTakeUs;
+            auto idleUs = _idleUs;
+            _idleUs = 0;
+            _lastTakeUs = now;
+
+            if (totalUs == 0 || idleUs >= totalUs) {
+                return 0;
+            }
+            return ((uint64_t)(totalUs - idleUs) * 1000) / totalUs;
+        }
+
+    private:
+        static inline TaskHandle_t _waitingTask = nullptr;
+        static inline bool _isEnabled = false;
+        static inline volatile uint32_t _idleUs = 0;
+        static inline uint32_t _lastTakeUs = 0;
+
+        /**
+         * @brief ボタンのエッジ割り込み(割り込みコンテキスト)
+         */
+        static void onEdge()
+        {
+            latency_monitor::onEdge();
+            if (!_waitingTask) {
+                return ;
+            }
+            BaseType_t woken = pdFALSE;
+            vTaskNotifyGiveFromISR(_waitingTask, &woken);
+            portYIELD_FROM_ISR(woken);
+        }
+    };
+}
@@ -42,8 +42,9 @@ class axis_detector
             _wasUp = _isUp;
             _wasDown = _isDown;
 
-            _isUp = _value > (_center + THRE);
-            _isDown = _value < (_center - THRE);
+            // 一度倒れたと判定したらHYST分戻るまで維持し、閾値付近でのばたつきを抑える
+            _isUp = _value > (_center + (_wasUp ? THRE - HYST : THRE));
+            _isDown = _value < (_center - (_wasDown ? THRE - HYST : THRE));
         }
 
 
@@ -152,5 +153,6 @@ class axis_detector
         static constexpr uint32_t MAX_VALUE = 1023;
         static constexpr uint32_t MIN_VALUE = 0;
         static constexpr uint32_t THRE = (MAX_VALUE - MIN_VALUE) / 4;
+        static constexpr uint32_t HYST = THRE / 4; ///< ヒステリシス
 };
 
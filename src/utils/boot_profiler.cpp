@@ -0,0 +1,150 @@
+#include <utils/boot_profiler.h>
+#include <utils/retained_ram.h>
+#include <stdio.h>
+#include <string.h>
+
+using namespace utils;
+
+// リセットでゼロクリアされないよう.noinitに置く
+boot_profiler::History boot_profiler::_history __attribute__((section(".noinit")));
+
+
+/**
+ * @brief 今回の起動の記録を始める(setup()の最初に呼ぶ)
+ * @param [in] resetReason RESETREAS
+ * @note ここまでの時間をSTARTUPとして記録する
+ */
+void boot_profiler::begin(const uint32_t resetReason)
+{
+    auto now = micros();
+
+    auto status = validate();
+    if (status != retained_ram::VALID) {
+        memset(&_history, 0, sizeof(_history));
+        _history.magic = MAGIC;
+    }
+    _history.count++;
+
+    auto& boot = current();
+    memset(&boot, 0, sizeof(boot));
+    boot.resetReason = resetReason;
+    boot.historyStatus = status;
+    boot.phaseUs[STARTUP] = now;
+    boot.lastPhase = STARTUP;
+    seal();
+
+    _isRecording = true;
+    _lastMarkUs = micros(); // CRCの計算は次の段階に含めない
+}
+
+
+/**
+ * @brief 段階の終わりを記録する
+ * @param [in] phase 終わった段階
+ * @note 記録済みの段階より前の段階(2回目以降の接続など)は無視する。飛ばした段階は0になる
+ */
+void boot_profiler::mark(const Phase phase)
+{
+    if (!_isRecording) {
+        return ;
+    }
+    auto& boot = current();
+    if (phase <= boot.lastPhase) {
+        return ;
+    }
+
+    auto now = micros();
+    boot.phaseUs[phase] = now - _lastMarkUs;
+    boot.lastPhase = phase;
+    seal();
+    _lastMarkUs = micros(); // CRCの計算は次の段階に含めない
+}
+
+
+/**
+ * @brief 保持したRAMの読み出し結果を記録する
+ * @param [in] status utils::retained_ram::Status
+ * @note DeepSleepからの復帰(RESETREASのOFF)なのにVALIDでなければ、保持したRAMが失われている
+ */
+void boot_profiler::setRetainedStatus(const uint8_t status)
+{
+    if (!_isRecording) {
+        return ;
+    }
+    current().retainedStatus = status;
+    seal();
+}
+
+
+/**
+ * @brief 直近の起動の記録をJSONにシリアライズ(新しい順)
+ * @details [{"r":RESETREAS,"m":保持したRAMの読み出し結果,"h":記録の状態,"t":[段階ごとのus(未到達はnull)]}, ...]
+ * @return 書き込んだサイズ(終端文字を含まない)
+ */
+size_t boot_profiler::serializeStats(char* buffer, const size_t size)
+{
+    size_t length = snprintf(buffer, size, "[");
+    auto count = _isRecording ? min(_history.count, (uint32_t)HISTORY_COUNT) : 0;
+    for (uint32_t i = 0; i < count && length < size; i++) {
+        auto& boot = _history.boots[(_history.count - 1 - i) % HISTORY_COUNT];
+        length += snprintf(buffer + length, size - length, "%s{\"r\":%lu,\"m\":%u,\"h\":%u,\"t\":[",
+            (i == 0) ? "" : ",",
+            (unsigned long)boot.resetReason,
+            (unsigned)boot.retainedStatus,
+            (unsigned)boot.historyStatus);
+        for (size_t phase = 0; phase < PHASE_COUNT && length < size; phase++) {
+            bool isReached = phase <= boot.lastPhase;
+            if (isReached) {
+                length += snprintf(buffer + length, size - length, "%s%lu", (phase == 0) ? "" : ",", (unsigned long)boot.phaseUs[phase]);
+            } else {
+                length += snprintf(buffer + length, size - length, "%snull", (phase == 0) ? "" : ",");
+            }
+        }
+        if (length < size) {
+            length += snprintf(buffer + length, size - length, "]}");
+        }
+    }
+    if (length < size) {
+        length += snprintf(buffer + length, size - length, "]");
+    }
+    return min(length, size - 1);
+}
+
+
+/**
+ * @brief System OFF中も記録を保持する
+ * @note SoftDeviceを止めてから呼ぶこと
+ */
+void boot_profiler::retainInSystemOff()
+{
+    retained_ram::retainInSystemOff(&_history, sizeof(_history));
+}
+
+
+/**
+ * @brief 前回までの記録が使えるか確かめる
+ * @return utils::retained_ram::Status
+ */
+uint8_t boot_profiler::validate()
+{
+    if (!retained_ram::isPlacementValid(&_history, sizeof(_history))) {
+        return retained_ram::MISPLACED;
+    }
+    if (_history.magic != MAGIC) {
+        return retained_ram::EMPTY;
+    }
+    auto crc = retained_ram::crc32((const uint8_t*)&_history.count, sizeof(_history) - offsetof(History, count));
+    if (crc != _history.crc) {
+        return retained_ram::CORRUPTED;
+    }
+    return retained_ram::VALID;
+}
+
+
+/**
+ * @brief 記録を書き換えたらCRCを付け直す
+ */
+void boot_profiler::seal()
+{
+    _history.crc = retained_ram::crc32((const uint8_t*)&_history.count, sizeof(_history) - offsetof(History, count));
+}
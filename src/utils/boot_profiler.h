@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <Arduino.h>
+
+namespace utils
+{
+    /**
+     * @brief 起動から最初のHIDレポートまでの段階ごとの時間を記録するクラス
+     * @details 段階の終わりでmark()を呼ぶと、前のmark()からの時間(us)をその段階の時間にする。
+     *          記録は.noinitに置いたリングに直接書くため、リセット(System OFFからの復帰を含む)を跨いで直近HISTORY_COUNT回分が残る。
+     *          Serialに書かないので、デバッグビルドでなくても常に記録する。
+     * @note 最初の段階(STARTUP)はFreeRTOSのtick(RTC1)の開始からsetup()まで。ブートローダ/SoftDeviceの初期化は含まない
+     * @note 記録にはマジックナンバーとCRC32を付け、電源投入直後の不定な内容や壊れた内容は捨ててやり直す。
+     *       やり直したかどうかはその起動の記録に残す(どの段階まで記録したかによらない)
+     */
+    class boot_profiler
+    {
+    public:
+        /**
+         * @brief 起動の段階(この順に進む)
+         */
+        enum Phase : uint8_t
+        {
+            STARTUP = 0,  ///< setup()の開始まで
+            RESTORE,      ///< シリアルの初期化(デバッグ時)と保持したRAMからの設定の復元
+            QSPI_SLEEP,   ///< 外部Flashの停止(DeepSleepからの復帰では0)
+            PIN_ASSIGN,   ///< ピンの初期設定/周辺機能の登録
+            CONFIG_LOAD,  ///< Flashからの設定の読み込み(config_manager::init())。復帰時は0
+            APPLY_CONFIG, ///< applyConfig()
+            BLE_INIT,     ///< Bluefruit/各サービスの初期化
+            BATTERY,      ///< 最初のバッテリー電圧の測定
+            HID_BEGIN,    ///< HIDの開始からsetup()の終わりまで
+            ADVERTISING,  ///< HIDのアドバタイズ開始まで
+            CONNECT,      ///< HIDの接続(READY)まで
+            FIRST_REPORT, ///< 最初のレポートを送信キューに積むまで
+            PHASE_COUNT,
+        };
+
+        static constexpr size_t HISTORY_COUNT = 3; ///< 残す起動の回数(JSONが512バイトに収まる数)
+
+        boot_profiler() = delete;
+
+        static void begin(const uint32_t resetReason);
+        static void mark(const Phase phase);
+        static void setRetainedStatus(const uint8_t status);
+        static size_t serializeStats(char* buffer, const size_t size);
+        static void retainInSystemOff();
+
+    private:
+        static constexpr uint32_t MAGIC = 0x42545046; ///< "BTPF"
+
+        /**
+         * @brief 1回の起動の記録
+         */
+        struct Boot
+        {
+            uint32_t resetReason;           ///< RESETREAS(OFFならDeepSleepからの復帰)
+            uint8_t lastPhase;              ///< 記録済みの最後の段階(begin()でSTARTUPを記録する)
+            uint8_t retainedStatus;         ///< 保持したRAMの読み出し結果(utils::retained_ram::Status)
+            uint8_t historyStatus;          ///< この起動の開始時の記録の状態(utils::retained_ram::Status。VALID以外は捨ててやり直した)
+            uint8_t reserved;
+            uint32_t phaseUs[PHASE_COUNT];  ///< 段階ごとの時間(us)
+        };
+
+        struct History
+        {
+            uint32_t magic;
+            uint32_t crc;   ///< count以降のCRC32
+            uint32_t count; ///< 記録した起動の回数(最新はcount - 1)
+            Boot boots[HISTORY_COUNT];
+        };
+
+        static History _history;
+        static inline uint32_t _lastMarkUs = 0;
+        static inline bool _isRecording = false; ///< begin()を呼んだ(記録が有効)
+
+        static uint8_t validate();
+        static void seal();
+
+        static inline Boot& current()
+        {
+            return _history.boots[(_history.count - 1) % HISTORY_COUNT];
+        }
+    };
+}
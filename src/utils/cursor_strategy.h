@@ -104,14 +104,23 @@ class sampler
                 return MoveCursor{0, 0};
             }
 
+            _lastIntervalMs = now;
+            return take();
+        }
+
+
+        /**
+         * @brief 積算した移動距離のうち整数部をカーソル移動量として取り出す
+         * @return カーソル移動量
+         */
+        inline MoveCursor take()
+        {
             auto move = MoveCursor{
                 (int8_t)_assumedDistance.x,
                 (int8_t)_assumedDistance.y
             };
             DEBUG_PRINTF("moved ! %d,%d", move.x, move.y);
 
-            _lastIntervalMs = now;
-
             // 残差(小数部)は次回に持ち越し
             _assumedDistance.x -= (move.x);
             _assumedDistance.y -= (move.y);
@@ -79,6 +79,8 @@ private:
 #define __FILENAME__ (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 #define stopwatch_ms(...)          _stopwatch_ms __ss##__LINE__(__FILENAME__, __FUNCTION__, __LINE__, ##__VA_ARGS__)
 #define DEBUG_PRINTF(fmt, ...)  _debugPrintfAligned(__FILENAME__, __FUNCTION__, __LINE__, fmt, ##__VA_ARGS__)
+/// 条件が成り立たなければ表示して止める(ウォッチドッグがあればリセットされる)
+#define DEBUG_ASSERT(cond)      do { if (!(cond)) { _debugPrintfAligned(__FILENAME__, __FUNCTION__, __LINE__, "assertion failed: %s", #cond); Serial.flush(); while (true) { delay(100); } } } while (0)
 
 #else
 
@@ -87,5 +89,6 @@ private:
 #define debugPrintf(...) 
 #define stopwatch_ms(...) 
 #define DEBUG_PRINTF(...) 
+#define DEBUG_ASSERT(cond) ((void)0)
 
 #endif
\ No newline at end of file
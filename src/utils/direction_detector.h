@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <utils/fixed_math.h>
+
+/**
+ * @brief ジョイスティックの傾きを8方向に分類するユーティリティクラス
+ * @details 倒し量と角度の両方にヒステリシスを持たせ、境界付近での方向のばたつきを抑える
+ */
+class direction_detector
+{
+    public:
+        /**
+         * @brief 方向(画面座標系で右から時計回り)
+         */
+        enum Direction
+        {
+            RIGHT = 0,
+            DOWN_RIGHT,
+            DOWN,
+            DOWN_LEFT,
+            LEFT,
+            UP_LEFT,
+            UP,
+            UP_RIGHT,
+            NONE,
+        };
+
+
+        /**
+         * @brief 状態を更新
+         * @param [in] x 中心からのX軸の差(-512～+512)。右が正
+         * @param [in] y 中心からのY軸の差(-512～+512)。下が正
+         */
+        void inline update(const int32_t x, const int32_t y)
+        {
+            _previous = _direction;
+            _magnitude = calcMagnitude(x, y);
+
+            // 倒し量のヒステリシス
+            uint32_t threshold = (_direction == NONE) ? RADIUS_ON : RADIUS_OFF;
+            if (_magnitude < threshold) {
+                _direction = NONE;
+                return;
+            }
+
+            // 角度のヒステリシス:現在のセクタ境界を一定角度超えるまでは方向を維持する
+            auto angle = fixed::atan2(y, x);
+            if (_direction != NONE) {
+                auto delta = fixed::angleDelta(angle, sectorCenter(_direction));
+                if (abs(delta) <= (SECTOR_WIDTH / 2) + ANGLE_HYST) {
+                    return;
+                }
+            }
+            _direction = static_cast<Direction>(((angle + (SECTOR_WIDTH / 2)) / SECTOR_WIDTH) % 8);
+        }
+
+
+        /**
+         * @brief 現在の方向を取得
+         */
+        Direction inline getDirection() const
+        {
+            return _direction;
+        }
+
+
+        /**
+         * @brief 方向が変化したか
+         */
+        bool inline isChanged() const
+        {
+            return _direction != _previous;
+        }
+
+
+        /**
+         * @brief 倒し量を0-255に正規化して取得
+         * @return 追跡開始の倒し量で0、最大まで倒して255
+         */
+        uint8_t inline getStrength() const
+        {
+            if (_magnitude <= RADIUS_ON) {
+                return 0;
+            }
+            uint32_t s = ((_magnitude - RADIUS_ON) * 255) / (RADIUS_MAX - RADIUS_ON);
+            return s > 255 ? 255 : s;
+        }
+
+    private:
+        static constexpr uint32_t RADIUS_ON = 256;  ///< 方向ありと判定する倒し量(最大512)
+        static constexpr uint32_t RADIUS_OFF = 192; ///< 方向なしに戻る倒し量
+        static constexpr uint32_t RADIUS_MAX = 480; ///< 最大とみなす倒し量
+        static constexpr int32_t SECTOR_WIDTH = fixed::FULL_TURN / 8;
+        static constexpr int32_t ANGLE_HYST = fixed::FULL_TURN / 64; ///< 約5.6度
+
+        Direction _direction = NONE;
+        Direction _previous = NONE;
+        uint32_t _magnitude = 0;
+
+        /**
+         * @brief セクタ中心の角度を取得
+         */
+        static inline uint16_t sectorCenter(const Direction direction)
+        {
+            return static_cast<uint16_t>(direction * SECTOR_WIDTH);
+        }
+
+        /**
+         * @brief 倒し量の近似値(max + 3/8 min)を計算
+         */
+        static inline uint32_t calcMagnitude(const int32_t x, const int32_t y)
+        {
+            uint32_t ax = abs(x);
+            uint32_t ay = abs(y);
+            return (ax > ay) ? ax + ((ay * 3) >> 3) : ay + ((ax * 3) >> 3);
+        }
+};
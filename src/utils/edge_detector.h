@@ -13,13 +13,24 @@ class edge_detector
          */
         void inline update()
         {
-            bool current = button::isPressed();
+            bool current = button::isPressed() || _isLatched;
+            _isLatched = false;
             _isRising = current && !_previous;
             _isFalling = !current && _previous;
             _previous = current;
         }
 
 
+        /**
+         * @brief 次のupdate()でピンの状態に関わらず押下とみなす
+         * @details スリープ復帰のきっかけになった押下を、最初のスキャンまでに離されていても取りこぼさないために使う
+         */
+        void inline latch()
+        {
+            _isLatched = true;
+        }
+
+
         /**
          * @brief 立ち上がり検知
          * @retval true  立ち上がり発生
@@ -56,4 +67,5 @@ class edge_detector
         bool _previous = false;
         bool _isRising = false;
         bool _isFalling = false;
+        bool _isLatched = false;
 };
\ No newline at end of file
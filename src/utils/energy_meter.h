@@ -0,0 +1,247 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace utils
+{
+    /**
+     * @brief 状態ごとの滞在時間とレポート数から消費電荷を見積もるクラス
+     * @details CPU(起動中/LightSleep)と、リンクごとの無線(アドバタイズ中/接続中)の滞在時間をmillis()で積算する。
+     *          状態が変わるたびに前回からの経過を前の状態に足すだけなので、記録のコストは状態の変化1回につき数十命令。
+     *          滞在時間×状態ごとの電流(設定`pwr`)+レポート数×1レポートの電荷で消費電荷を見積もり、
+     *          System ON の時間あたりの値から1日あたりに換算する。
+     *          積算値はDeepSleep(System OFF)の間は保持したRAMで持ち越す(config_manager::retain()/restore())。
+     * @note System OFF中はRTCも止まるため、System OFFの時間は測れない(回数だけ数える)
+     * @note 電流はモデル値。測ったものではない
+     */
+    class energy_meter
+    {
+    public:
+        /**
+         * @brief 時間を積算する状態
+         */
+        enum State : uint8_t
+        {
+            ACTIVE = 0,  ///< 起動中(tickless idleを含む)
+            LIGHT_SLEEP, ///< LightSleep
+            ADVERTISING, ///< アドバタイズ中(リンクごとに足す)
+            CONNECTED,   ///< 接続中(リンクごとに足す)
+            STATE_COUNT,
+            NONE = 0xFF, ///< 無線を使っていない
+        };
+
+        static constexpr size_t MAX_LINKS = 4;
+
+        energy_meter() = delete;
+
+
+        /**
+         * @brief 状態ごとの電流を設定する
+         * @param [in] activeUa      起動中の平均電流(uA)
+         * @param [in] lightSleepUa  LightSleep中の電流(uA)
+         * @param [in] advertisingUa アドバタイズ1本の平均電流(uA)
+         * @param [in] connectedUa   接続1本を維持する平均電流(uA)
+         * @param [in] reportNc      1レポートの電荷(nC = uA・ms)
+         */
+        static void configure(const uint16_t activeUa, const uint16_t lightSleepUa, const uint16_t advertisingUa, const uint16_t connectedUa, const uint16_t reportNc)
+        {
+            _currentUa[ACTIVE] = activeUa;
+            _currentUa[LIGHT_SLEEP] = lightSleepUa;
+            _currentUa[ADVERTISING] = advertisingUa;
+            _currentUa[CONNECTED] = connectedUa;
+            _reportNc = reportNc;
+        }
+
+
+        /**
+         * @brief 起動を記録する
+         * @note リセットからここまでは起動中として数える(millis()の起点から積算する)
+         */
+        static void begin()
+        {
+            _counters.boots++;
+        }
+
+
+        /**
+         * @brief 積算値を消す(保持したRAMからの復元が途中で失敗したとき)
+         */
+        static void reset()
+        {
+            _counters = {};
+            _lastMs = millis();
+        }
+
+
+        /**
+         * @brief LightSleepに入る/から戻る
+         */
+        static void setSleeping(const bool isSleeping)
+        {
+            accumulate();
+            _cpuState = isSleeping ? LIGHT_SLEEP : ACTIVE;
+        }
+
+
+        /**
+         * @brief リンクの無線の状態を設定する
+         * @param [in] link  リンク番号
+         * @param [in] state ADVERTISING/CONNECTED/NONE
+         */
+        static void setLinkState(const uint8_t link, const State state)
+        {
+            if (link >= MAX_LINKS || _linkStates[link] == state) {
+                return ;
+            }
+            accumulate();
+            _linkStates[link] = state;
+        }
+
+
+        /**
+         * @brief レポートを送信キューに積んだ
+         */
+        static inline void onReport()
+        {
+            _counters.reports++;
+        }
+
+
+        /**
+         * @brief System OFFに入る(ここまでを積算して回数を数える)
+         * @note 保持するRAMに書き込む(config_manager::retain())前に呼ぶこと
+         */
+        static void onSystemOff()
+        {
+            accumulate();
+            _counters.systemOffs++;
+        }
+
+
+        /**
+         * @brief 見積もった消費電荷(uAh)
+         */
+        static uint32_t getChargeUah()
+        {
+            accumulate();
+            return totalNc() / NC_PER_UAH;
+        }
+
+
+        /**
+         * @brief 1日あたりの消費電荷の見積もり(uAh/日)
+         * @details System ONの時間(起動中+LightSleep)での平均電流を1日分にする
+         */
+        static uint32_t getChargePerDayUah()
+        {
+            accumulate();
+            uint64_t onMs = _counters.ms[ACTIVE] + _counters.ms[LIGHT_SLEEP];
+            if (onMs == 0) {
+                return 0;
+            }
+            return totalNc() * MS_PER_DAY / onMs / NC_PER_UAH;
+        }
+
+
+        /**
+         * @brief 計測値をJSONにシリアライズ
+         * @details {"t":[起動中,LightSleep,アドバタイズ,接続の各秒],"r":レポート数,"o":System OFFの回数,"b":起動回数,
+         *          "q":消費電荷uAh,"d":1日あたりuAh}
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        static size_t serializeStats(char* buffer, const size_t size)
+        {
+            accumulate();
+            size_t length = snprintf(buffer, size, "{\"t\":[%lu,%lu,%lu,%lu],\"r\":%lu,\"o\":%lu,\"b\":%lu,\"q\":%lu,\"d\":%lu}",
+                (unsigned long)(_counters.ms[ACTIVE] / 1000),
+                (unsigned long)(_counters.ms[LIGHT_SLEEP] / 1000),
+                (unsigned long)(_counters.ms[ADVERTISING] / 1000),
+                (unsigned long)(_counters.ms[CONNECTED] / 1000),
+                (unsigned long)_counters.reports,
+                (unsigned long)_counters.systemOffs,
+                (unsigned long)_counters.boots,
+                (unsigned long)getChargeUah(),
+                (unsigned long)getChargePerDayUah());
+            return min(length, size - 1);
+        }
+
+
+        /**
+         * @brief シリアライズ時のサイズを取得(保持するRAM用)
+         */
+        static constexpr uint16_t getSerializedSize()
+        {
+            return sizeof(Counters);
+        }
+
+        static uint16_t serialize(uint8_t* buffer)
+        {
+            memcpy(buffer, &_counters, sizeof(Counters));
+            return sizeof(Counters);
+        }
+
+        static bool deserialize(const uint8_t* buffer, const uint16_t buffSize)
+        {
+            if (buffSize < sizeof(Counters)) {
+                return false;
+            }
+            memcpy(&_counters, buffer, sizeof(Counters));
+            return true;
+        }
+
+    private:
+        static constexpr uint64_t NC_PER_UAH = 3600000;     ///< 1uAh = 3600uC
+        static constexpr uint64_t MS_PER_DAY = 24 * 60 * 60 * 1000;
+
+        /**
+         * @brief System OFFを跨いで持ち越す積算値
+         */
+        struct Counters
+        {
+            uint64_t ms[STATE_COUNT]; ///< 状態ごとの滞在時間(無線はリンクの合計)
+            uint32_t reports;
+            uint32_t systemOffs;
+            uint32_t boots;
+        };
+
+        static inline Counters _counters = {};
+        static inline uint32_t _lastMs = 0;
+        static inline State _cpuState = ACTIVE;
+        static inline State _linkStates[MAX_LINKS] = {NONE, NONE, NONE, NONE};
+        static inline uint16_t _currentUa[STATE_COUNT] = {};
+        static inline uint16_t _reportNc = 0;
+
+
+        /**
+         * @brief 前回からの経過を今の状態に足す
+         */
+        static void accumulate()
+        {
+            auto now = millis();
+            auto elapsedMs = now - _lastMs;
+            _lastMs = now;
+
+            _counters.ms[_cpuState] += elapsedMs;
+            for (auto state : _linkStates) {
+                if (state != NONE) {
+                    _counters.ms[state] += elapsedMs;
+                }
+            }
+        }
+
+
+        /**
+         * @brief 見積もった消費電荷(nC = uA・ms)
+         */
+        static uint64_t totalNc()
+        {
+            uint64_t nc = (uint64_t)_counters.reports * _reportNc;
+            for (size_t state = 0; state < STATE_COUNT; state++) {
+                nc += _counters.ms[state] * _currentUa[state];
+            }
+            return nc;
+        }
+    };
+}
@@ -0,0 +1,60 @@
+/**
+ * @brief 固定小数点の数学関数
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace fixed
+{
+    /**
+     * @brief 1周を表す角度(バイナリ角度)。uint16_tの桁あふれで自然に一周する
+     */
+    constexpr uint32_t FULL_TURN = 65536;
+    constexpr uint16_t QUARTER_TURN = FULL_TURN / 4;
+    constexpr uint16_t HALF_TURN = FULL_TURN / 2;
+
+
+    /**
+     * @brief 固定小数点のatan2
+     * @param [in] y Y成分
+     * @param [in] x X成分
+     * @return 角度(0 - 65535 で 0 - 360度)。x=y=0のときは0
+     * @note atan(t) ≒ (π/4)t + 0.273t(1-t) の近似式を使用(最大誤差は約0.22度)
+     */
+    inline uint16_t atan2(const int32_t y, const int32_t x)
+    {
+        uint32_t ax = abs(x);
+        uint32_t ay = abs(y);
+        if (ax == 0 && ay == 0) {
+            return 0;
+        }
+
+        // 0～45度に畳み込む(t = min/max をQ15で表す)
+        bool swapped = ay > ax;
+        uint32_t t = swapped ? (ax << 15) / ay : (ay << 15) / ax;
+
+        // (π/4)t = 8192t, 0.273rad = 2847
+        uint32_t angle = ((8192 * t) >> 15) + ((((t * (32768 - t)) >> 15) * 2847) >> 15);
+
+        // 象限を復元
+        if (swapped) angle = QUARTER_TURN - angle;
+        if (x < 0)   angle = HALF_TURN - angle;
+        if (y < 0)   angle = FULL_TURN - angle;
+
+        return static_cast<uint16_t>(angle);
+    }
+
+
+    /**
+     * @brief 2つの角度の差分を取得する
+     * @param [in] current  現在の角度
+     * @param [in] previous 前回の角度
+     * @return 差分(-32768 - 32767)。180度をまたぐ場合は近い方向を返す
+     */
+    inline int16_t angleDelta(const uint16_t current, const uint16_t previous)
+    {
+        return static_cast<int16_t>(static_cast<uint16_t>(current - previous));
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <Arduino.h>
+
+namespace utils
+{
+    /**
+     * @brief 電圧からLiPoの残量を推定するクラス
+     * @details 測った端子電圧に負荷電流×内部抵抗の電圧降下を足して開放電圧に直し、指数移動平均でならしてから
+     *          放電曲線の表で残量(%)にする。報告する残量はHYSTERESIS_PERCENT以上変わったときだけ更新する(0%/100%は即時)。
+     * @note 放電曲線と内部抵抗は一般的な小容量LiPoの目安で、このデバイスの電池で測ったものではない
+     */
+    class fuel_gauge
+    {
+    public:
+        fuel_gauge() = default;
+
+
+        /**
+         * @brief 負荷電流の目安(uA)
+         * @param [in] isConnected    BLE接続中か
+         * @param [in] ledDutyPermille LEDの全チャネルのデューティの合計(‰)
+         */
+        static uint32_t estimateLoadUa(const bool isConnected, const uint32_t ledDutyPermille)
+        {
+            return BASE_UA + (isConnected ? RADIO_UA : 0) + LED_FULL_UA * ledDutyPermille / 1000;
+        }
+
+
+        /**
+         * @brief 測った電圧を与えて残量を更新する
+         * @param [in] measuredMv 端子電圧(mV)
+         * @param [in] loadUa     測ったときの負荷電流の目安(uA)
+         * @retval true  報告する残量が変わった
+         * @retval false 変わっていない
+         */
+        bool update(const uint32_t measuredMv, const uint32_t loadUa)
+        {
+            uint32_t openMv = measuredMv + loadUa * INTERNAL_RESISTANCE_MOHM / 1000000;
+            _measuredMv = measuredMv;
+
+            // 指数移動平均(1/4)。最初はそのまま
+            if (_filteredMv == 0) {
+                _filteredMv = openMv;
+            } else {
+                _filteredMv += ((int32_t)openMv - (int32_t)_filteredMv) / 4;
+            }
+            _samples++;
+
+            auto percent = toPercent(_filteredMv);
+            bool isChanged = (_percent == INVALID_PERCENT)
+                || abs((int)percent - (int)_percent) >= HYSTERESIS_PERCENT
+                || (percent != _percent && (percent == 0 || percent == 100));
+            if (isChanged) {
+                _percent = percent;
+            }
+            return isChanged;
+        }
+
+
+        bool isValid() const
+        {
+            return _percent != INVALID_PERCENT;
+        }
+
+        /**
+         * @brief 報告する残量(%)
+         */
+        uint8_t getPercent() const
+        {
+            return isValid() ? _percent : 0;
+        }
+
+
+        /**
+         * @brief 計測値をJSONにシリアライズ
+         * @details {"v":端子電圧mV,"o":補正してならした開放電圧mV,"p":残量%,"n":測定回数}
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        size_t serializeStats(char* buffer, const size_t size) const
+        {
+            size_t length = snprintf(buffer, size, "{\"v\":%lu,\"o\":%lu,\"p\":%d,\"n\":%lu}",
+                (unsigned long)_measuredMv,
+                (unsigned long)_filteredMv,
+                isValid() ? _percent : -1,
+                (unsigned long)_samples);
+            return min(length, size - 1);
+        }
+
+    private:
+        static constexpr uint8_t INVALID_PERCENT = 0xFF;
+        static constexpr uint8_t HYSTERESIS_PERCENT = 2;
+        static constexpr uint32_t INTERNAL_RESISTANCE_MOHM = 300; ///< 内部抵抗(mΩ)
+
+        // 負荷電流のモデル値(uA)
+        static constexpr uint32_t BASE_UA = 1000;     ///< CPU/周辺(スキャン中の平均)
+        static constexpr uint32_t RADIO_UA = 600;     ///< 接続を維持する平均
+        static constexpr uint32_t LED_FULL_UA = 2000; ///< LED1色をデューティ100%で点灯
+
+        /**
+         * @brief 放電曲線(開放電圧mV, 残量%)。電圧の高い順
+         */
+        struct Point { uint16_t mv; uint8_t percent; };
+        static constexpr Point CURVE[] = {
+            {4200, 100}, {4150, 95}, {4110, 90}, {4080, 85}, {4020, 80}, {3980, 75}, {3950, 70},
+            {3910, 65},  {3870, 60}, {3850, 55}, {3840, 50}, {3820, 45}, {3800, 40}, {3790, 35},
+            {3770, 30},  {3750, 25}, {3730, 20}, {3710, 15}, {3690, 10}, {3610, 5},  {3270, 0},
+        };
+
+        uint32_t _measuredMv = 0;
+        uint32_t _filteredMv = 0;
+        uint32_t _samples = 0;
+        uint8_t _percent = INVALID_PERCENT;
+
+
+        /**
+         * @brief 開放電圧から残量(%)を線形補間で求める
+         */
+        static uint8_t toPercent(const uint32_t mv)
+        {
+            constexpr size_t count = sizeof(CURVE) / sizeof(CURVE[0]);
+            if (mv >= CURVE[0].mv) {
+                return CURVE[0].percent;
+            }
+            for (size_t i = 1; i < count; i++) {
+                auto& upper = CURVE[i - 1];
+                auto& lower = CURVE[i];
+                if (mv >= lower.mv) {
+                    return lower.percent + (mv - lower.mv) * (upper.percent - lower.percent) / (upper.mv - lower.mv);
+                }
+            }
+            return 0;
+        }
+    };
+}
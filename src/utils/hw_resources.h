@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace utils
+{
+    /**
+     * @brief チャネル番号の並びをビットマスクにする
+     * @param [in] channels チャネル番号
+     * @return ビットマスク
+     */
+    template <typename... Channels>
+    constexpr uint32_t hw_bits(const Channels... channels)
+    {
+        return (0u | ... | (1u << channels));
+    }
+
+
+    /**
+     * @brief モジュールが占有するハードウェア資源の宣言
+     * @details 各モジュールはusing resources = hw_resources<...>で使うチャネルをビットマスクで宣言し、
+     *          hw_allocationで全モジュールの宣言が重ならないことをビルド時に確かめる。
+     * @tparam ppi    PPIチャネル(0-19がプログラム可能)
+     * @tparam gpiote GPIOTEチャネル(0-7)
+     * @tparam timer  TIMER(0-4)
+     * @tparam rtc    RTC(0-2)
+     * @tparam pwm    PWM(0-3)
+     */
+    template <uint32_t ppi, uint8_t gpiote = 0, uint8_t timer = 0, uint8_t rtc = 0, uint8_t pwm = 0>
+    struct hw_resources
+    {
+        static constexpr uint32_t PPI = ppi;
+        static constexpr uint8_t GPIOTE = gpiote;
+        static constexpr uint8_t TIMER = timer;
+        static constexpr uint8_t RTC = rtc;
+        static constexpr uint8_t PWM = pwm;
+
+        static_assert((ppi & ~((1u << 20) - 1)) == 0, "PPI channels 20-31 are pre-programmed and cannot be allocated");
+        static_assert((timer & ~0x1F) == 0, "nRF52840 has TIMER0-4 only");
+        static_assert((rtc & ~0x07) == 0, "nRF52840 has RTC0-2 only");
+        static_assert((pwm & ~0x0F) == 0, "nRF52840 has PWM0-3 only");
+    };
+
+
+    /**
+     * @brief SoftDevice(S140)とArduinoコアが使う資源
+     * @details PPI 17-19はSoftDeviceが有効な間は使えない(NRF_SOC_SD_PPI_CHANNELS_SD_ENABLED_MSK)。
+     *          TIMER0/RTC0はSoftDevice、RTC1はFreeRTOSのtickが使う。
+     */
+    using hw_system_resources = hw_resources<hw_bits(17, 18, 19), 0, hw_bits(0), hw_bits(0, 1)>;
+
+
+    /**
+     * @brief 2つのモジュールの資源が重ならないことを確かめる
+     * @note 重なったらこのテンプレートの実引数(モジュールの組み合わせ)がエラーに表示される
+     */
+    template <typename A, typename B>
+    struct hw_disjoint
+    {
+        static_assert((A::PPI & B::PPI) == 0, "PPI channel allocated by two modules (see hw_disjoint<A, B>)");
+        static_assert((A::GPIOTE & B::GPIOTE) == 0, "GPIOTE channel allocated by two modules (see hw_disjoint<A, B>)");
+        static_assert((A::TIMER & B::TIMER) == 0, "TIMER allocated by two modules (see hw_disjoint<A, B>)");
+        static_assert((A::RTC & B::RTC) == 0, "RTC allocated by two modules (see hw_disjoint<A, B>)");
+        static_assert((A::PWM & B::PWM) == 0, "PWM allocated by two modules (see hw_disjoint<A, B>)");
+        static constexpr bool value = true;
+    };
+
+
+    /**
+     * @brief 全モジュールの資源の割り当て
+     * @details 全ての組み合わせでhw_disjointを確かめる。使っていない資源はFREE_*で取得できる。
+     * @tparam Modules 各モジュールのhw_resources
+     */
+    template <typename... Modules>
+    struct hw_allocation;
+
+    template <>
+    struct hw_allocation<>
+    {
+        static constexpr bool value = true;
+        static constexpr uint32_t PPI = 0;
+        static constexpr uint8_t GPIOTE = 0;
+        static constexpr uint8_t TIMER = 0;
+        static constexpr uint8_t RTC = 0;
+        static constexpr uint8_t PWM = 0;
+    };
+
+    template <typename First, typename... Rest>
+    struct hw_allocation<First, Rest...>
+    {
+        static constexpr bool value = (hw_disjoint<First, Rest>::value && ... && hw_allocation<Rest...>::value);
+
+        static constexpr uint32_t PPI = First::PPI | hw_allocation<Rest...>::PPI;
+        static constexpr uint8_t GPIOTE = First::GPIOTE | hw_allocation<Rest...>::GPIOTE;
+        static constexpr uint8_t TIMER = First::TIMER | hw_allocation<Rest...>::TIMER;
+        static constexpr uint8_t RTC = First::RTC | hw_allocation<Rest...>::RTC;
+        static constexpr uint8_t PWM = First::PWM | hw_allocation<Rest...>::PWM;
+
+        static constexpr uint32_t FREE_PPI = ~PPI & ((1u << 20) - 1);
+        static constexpr uint8_t FREE_GPIOTE = ~GPIOTE & 0xFF;
+        static constexpr uint8_t FREE_TIMER = ~TIMER & 0x1F;
+    };
+}
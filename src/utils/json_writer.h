@@ -0,0 +1,102 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+namespace utils
+{
+    /**
+     * @brief 計測値のJSONを固定長のバッファに書くクラス
+     * @details scheduler::serializeStats()と同じく、要素は丸ごと入るときだけ書き、入りきらなければそれ以降は書かない。
+     *          閉じ括弧の分(reserve)は常に残しておき、close()で必ず閉じるので、途中で切れたJSONにならない。
+     *          複数回に分けて書く要素はgetLength()で位置を覚え、入りきらなければrollback()で要素ごと取り消す。
+     */
+    class json_writer
+    {
+    public:
+        /**
+         * @param [out] buffer  出力先
+         * @param [in]  size    出力先のサイズ
+         * @param [in]  reserve 閉じ括弧のために残しておくバイト数(要素の境界で開いている括弧の最大数)
+         */
+        json_writer(char* buffer, const size_t size, const size_t reserve)
+            : _buffer(buffer), _size(size), _reserve(reserve)
+        {
+            if (_size > 0) {
+                _buffer[0] = '\0';
+            }
+        }
+
+
+        /**
+         * @brief 要素を書く(閉じ括弧の分を残して入りきるときだけ)
+         * @retval true  書いた
+         * @retval false 入りきらなかった(以降のappend()も書かない)
+         */
+        bool append(const char* format, ...) __attribute__((format(printf, 2, 3)))
+        {
+            if (_isFull || _length + _reserve + 1 >= _size) {
+                _isFull = true;
+                return false;
+            }
+
+            auto available = _size - _length - _reserve;
+            va_list args;
+            va_start(args, format);
+            auto written = vsnprintf(_buffer + _length, available, format, args);
+            va_end(args);
+
+            if (written < 0 || (size_t)written >= available) {
+                _buffer[_length] = '\0';
+                _isFull = true;
+                return false;
+            }
+            _length += written;
+            return true;
+        }
+
+
+        /**
+         * @brief 開いている括弧を閉じる(残しておいた分に書く)
+         * @param [in] brackets 閉じ括弧
+         * @note 何も書いていなければ閉じない
+         */
+        void close(const char* brackets)
+        {
+            auto len = strlen(brackets);
+            if (_length == 0 || _length + len >= _size) {
+                return ;
+            }
+            memcpy(_buffer + _length, brackets, len + 1);
+            _length += len;
+        }
+
+
+        /**
+         * @brief 指定した位置まで取り消す(入りきらなかった要素を消す)
+         * @param [in] length getLength()で覚えた位置
+         */
+        void rollback(const size_t length)
+        {
+            if (length < _length) {
+                _length = length;
+                _buffer[_length] = '\0';
+            }
+        }
+
+
+        size_t inline getLength() const
+        {
+            return _length;
+        }
+
+    private:
+        char* _buffer;
+        size_t _size;
+        size_t _reserve;
+        size_t _length = 0;
+        bool _isFull = false;
+    };
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <utils/json_writer.h>
+
+namespace utils
+{
+    /**
+     * @brief 入力からHIDレポートまでの遅延を計測するクラス
+     * @details 経路(同時押し/マウスボタン/カーソル移動/スクロール)ごとに、入力を検出した時刻をmarkInput()で覚えておき、
+     *          対応するレポートをblehidに渡すときにmarkReport()で経過時間を区間固定のヒストグラムに記録する。
+     *          レポートまでに入力が重なった場合は最初の入力から数える(1回のレポートにつき1件)。
+     *          ボタンは押した時刻に近づけるため、GPIOTEの割り込み(onEdge())またはLightSleepから復帰した時刻を入力時刻にする。
+     * @note 割り込みから呼ぶのはonEdge()だけ。他はループのタスクから呼ぶこと
+     */
+    class latency_monitor
+    {
+    public:
+        /**
+         * @brief 経路
+         */
+        enum Path : uint8_t
+        {
+            KEY_CHORD = 0, ///< ボタン押下からキーボードレポート(同時押しの確定待ちを含む)
+            MOUSE_BUTTON,  ///< ボタンのエッジからマウスボタンのレポート
+            MOTION,        ///< ジョイスティックのサンプルからカーソル移動のレポート
+            SCROLL,        ///< ジョイスティックのサンプルからスクロールのレポート
+            PATH_COUNT,
+        };
+
+        static constexpr size_t BIN_COUNT = 14;
+
+        /// 区間の上限(us)。最後の区間は上限なし
+        static constexpr uint32_t BIN_UPPER_US[BIN_COUNT] = {
+            1000, 2000, 3000, 5000, 7500, 10000, 15000, 20000, 30000, 50000, 75000, 100000, 250000, UINT32_MAX
+        };
+
+        latency_monitor() = delete;
+
+
+        /**
+         * @brief ボタンのエッジを記録する(割り込みコンテキスト)
+         * @param [in] us エッジの時刻(micros)
+         * @note 直近(EDGE_MAX_AGE_US以内)の未使用のエッジがあれば最初のものを残す
+         */
+        static void onEdge(const uint32_t us)
+        {
+            if (_edgeUs == 0 || (us - _edgeUs) > EDGE_MAX_AGE_US) {
+                _edgeUs = us | 1; // 0は未記録
+            }
+        }
+
+        static void onEdge()
+        {
+            onEdge(micros());
+        }
+
+
+        /**
+         * @brief ボタンの入力時刻を取り出す
+         * @return 直近のエッジの時刻。なければ現在時刻
+         */
+        static uint32_t takeEdgeUs()
+        {
+            auto now = micros();
+            uint32_t edgeUs = _edgeUs;
+            _edgeUs = 0;
+            if (edgeUs == 0 || (now - edgeUs) > EDGE_MAX_AGE_US) {
+                return now;
+            }
+            return edgeUs;
+        }
+
+
+        /**
+         * @brief 未使用のエッジを捨てる(ボタンを離したエッジを次の押下の時刻に使わないため)
+         */
+        static void clearEdge()
+        {
+            _edgeUs = 0;
+        }
+
+
+        /**
+         * @brief 入力を検出した
+         * @param [in] path 経路
+         * @param [in] us   入力の時刻(micros)
+         * @note レポート待ちの入力があれば何もしない(最初の入力から数える)
+         */
+        static void markInput(const Path path, const uint32_t us)
+        {
+            auto& state = _paths[path];
+            if (!state.isPending) {
+                state.isPending = true;
+                state.inputUs = us;
+            }
+        }
+
+        static void markInput(const Path path)
+        {
+            markInput(path, micros());
+        }
+
+
+        /**
+         * @brief レポートをblehidに渡す(レポート待ちの入力があれば遅延を記録する)
+         * @param [in] path 経路
+         */
+        static void markReport(const Path path)
+        {
+            auto& state = _paths[path];
+            if (!state.isPending) {
+                return ;
+            }
+            state.isPending = false;
+
+            auto elapsedUs = micros() - state.inputUs;
+            size_t bin = 0;
+            while (bin < BIN_COUNT - 1 && elapsedUs >= BIN_UPPER_US[bin]) {
+                bin++;
+            }
+            state.counts[bin]++;
+            state.total++;
+            if (elapsedUs > state.maxUs) {
+                state.maxUs = elapsedUs;
+            }
+        }
+
+
+        /**
+         * @brief レポートにならなかった入力を捨てる(次のレポートに遅延を付けないため)
+         * @param [in] path 経路
+         */
+        static void cancel(const Path path)
+        {
+            _paths[path].isPending = false;
+        }
+
+
+        /**
+         * @brief 記録を消す
+         */
+        static void reset()
+        {
+            for (auto& state : _paths) {
+                state = {};
+            }
+        }
+
+
+        /**
+         * @brief 計測値をJSONにシリアライズ
+         * @details {"u":[区間の上限us(最後は0=上限なし)],"p":[{"n":回数,"x":最大us,"h":[区間ごとの回数]}, ...]}
+         *          経路の順はPathの順
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        static size_t serializeStats(char* buffer, const size_t size)
+        {
+            // 入りきらない経路は丸ごと出力しない
+            json_writer writer(buffer, size, 2); // "]}"
+            writer.append("{\"u\":[");
+            for (size_t bin = 0; bin < BIN_COUNT; bin++) {
+                writer.append("%s%lu",
+                    (bin == 0) ? "" : ",",
+                    (unsigned long)(BIN_UPPER_US[bin] == UINT32_MAX ? 0 : BIN_UPPER_US[bin]));
+            }
+            writer.close("]");
+            if (writer.append(",\"p\":[")) {
+                for (size_t path = 0; path < PATH_COUNT; path++) {
+                    auto& state = _paths[path];
+                    auto start = writer.getLength();
+                    bool fits = writer.append("%s{\"n\":%lu,\"x\":%lu,\"h\":[",
+                        (path == 0) ? "" : ",",
+                        (unsigned long)state.total,
+                        (unsigned long)state.maxUs);
+                    for (size_t bin = 0; bin < BIN_COUNT && fits; bin++) {
+                        fits = writer.append("%s%lu",
+                            (bin == 0) ? "" : ",",
+                            (unsigned long)state.counts[bin]);
+                    }
+                    fits = fits && writer.append("]}");
+                    if (!fits) {
+                        writer.rollback(start);
+                        break;
+                    }
+                }
+                writer.close("]");
+            }
+            writer.close("}");
+            return writer.getLength();
+        }
+
+    private:
+        static constexpr uint32_t EDGE_MAX_AGE_US = 100000; ///< これより古いエッジは入力時刻に使わない
+
+        struct PathState
+        {
+            bool isPending;       ///< レポート待ちの入力がある
+            uint32_t inputUs;     ///< レポート待ちの最初の入力の時刻
+            uint32_t total;
+            uint32_t maxUs;
+            uint32_t counts[BIN_COUNT];
+        };
+
+        static inline PathState _paths[PATH_COUNT] = {};
+        static inline volatile uint32_t _edgeUs = 0; ///< 未使用のボタンのエッジの時刻(0は未記録)
+    };
+}
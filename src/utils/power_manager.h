@@ -0,0 +1,164 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdio.h>
+#include <nrf_soc.h>
+#include <utils/debug.h>
+
+namespace utils
+{
+    /**
+     * @brief 周辺機能の電源(停止/再開)を管理するクラス
+     * @details 各モジュールが使う周辺機能を、動いているかの判定と停止/再開の処理と一緒に登録する。
+     *          スリープ前にsuspend()で動いているものを止め、眠る直前(sd_app_evt_wait()/System OFF)に
+     *          verify()で止まっているかを確かめる。止まっていなかったものは回数を記録し、デバッグ時はアサートで止める。
+     *          スリープの復帰に使う周辺機能は、使うスリープの種類をwakeInに指定して確認から外す。
+     *          DCDCはbegin()で有効にし、起きている間も含めて使い続ける。
+     */
+    class power_manager
+    {
+    public:
+        /**
+         * @brief スリープの種類
+         */
+        enum SleepState : uint8_t
+        {
+            LIGHT_SLEEP = 0x01, ///< System ON(sd_app_evt_wait())
+            SYSTEM_OFF = 0x02,  ///< System OFF
+        };
+
+        using IsActiveFunc = bool (*)();
+        using HookFunc = void (*)();
+
+        static constexpr size_t CAPACITY = 8;
+
+        power_manager() = delete;
+
+
+        /**
+         * @brief 電源の設定を開始する(DCDCを有効化)
+         * @note SoftDeviceを有効にしてから呼ぶこと
+         */
+        static void begin()
+        {
+            sd_power_mode_set(NRF_POWER_MODE_LOWPWR);
+            sd_power_dcdc_mode_set(NRF_POWER_DCDC_ENABLE);
+        }
+
+
+        /**
+         * @brief 周辺機能を登録する
+         * @param [in] module   登録するモジュール名
+         * @param [in] name     周辺機能名
+         * @param [in] isActive 動いているか
+         * @param [in] suspend  止める処理(nullptrなら止めない)
+         * @param [in] resume   再開する処理(nullptrなら再開しない)
+         * @param [in] wakeIn   復帰に使うスリープの種類(SleepStateの組み合わせ)。その間は動いていてよい
+         * @retval false 登録数の上限
+         */
+        static bool add(const char* module, const char* name, const IsActiveFunc isActive, const HookFunc suspend, const HookFunc resume, const uint8_t wakeIn=0)
+        {
+            if (_count >= CAPACITY) {
+                DEBUG_PRINTF("power_manager full (%s %s)", module, name);
+                return false;
+            }
+            _entries[_count++] = Entry{module, name, isActive, suspend, resume, wakeIn, false, 0};
+            return true;
+        }
+
+
+        /**
+         * @brief 動いている周辺機能を止める(登録と逆順)
+         * @param [in] state これから入るスリープ。復帰に使う周辺機能は止めない
+         */
+        static void suspend(const SleepState state)
+        {
+            for (size_t i = _count; i-- > 0; ) {
+                auto& entry = _entries[i];
+                entry.isSuspended = false;
+                if ((entry.wakeIn & state) || !entry.suspend || !entry.isActive()) {
+                    continue;
+                }
+                entry.suspend();
+                entry.isSuspended = true;
+            }
+        }
+
+
+        /**
+         * @brief suspend()で止めた周辺機能を再開する(登録順)
+         */
+        static void resume()
+        {
+            for (size_t i = 0; i < _count; i++) {
+                auto& entry = _entries[i];
+                if (entry.isSuspended && entry.resume) {
+                    entry.resume();
+                }
+                entry.isSuspended = false;
+            }
+        }
+
+
+        /**
+         * @brief 全ての周辺機能が止まっているかを確かめる(眠る直前に呼ぶ)
+         * @param [in] state これから入るスリープ
+         * @retval true  止まっている
+         * @retval false 動いているものがある(回数を記録)
+         */
+        static bool verify(const SleepState state)
+        {
+            size_t awake = 0;
+            for (size_t i = 0; i < _count; i++) {
+                auto& entry = _entries[i];
+                if ((entry.wakeIn & state) || !entry.isActive()) {
+                    continue;
+                }
+                entry.awakeCount++;
+                awake++;
+                DEBUG_PRINTF("%s kept %s awake", entry.module, entry.name);
+            }
+            DEBUG_ASSERT(awake == 0);
+            return awake == 0;
+        }
+
+
+        /**
+         * @brief 計測値をJSONにシリアライズ
+         * @details [{"m":モジュール名,"p":周辺機能名,"n":眠る直前に動いていた回数}, ...]
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        static size_t serializeStats(char* buffer, const size_t size)
+        {
+            size_t length = snprintf(buffer, size, "[");
+            for (size_t i = 0; i < _count && length < size; i++) {
+                auto& entry = _entries[i];
+                length += snprintf(buffer + length, size - length, "%s{\"m\":\"%s\",\"p\":\"%s\",\"n\":%lu}",
+                    (i == 0) ? "" : ",",
+                    entry.module,
+                    entry.name,
+                    (unsigned long)entry.awakeCount);
+            }
+            if (length < size) {
+                length += snprintf(buffer + length, size - length, "]");
+            }
+            return min(length, size - 1);
+        }
+
+    private:
+        struct Entry
+        {
+            const char* module;
+            const char* name;
+            IsActiveFunc isActive;
+            HookFunc suspend;
+            HookFunc resume;
+            uint8_t wakeIn;
+            bool isSuspended;     ///< 直近のsuspend()で止めた
+            uint32_t awakeCount;  ///< 眠る直前に動いていた回数
+        };
+
+        static inline Entry _entries[CAPACITY] = {};
+        static inline size_t _count = 0;
+    };
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <Arduino.h>
+
+namespace utils
+{
+    /**
+     * @brief 操作状況に応じてスキャン/レポート周期を切り替えるクラス
+     * @details 操作(ジョイスティックの移動やボタンのエッジ)があれば即座にBURSTに上げ、
+     *          操作がない時間が続くとBURST→NORMAL→IDLEの順に1段ずつ下げる。
+     *          各段にいた時間(滞在時間)を積算し、しきい値の調整に使えるようにする。
+     */
+    class rate_governor
+    {
+    public:
+        /**
+         * @brief 段階
+         */
+        enum Tier
+        {
+            BURST = 0, ///< 操作中
+            NORMAL,    ///< 操作が途切れた直後
+            IDLE,      ///< しばらく操作なし
+            TIER_COUNT,
+        };
+
+        rate_governor() = default;
+
+
+        /**
+         * @brief 周期としきい値を設定する
+         * @param [in] burstMs       BURSTの周期(ms)
+         * @param [in] normalMs      NORMALの周期(ms)
+         * @param [in] idleMs        IDLEの周期(ms)
+         * @param [in] burstQuietMs  BURSTからNORMALに下げるまでの無操作時間(ms)
+         * @param [in] normalQuietMs NORMALからIDLEに下げるまでの無操作時間(ms)
+         */
+        void inline configure(const uint32_t burstMs, const uint32_t normalMs, const uint32_t idleMs, const uint32_t burstQuietMs, const uint32_t normalQuietMs)
+        {
+            _periodMs[BURST] = max(burstMs, (uint32_t)1);
+            _periodMs[NORMAL] = max(normalMs, (uint32_t)1);
+            _periodMs[IDLE] = max(idleMs, (uint32_t)1);
+            _quietMs[BURST] = burstQuietMs;
+            _quietMs[NORMAL] = normalQuietMs;
+            _quietMs[IDLE] = 0;
+        }
+
+
+        /**
+         * @brief 操作の有無を与えて段階を更新する
+         * @param [in] isActive 操作があったか
+         * @retval true  段階が変わった(周期を設定し直すこと)
+         * @retval false 段階は変わっていない
+         */
+        bool inline update(const bool isActive)
+        {
+            auto now = millis();
+            _residencyMs[_tier] += now - _lastUpdateMs;
+            _lastUpdateMs = now;
+
+            if (isActive) {
+                _lastActiveMs = now;
+                return changeTo(BURST);
+            }
+
+            if (_tier != IDLE && (now - _lastActiveMs) >= quietUntil(_tier)) {
+                return changeTo(static_cast<Tier>(_tier + 1));
+            }
+            return false;
+        }
+
+
+        /**
+         * @brief 現在の段階を取得
+         */
+        Tier inline getTier() const
+        {
+            return _tier;
+        }
+
+
+        /**
+         * @brief 現在の段階の周期を取得
+         * @return 周期(us)
+         */
+        uint32_t inline getPeriodUs() const
+        {
+            return _periodMs[_tier] * 1000;
+        }
+
+
+        /**
+         * @brief 段階ごとの滞在時間をJSONにシリアライズ
+         * @details {"t":現在の段階,"r":[BURST,NORMAL,IDLEの滞在時間ms],"c":段階が変わった回数}
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        size_t inline serializeStats(char* buffer, const size_t size) const
+        {
+            auto written = snprintf(buffer, size, "{\"t\":%d,\"r\":[%lu,%lu,%lu],\"c\":%lu}",
+                _tier,
+                (unsigned long)_residencyMs[BURST],
+                (unsigned long)_residencyMs[NORMAL],
+                (unsigned long)_residencyMs[IDLE],
+                (unsigned long)_changes);
+            if (written < 0) {
+                return 0;
+            }
+            return min((size_t)written, size - 1);
+        }
+
+    private:
+        Tier _tier = NORMAL;
+        uint32_t _periodMs[TIER_COUNT] = {5, 10, 50};
+        uint32_t _quietMs[TIER_COUNT] = {200, 2000, 0};
+        uint32_t _residencyMs[TIER_COUNT] = {};
+        uint32_t _changes = 0;
+        uint32_t _lastActiveMs = 0;
+        uint32_t _lastUpdateMs = 0;
+
+        /**
+         * @brief 段階を下げるまでの無操作時間(前の段階からの累積)
+         */
+        uint32_t inline quietUntil(const Tier tier) const
+        {
+            uint32_t total = 0;
+            for (int i = BURST; i <= tier; i++) {
+                total += _quietMs[i];
+            }
+            return total;
+        }
+
+        bool inline changeTo(const Tier tier)
+        {
+            if (_tier == tier) {
+                return false;
+            }
+            _tier = tier;
+            _changes++;
+            return true;
+        }
+    };
+}
@@ -0,0 +1,145 @@
+#include <utils/retained_ram.h>
+#include <utils/debug.h>
+
+using namespace utils;
+
+// 起動時にゼロクリアされないよう.noinitに置く
+retained_ram::Area retained_ram::_area __attribute__((section(".noinit")));
+
+// リンカスクリプトが定義する、起動時にコピー/ゼロクリアされる範囲
+extern "C" uint32_t __data_start__;
+extern "C" uint32_t __data_end__;
+extern "C" uint32_t __bss_start__;
+extern "C" uint32_t __bss_end__;
+
+
+/**
+ * @brief データを保持する
+ * @param [in] data データ
+ * @param [in] size サイズ
+ * @retval false 大きすぎて保持できない
+ */
+bool retained_ram::write(const uint8_t* data, const size_t size)
+{
+    if (size > CAPACITY || !isPlacementValid()) {
+        invalidate();
+        return false;
+    }
+
+    // 書きかけで止まっても無効になるよう、マジックナンバーは最後に書く
+    _area.magic = 0;
+    memcpy(_area.data, data, size);
+    _area.size = size;
+    _area.crc = crc32(data, size);
+    _area.magic = MAGIC;
+    return true;
+}
+
+
+/**
+ * @brief 保持しているデータを取得する
+ * @param [out] data データの先頭
+ * @return サイズ。有効なデータがなければ0
+ */
+size_t retained_ram::read(const uint8_t*& data)
+{
+    if (!isPlacementValid()) {
+        DEBUG_PRINTF("retained ram is placed in .data/.bss");
+        _status = MISPLACED;
+        return 0;
+    }
+    if (_area.magic != MAGIC) {
+        _status = EMPTY;
+        return 0;
+    }
+    if (_area.size == 0 || _area.size > CAPACITY || crc32(_area.data, _area.size) != _area.crc) {
+        DEBUG_PRINTF("retained ram crc mismatch");
+        _status = CORRUPTED;
+        return 0;
+    }
+    _status = VALID;
+    data = _area.data;
+    return _area.size;
+}
+
+
+void retained_ram::invalidate()
+{
+    _area.magic = 0;
+}
+
+
+/**
+ * @brief 保持する領域が起動時に初期化される範囲(.data/.bss)の外にあるか
+ */
+bool retained_ram::isPlacementValid()
+{
+    return isPlacementValid(&_area, sizeof(_area));
+}
+
+
+/**
+ * @brief 指定した範囲が起動時に初期化される範囲(.data/.bss)の外にあるか(.noinitに置いた他の領域用)
+ * @param [in] address 先頭
+ * @param [in] size    サイズ
+ */
+bool retained_ram::isPlacementValid(const void* address, const size_t size)
+{
+    auto start = (uintptr_t)address;
+    auto end = start + size;
+    auto overlaps = [&](const void* first, const void* last) {
+        return start < (uintptr_t)last && (uintptr_t)first < end;
+    };
+    return !overlaps(&__data_start__, &__data_end__) && !overlaps(&__bss_start__, &__bss_end__);
+}
+
+
+/**
+ * @brief System OFF中もこの領域を含むRAMセクションを保持する
+ * @note SoftDeviceを止めてから呼ぶこと(POWERのレジスタを直接操作する)
+ */
+void retained_ram::retainInSystemOff()
+{
+    retainInSystemOff(&_area, sizeof(_area));
+}
+
+
+/**
+ * @brief System OFF中も指定した範囲を含むRAMセクションを保持する(.noinitに置いた他の領域用)
+ * @details nRF52840のRAMはRAM0-7が4KBx2セクション、RAM8が32KBx6セクション
+ * @param [in] address 先頭
+ * @param [in] size    サイズ
+ * @note SoftDeviceを止めてから呼ぶこと(POWERのレジスタを直接操作する)
+ */
+void retained_ram::retainInSystemOff(const void* address, const size_t size)
+{
+    constexpr uint32_t RAM_START = 0x20000000;
+    constexpr uint32_t SMALL_BLOCKS_SIZE = 8 * 8 * 1024;
+
+    auto start = (uint32_t)address - RAM_START;
+    auto end = start + size - 1;
+    for (auto offset = start & ~(4 * 1024 - 1); offset <= end; offset += 4 * 1024) {
+        uint32_t block, section;
+        if (offset < SMALL_BLOCKS_SIZE) {
+            block = offset / (8 * 1024);
+            section = (offset % (8 * 1024)) / (4 * 1024);
+        } else {
+            block = 8;
+            section = (offset - SMALL_BLOCKS_SIZE) / (32 * 1024);
+        }
+        NRF_POWER->RAM[block].POWERSET = (POWER_RAM_POWER_S0RETENTION_On << (POWER_RAM_POWER_S0RETENTION_Pos + section));
+    }
+}
+
+
+uint32_t retained_ram::crc32(const uint8_t* data, const size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
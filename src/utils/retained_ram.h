@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <Arduino.h>
+
+namespace utils
+{
+    /**
+     * @brief System OFF中も内容を保持するRAM領域
+     * @details .noinitセクションに置いて起動時のゼロクリアを避け、System OFFに入る前に
+     *          この領域を含むRAMセクションの保持(S0RETENTION)を有効にする。
+     *          先頭にマジックナンバー/サイズ/CRC32を付け、電源投入直後の不定な内容や書きかけの内容は無効とみなす。
+     *          リンカスクリプトが.noinitを定義していないと孤立セクションとして.data/.bssの範囲に置かれ得るため、
+     *          起動時に範囲を確かめ、重なっていれば保持しない(getStatus()がMISPLACEDになる)。
+     * @note System OFFからの復帰はリセット扱いだが、保持したRAMの内容は残る
+     * @note ブートローダが同じRAMを使うと内容は壊れる(CRCで検出し、getStatus()がEMPTY/CORRUPTEDになる)
+     */
+    class retained_ram
+    {
+    public:
+        static constexpr size_t CAPACITY = 1536; ///< 保持できるデータの最大サイズ
+
+        /**
+         * @brief 直近のread()の結果
+         */
+        enum Status : uint8_t
+        {
+            EMPTY = 0, ///< 保持した内容がない(電源投入/リセット、または失われた)
+            VALID,     ///< 有効
+            CORRUPTED, ///< マジックナンバーはあるがサイズ/CRCが合わない
+            MISPLACED, ///< .noinitが起動時に初期化される範囲に置かれている(保持できない)
+        };
+
+        retained_ram() = delete;
+
+        static bool write(const uint8_t* data, const size_t size);
+        static size_t read(const uint8_t*& data);
+        static void invalidate();
+        static bool isPlacementValid();
+        static bool isPlacementValid(const void* address, const size_t size);
+
+        static Status getStatus()
+        {
+            return _status;
+        }
+
+        static uint32_t crc32(const uint8_t* data, const size_t size);
+        static void retainInSystemOff();
+        static void retainInSystemOff(const void* address, const size_t size);
+
+    private:
+        static constexpr uint32_t MAGIC = 0x52544E44; ///< "RTND"
+
+        struct Area
+        {
+            uint32_t magic;
+            uint32_t size;
+            uint32_t crc;
+            uint8_t data[CAPACITY];
+        };
+
+        static Area _area;
+        static inline Status _status = EMPTY;
+    };
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace utils
+{
+    /**
+     * @brief ピンをSAADCの入力(AIN)に変換
+     * @param [in] pin ピン番号(Arduino)
+     * @return PSELPの値。アナログ入力でなければ未接続
+     */
+    inline uint32_t toAnalogInput(const uint8_t pin)
+    {
+        switch (g_ADigitalPinMap[pin]) {
+            case 2:  return SAADC_CH_PSELP_PSELP_AnalogInput0;
+            case 3:  return SAADC_CH_PSELP_PSELP_AnalogInput1;
+            case 4:  return SAADC_CH_PSELP_PSELP_AnalogInput2;
+            case 5:  return SAADC_CH_PSELP_PSELP_AnalogInput3;
+            case 28: return SAADC_CH_PSELP_PSELP_AnalogInput4;
+            case 29: return SAADC_CH_PSELP_PSELP_AnalogInput5;
+            case 30: return SAADC_CH_PSELP_PSELP_AnalogInput6;
+            case 31: return SAADC_CH_PSELP_PSELP_AnalogInput7;
+            default: return SAADC_CH_PSELP_PSELP_NC;
+        }
+    }
+}
@@ -0,0 +1,308 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <Arduino.h>
+#include <utils/trace.h>
+
+namespace utils
+{
+    /**
+     * @brief 静的に確保する協調型のデッドラインスケジューラ
+     * @details 周期タスクとワンショットタスクを登録し、runOnce()をループから呼ぶ。
+     *          実行可能(リリース時刻を過ぎた)タスクのうち絶対デッドラインが最も早いものを1つだけ実行する(EDF)。
+     *          タスクごとに最悪実行時間/最大遅延(リリースから開始まで)/デッドラインミス回数を計測する。
+     *          協調型のため実行中のタスクは横取りされない。長い処理はタスク側で分割すること。
+     * @tparam MAX_TASKS 登録できる最大タスク数
+     */
+    template <size_t MAX_TASKS>
+    class scheduler
+    {
+    public:
+        using TaskFunction = void(*)();
+        using TaskId = uint8_t;
+
+        static constexpr TaskId INVALID_TASK = 0xFF;
+
+        /**
+         * @brief タスクごとの計測値
+         */
+        struct TaskStats
+        {
+            uint32_t lastUs;       ///< 直近の実行時間
+            uint32_t wcetUs;       ///< 最悪実行時間
+            uint32_t maxLatencyUs; ///< リリースから実行開始までの最大遅延(ジッタ)
+            uint32_t runs;         ///< 実行回数
+            uint32_t misses;       ///< デッドラインミス回数(飛ばした周期を含む)
+        };
+
+        scheduler() = default;
+
+
+        /**
+         * @brief 周期タスクを登録する
+         * @param [in] name       タスク名(統計出力用)
+         * @param [in] function   タスク本体
+         * @param [in] periodUs   周期(us)
+         * @param [in] deadlineUs リリースからの相対デッドライン(us)。0なら周期と同じ
+         * @return タスクID。登録できなければINVALID_TASK
+         */
+        TaskId addPeriodic(const char* name, TaskFunction function, const uint32_t periodUs, const uint32_t deadlineUs=0)
+        {
+            auto id = add(name, function, periodUs, deadlineUs ? deadlineUs : periodUs);
+            if (id != INVALID_TASK) {
+                _tasks[id].releaseUs = micros();
+                _tasks[id].isActive = true;
+            }
+            return id;
+        }
+
+
+        /**
+         * @brief ワンショットタスクを登録する
+         * @details 登録直後は停止しており、trigger()で実行を予約する
+         * @param [in] name       タスク名(統計出力用)
+         * @param [in] function   タスク本体
+         * @param [in] deadlineUs リリースからの相対デッドライン(us)
+         * @return タスクID。登録できなければINVALID_TASK
+         */
+        TaskId addOneShot(const char* name, TaskFunction function, const uint32_t deadlineUs)
+        {
+            return add(name, function, 0, deadlineUs);
+        }
+
+
+        /**
+         * @brief 周期を変更する
+         * @note 次回のリリース時刻は変更しない
+         */
+        void setPeriod(const TaskId id, const uint32_t periodUs, const uint32_t deadlineUs=0)
+        {
+            if (id >= _count || _tasks[id].periodUs == 0) {
+                return ;
+            }
+            _tasks[id].periodUs = periodUs;
+            _tasks[id].deadlineUs = deadlineUs ? deadlineUs : periodUs;
+        }
+
+
+        /**
+         * @brief 指定時間後にタスクをリリースする
+         * @details 予約済みのワンショットタスクを再度triggerすると予約が後ろにずれる(デバウンスに使える)
+         * @param [in] id      タスクID
+         * @param [in] delayUs リリースまでの時間(us)
+         */
+        void trigger(const TaskId id, const uint32_t delayUs=0)
+        {
+            if (id >= _count) {
+                return ;
+            }
+            _tasks[id].releaseUs = micros() + delayUs;
+            _tasks[id].isActive = true;
+        }
+
+
+        /**
+         * @brief タスクを停止する
+         */
+        void cancel(const TaskId id)
+        {
+            if (id >= _count) {
+                return ;
+            }
+            _tasks[id].isActive = false;
+        }
+
+
+        /**
+         * @brief リリース済みのタスクを1つ実行する
+         * @retval true  タスクを実行した
+         * @retval false 実行可能なタスクがなかった
+         */
+        bool runOnce()
+        {
+            auto now = micros();
+
+            // 実行可能なタスクのうち絶対デッドラインが最も早いもの
+            TaskId next = INVALID_TASK;
+            int32_t nextSlack = 0;
+            for (TaskId i = 0; i < _count; i++) {
+                auto& task = _tasks[i];
+                if (!task.isActive || (int32_t)(now - task.releaseUs) < 0) {
+                    continue;
+                }
+                int32_t slack = (int32_t)(task.releaseUs + task.deadlineUs - now);
+                if (next == INVALID_TASK || slack < nextSlack) {
+                    next = i;
+                    nextSlack = slack;
+                }
+            }
+            if (next == INVALID_TASK) {
+                return false;
+            }
+
+            auto& task = _tasks[next];
+            auto latencyUs = now - task.releaseUs;
+
+            // 実行前にリリース時刻を進めておく(タスク内でtrigger/cancelされてもよいように)
+            auto releaseUs = task.releaseUs;
+            if (task.periodUs == 0) {
+                task.isActive = false;
+            } else {
+                task.releaseUs += task.periodUs;
+            }
+
+            task.function();
+
+            auto end = micros();
+            auto elapsedUs = end - now;
+
+            auto& stats = task.stats;
+            stats.lastUs = elapsedUs;
+            stats.runs++;
+            if (elapsedUs > stats.wcetUs) {
+                stats.wcetUs = elapsedUs;
+            }
+            if (latencyUs > stats.maxLatencyUs) {
+                stats.maxLatencyUs = latencyUs;
+            }
+            if ((int32_t)(end - (releaseUs + task.deadlineUs)) > 0) {
+                stats.misses++;
+                TRACE(TASK_MISS, next, end - (releaseUs + task.deadlineUs));
+            }
+
+            // 周期タスクで次のリリースも過ぎているなら、飛ばした周期をミスとして数えて追いつく
+            if (task.periodUs > 0 && task.isActive) {
+                while ((int32_t)(end - (task.releaseUs + task.deadlineUs)) > 0) {
+                    task.releaseUs += task.periodUs;
+                    stats.misses++;
+                }
+            }
+
+            return true;
+        }
+
+
+        /**
+         * @brief 次にリリースされるタスクまでの時間を取得
+         * @return 次のリリースまでの時間(us)。実行可能なタスクがあれば0、予約がなければUINT32_MAX
+         */
+        uint32_t getNextReleaseUs() const
+        {
+            auto now = micros();
+            uint32_t nearest = UINT32_MAX;
+            for (TaskId i = 0; i < _count; i++) {
+                auto& task = _tasks[i];
+                if (!task.isActive) {
+                    continue;
+                }
+                int32_t remain = (int32_t)(task.releaseUs - now);
+                if (remain <= 0) {
+                    return 0;
+                }
+                if ((uint32_t)remain < nearest) {
+                    nearest = remain;
+                }
+            }
+            return nearest;
+        }
+
+
+        /**
+         * @brief 周期タスクのリリース時刻を現在時刻から振り直す
+         * @note スリープ復帰後など、意図的に止めていた間をデッドラインミスとして数えないために使う
+         */
+        void resync()
+        {
+            auto now = micros();
+            for (TaskId i = 0; i < _count; i++) {
+                auto& task = _tasks[i];
+                if (task.isActive && task.periodUs > 0) {
+                    task.releaseUs = now;
+                }
+            }
+        }
+
+
+        /**
+         * @brief 計測値を取得
+         */
+        const TaskStats& getStats(const TaskId id) const
+        {
+            return _tasks[id].stats;
+        }
+
+
+        /**
+         * @brief 計測値をリセット
+         */
+        void resetStats()
+        {
+            for (TaskId i = 0; i < _count; i++) {
+                _tasks[i].stats = TaskStats{};
+            }
+        }
+
+
+        /**
+         * @brief 計測値をJSON配列にシリアライズ
+         * @details [{"n":名前,"w":最悪実行時間us,"j":最大遅延us,"r":実行回数,"m":ミス回数}, ...]
+         * @param [out] buffer 出力先
+         * @param [in]  size   出力先のサイズ
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        size_t serializeStats(char* buffer, const size_t size) const
+        {
+            if (size < 3) {
+                return 0;
+            }
+
+            size_t length = 0;
+            buffer[length++] = '[';
+            for (TaskId i = 0; i < _count; i++) {
+                auto& task = _tasks[i];
+                auto written = snprintf(buffer + length, size - length - 1, "%s{\"n\":\"%s\",\"w\":%lu,\"j\":%lu,\"r\":%lu,\"m\":%lu}",
+                    (i == 0) ? "" : ",",
+                    task.name,
+                    (unsigned long)task.stats.wcetUs,
+                    (unsigned long)task.stats.maxLatencyUs,
+                    (unsigned long)task.stats.runs,
+                    (unsigned long)task.stats.misses);
+
+                // 入りきらなければそのタスク以降は出力しない
+                if (written < 0 || (size_t)written >= size - length - 1) {
+                    buffer[length] = '\0';
+                    break;
+                }
+                length += written;
+            }
+            buffer[length++] = ']';
+            buffer[length] = '\0';
+            return length;
+        }
+
+    private:
+        struct Task
+        {
+            const char* name;
+            TaskFunction function;
+            uint32_t periodUs;   ///< 0ならワンショット
+            uint32_t deadlineUs; ///< リリースからの相対デッドライン
+            uint32_t releaseUs;  ///< 次のリリース時刻
+            bool isActive;
+            TaskStats stats;
+        };
+
+        Task _tasks[MAX_TASKS] = {};
+        TaskId _count = 0;
+
+        TaskId add(const char* name, TaskFunction function, const uint32_t periodUs, const uint32_t deadlineUs)
+        {
+            if (_count >= MAX_TASKS) {
+                return INVALID_TASK;
+            }
+            _tasks[_count] = Task{name, function, periodUs, deadlineUs, 0, false, {}};
+            return _count++;
+        }
+    };
+}
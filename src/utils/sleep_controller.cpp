@@ -19,6 +19,20 @@ extern "C" {
 
         return ;
     }
+
+    /**
+     * @brief SAADC割り込みハンドラ(LightSleep中のジョイスティックのリミット).割り込みイベントは_saadcIntFiredでチェック
+     */
+    void SAADC_IRQHandler(void)
+    {
+        sleep_controller::_saadcIntFired = true;
+        NRF_SAADC->EVENTS_CH[0].LIMITH = 0;
+        NRF_SAADC->EVENTS_CH[0].LIMITL = 0;
+        NRF_SAADC->EVENTS_CH[1].LIMITH = 0;
+        NRF_SAADC->EVENTS_CH[1].LIMITL = 0;
+        // 復帰するまで繰り返し割り込まないようリミットの割り込みを止める
+        NRF_SAADC->INTENCLR = 0xFFFFFFFF;
+    }
 }
 
 #endif
\ No newline at end of file
@@ -9,13 +9,21 @@
 #include <ble.h>
 #include <ble/ble_hid.h>
 #include <ble/ble_config.h>
+#include <ble/ble_link.h>
 
 #include <bluefruit.h>
 #include <utils/debug.h>
 #include <Adafruit_SPIFlash.h>
+#include <layer/event.h>
+#include <utils/retained_ram.h>
+#include <utils/power_manager.h>
+#include <utils/hw_resources.h>
+#include <utils/saadc_input.h>
+#include <utils/energy_meter.h>
+#include <utils/boot_profiler.h>
 
 #define ENABLE_LPCOMP_IRQ (1)
-#define ENABLE_BLE_SETTING (0)
+#define ENABLE_SAADC_WAKE (1) ///< LightSleep中のジョイスティック復帰をSAADCのリミットで判定する(0ならLPCOMP)
 
 namespace utils 
 {
@@ -27,6 +35,23 @@ namespace utils
     class sleep_controller
     {
     public:
+        /**
+         * @brief LightSleepから復帰したきっかけ
+         */
+        enum WakeSource
+        {
+            WAKE_NONE = 0,
+            WAKE_TIMEOUT,  ///< タイムアウト(RTC2)
+            WAKE_BUTTON,   ///< ボタン(GPIOのLATCH)
+            WAKE_JOYSTICK, ///< ジョイスティック(LPCOMP)
+        };
+
+        static constexpr int PPI_SAADC_SAMPLE_CH = 3;              ///< RTC2のTICK -> SAADCのサンプル
+        static constexpr int PPI_SAADC_RESTART_CH = 4;             ///< SAADCのEND -> SAADCの再開
+
+        /// 使うハードウェア資源(RTC2はLightSleepのタイムアウトとSAADCのサンプリング周期)
+        using resources = hw_resources<hw_bits(PPI_SAADC_SAMPLE_CH, PPI_SAADC_RESTART_CH), 0, 0, hw_bits(2)>;
+
         sleep_controller() = delete;
     
         /**
@@ -73,31 +98,34 @@ namespace utils
             stopwatch_ms();
             DEBUG_PRINTF(">> light sleep start!");
 
-            prepareInterruptForSleep();
+            // ボタン割り込み設定
+            enableGpioIntrrupt();
 
-#if ENABLE_BLE_SETTING            
-            // ble::disconnect(true);
-            //ble::update(IDLE_CONNECTION_PARAMETER);
+            // ジョイスティック
+#if ENABLE_SAADC_WAKE
+            enableSaadcWake();
+#else
+            enableLpcompIntrrupt();
 #endif
 
-            // タイムアウト用
-            if (timeoutMs > 0) {
-                enableRtcIntrrupt(timeoutMs);
-            }
+            // 接続は維持したまま眠る(無操作が続いた時点でconn_param_managerがスレーブレイテンシを上げている)
+
+            // タイムアウト/SAADCのサンプリング用
+            enableRtcIntrrupt(timeoutMs);
     
             // WDT停止
             NRF_WDT->CONFIG |= (WDT_CONFIG_SLEEP_Pause << WDT_CONFIG_SLEEP_Pos);
 
-            // スリープ開始
-            sd_power_mode_set(NRF_POWER_MODE_LOWPWR);
-            sd_power_dcdc_mode_set(NRF_POWER_DCDC_ENABLE);
+            // スリープ開始(DCDCはpower_managerが起動時から有効にしている)
+            power_manager::verify(power_manager::LIGHT_SLEEP);
+            energy_meter::setSleeping(true);
 
             {
                 stopwatch_ms("light sleep");
                 
                 // スリープ本体
                 while(!(NRF_RTC2->EVENTS_COMPARE[0] ||  // RTC2
-                    _lpcompIntFired || // LPCOMP(Joystick)
+                    _lpcompIntFired || _saadcIntFired || // LPCOMP/SAADC(Joystick)
                     NRF_P0->LATCH || NRF_P1->LATCH) // GPIO(Button))) 
                 ){
                     sd_app_evt_wait();
@@ -111,23 +139,23 @@ namespace utils
                 // スリープここまで
             }
 
-            DEBUG_PRINTF("<< light sleep wakeup");
+            // 復帰のきっかけを記録(LATCHは割り込み解除でクリアされるので先に読む)
+            energy_meter::setSleeping(false);
+            _wakeUs = micros();
+            _wakeInputs = latchedInputs();
             bool timeouted = NRF_RTC2->EVENTS_COMPARE[0];
+            _wakeSource = _wakeInputs ? WAKE_BUTTON : (_lpcompIntFired || _saadcIntFired) ? WAKE_JOYSTICK : timeouted ? WAKE_TIMEOUT : WAKE_NONE;
+            DEBUG_PRINTF("<< light sleep wakeup source=%d inputs=0x%04x", _wakeSource, _wakeInputs);
 
             // 割り込み解除
             disableGpioIntrrupt();
+#if ENABLE_SAADC_WAKE
+            disableSaadcWake();
+#else
             disableLpcompIntrrupt();
+#endif
             disableRtcIntrrupt();
 
-            // BLE接続設定を元に戻す
-#if ENABLE_BLE_SETTING
-            if( !ble::update(ble::ACTIVE_CONNECTION_PARAMETER) ) {
-                // PC側で30sぐらい変更ガードが働いてるため、スリープが30s以内に解除されると失敗することがある（おそらくconnectionIntervalを縮めた場合）
-                // 失敗してるならもう切断してmain側の再接続に任せる
-                ble::disconnect(true);
-            }
-#endif            
-
             return timeouted;
         }
 
@@ -142,13 +170,20 @@ namespace utils
     
             prepareInterruptForSleep();
 
-            // BLE切断
-            ble::ble_hid::disconnect();
-            ble::ble_config::disconnect();
+            // BLE切断(切断を待ってからSoftDeviceを止める)
+            ble::ble_link::endAll(DISCONNECT_TIMEOUT_MS);
 
             // softdevice終了
             disableSoftDevice();
 
+            // 設定を保持したRAMと起動の記録はSystem OFF中も保持する
+            utils::retained_ram::retainInSystemOff();
+            utils::boot_profiler::retainInSystemOff();
+
+            // 復帰に使うもの(GPIOのSENSE/LPCOMP)以外は止まっているはず
+            power_manager::suspend(power_manager::SYSTEM_OFF);
+            power_manager::verify(power_manager::SYSTEM_OFF);
+
             DEBUG_PRINTF("<<< System OFF Sleep! (not return)");
 
             nrf_power_system_off(NRF_POWER);
@@ -156,6 +191,24 @@ namespace utils
         }
 
 
+        /**
+         * @brief 使う周辺機能をpower_managerに登録
+         * @details SAADC(LightSleepの復帰)とLPCOMP(DeepSleepの復帰)は復帰に使う間は動いていてよい。
+         *          QSPIは起動時にenterSleepQSPIFlash()で止めたまま使わない
+         */
+        static void registerPeripherals()
+        {
+            power_manager::add("sleep", "QSPI", []() { return NRF_QSPI->ENABLE != 0; }, enterSleepQSPIFlash, nullptr);
+#if ENABLE_SAADC_WAKE
+            power_manager::add("sleep", "SAADC", []() { return NRF_SAADC->ENABLE != 0; }, disableSaadcWake, nullptr, power_manager::LIGHT_SLEEP);
+            power_manager::add("sleep", "LPCOMP", []() { return NRF_LPCOMP->ENABLE != 0; }, disableLpcompIntrrupt, nullptr, power_manager::SYSTEM_OFF);
+#else
+            power_manager::add("sleep", "SAADC", []() { return NRF_SAADC->ENABLE != 0; }, disableSaadcWake, nullptr);
+            power_manager::add("sleep", "LPCOMP", []() { return NRF_LPCOMP->ENABLE != 0; }, disableLpcompIntrrupt, nullptr, power_manager::LIGHT_SLEEP | power_manager::SYSTEM_OFF);
+#endif
+        }
+
+
         /**
          * XIAOのオンボードQSPI Flashをスリープする
          */
@@ -169,20 +222,61 @@ namespace utils
             flashTransport.end();
         }
 
+        /**
+         * @brief 直近のLightSleepから復帰したきっかけ
+         */
+        static WakeSource getWakeSource()
+        {
+            return _wakeSource;
+        }
+
+        /**
+         * @brief 直近のLightSleepから復帰したときにLATCHされていたボタン
+         * @return Inputの組み合わせ。復帰後に離されていても含む
+         */
+        static uint16_t getWakeInputs()
+        {
+            return _wakeInputs;
+        }
+
+        /**
+         * @brief 直近のLightSleepから復帰した時刻(micros)
+         */
+        static uint32_t getWakeUs()
+        {
+            return _wakeUs;
+        }
+
+        /**
+         * @brief ジョイスティックの中心(キャリブレーション値)を設定
+         * @details LightSleep中はこの値の周りにSAADCのリミットを設定する。0ならスリープ開始時の値を中心にする
+         * @param [in] centerX X軸の中心(axis::getValue()の値)
+         * @param [in] centerY Y軸の中心(axis::getValue()の値)
+         */
+        static void setJoystickCenter(const uint32_t centerX, const uint32_t centerY)
+        {
+            _centerX = centerX;
+            _centerY = centerY;
+        }
+
         static volatile bool _lpcompIntFired;
+        static inline volatile bool _saadcIntFired = false;
 
 
     private:
         static uint32_t _startMs;
+        static inline WakeSource _wakeSource = WAKE_NONE;
+        static inline uint16_t _wakeInputs = 0;
+        static inline uint32_t _wakeUs = 0;
+        static inline uint32_t _centerX = 0;
+        static inline uint32_t _centerY = 0;
+        static inline int16_t _saadcResult[2] = {};   ///< SAADCの結果(EasyDMAの書き込み先)
+
+        static constexpr uint32_t RTC_HZ = 16;                     ///< LightSleep中のRTC2の周波数(SAADCのサンプリング周期)
+        static constexpr uint32_t RTC_PRESCALER = 32768 / RTC_HZ - 1;
+        static constexpr int16_t JOYSTICK_WAKE_THRESHOLD = 48;     ///< 中心からこれ以上倒れたら復帰する(10bit)
+        static constexpr uint32_t DISCONNECT_TIMEOUT_MS = 1000; ///< DeepSleep前の切断待ち
 
-#if ENABLE_BLE_SETTING                    
-        static constexpr ble::ble_hid::ConnectionParameter IDLE_CONNECTION_PARAMETER = {
-            ble::ACTIVE_CONNECTION_PARAMETER.connectionInterval,  // connectionIntervalは変更するとセントラルから拒否られるので変えない
-            79,   // slaveLatency 
-            3200, // sup timeout 30000ms
-            -4,   // txpower -4dbm
-        };
-#endif
         
 
         /**
@@ -235,11 +329,15 @@ namespace utils
             NRF_RTC2->TASKS_STOP = 1;
             NRF_RTC2->TASKS_CLEAR = 1;
 
-            NRF_RTC2->PRESCALER = 32767; // 1ms/tick
-            NRF_RTC2->CC[0] = timeoutMs;
+            // 32768Hz / (PRESCALER + 1) = RTC_HZ。TICKはSAADCのサンプリングに使う
+            NRF_RTC2->PRESCALER = RTC_PRESCALER;
             NRF_RTC2->EVENTS_COMPARE[0] = 0;
+            NRF_RTC2->EVENTS_TICK = 0;
 
-            NRF_RTC2->INTENSET |= RTC_INTENSET_COMPARE0_Msk;
+            if (timeoutMs > 0) {
+                NRF_RTC2->CC[0] = max((uint32_t)1, (uint32_t)(((uint64_t)timeoutMs * RTC_HZ) / 1000));
+                NRF_RTC2->INTENSET |= RTC_INTENSET_COMPARE0_Msk;
+            }
             NRF_RTC2->TASKS_START = 1;
         }
 
@@ -250,11 +348,118 @@ namespace utils
         static inline void disableRtcIntrrupt()
         {
             NRF_RTC2->EVENTS_COMPARE[0] = 0;
+            NRF_RTC2->EVENTS_TICK = 0;
             NRF_RTC2->INTENCLR = RTC_INTENCLR_COMPARE0_Msk;
             NRF_RTC2->TASKS_STOP = 1;
         }
 
 
+        /**
+         * @brief SAADCのリミットによるジョイスティックの復帰を有効化
+         * @details RTC2のTICKでPPI経由でX/Y軸をサンプリングし、中心からJOYSTICK_WAKE_THRESHOLD以上離れたら
+         *          LIMITH/LIMITLの割り込みで復帰する。サンプリングの間CPUは動かない。
+         *          結果のバッファが埋まったらPPIでSAADCを再開し、次のTICKに備える。
+         */
+        static inline void enableSaadcWake()
+        {
+            // 中心(未キャリブレーションなら現在値)をSAADCの生の値にする
+            auto toRaw = [](const uint32_t center, const bool isInverse) {
+                return (int16_t)(isInverse ? 1024 - center : center);
+            };
+            int16_t centerX = toRaw(_centerX ? _centerX : joystick::xAxis::getValue(), joystick::xAxis::isInverse());
+            int16_t centerY = toRaw(_centerY ? _centerY : joystick::yAxis::getValue(), joystick::yAxis::isInverse());
+
+            // analogRead()と同じ条件(10bit、既定のAR_DEFAULT=内部0.6V基準でゲイン1/6の3.6V)
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+            NRF_SAADC->RESOLUTION = SAADC_RESOLUTION_VAL_10bit;
+            NRF_SAADC->OVERSAMPLE = SAADC_OVERSAMPLE_OVERSAMPLE_Bypass;
+            NRF_SAADC->SAMPLERATE = SAADC_SAMPLERATE_MODE_Task << SAADC_SAMPLERATE_MODE_Pos;
+            configureSaadcChannel(0, toAnalogInput(joystick::xAxis::getPin()), centerX);
+            configureSaadcChannel(1, toAnalogInput(joystick::yAxis::getPin()), centerY);
+
+            NRF_SAADC->RESULT.PTR = (uint32_t)_saadcResult;
+            NRF_SAADC->RESULT.MAXCNT = 2;
+
+            NRF_SAADC->EVENTS_CH[0].LIMITH = 0;
+            NRF_SAADC->EVENTS_CH[0].LIMITL = 0;
+            NRF_SAADC->EVENTS_CH[1].LIMITH = 0;
+            NRF_SAADC->EVENTS_CH[1].LIMITL = 0;
+            NRF_SAADC->INTENSET = SAADC_INTENSET_CH0LIMITH_Msk | SAADC_INTENSET_CH0LIMITL_Msk
+                                | SAADC_INTENSET_CH1LIMITH_Msk | SAADC_INTENSET_CH1LIMITL_Msk;
+
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Enabled;
+            NRF_SAADC->EVENTS_STARTED = 0;
+            NRF_SAADC->TASKS_START = 1;
+            while (NRF_SAADC->EVENTS_STARTED == 0);
+            NRF_SAADC->EVENTS_STARTED = 0;
+            NRF_SAADC->EVENTS_END = 0;
+
+            // RTC2のTICK -> サンプル、END -> 再開
+            NRF_RTC2->EVTENSET = RTC_EVTENSET_TICK_Msk;
+            NRF_PPI->CH[PPI_SAADC_SAMPLE_CH].EEP = (uint32_t)&NRF_RTC2->EVENTS_TICK;
+            NRF_PPI->CH[PPI_SAADC_SAMPLE_CH].TEP = (uint32_t)&NRF_SAADC->TASKS_SAMPLE;
+            NRF_PPI->CH[PPI_SAADC_RESTART_CH].EEP = (uint32_t)&NRF_SAADC->EVENTS_END;
+            NRF_PPI->CH[PPI_SAADC_RESTART_CH].TEP = (uint32_t)&NRF_SAADC->TASKS_START;
+            NRF_PPI->CHENSET = (1 << PPI_SAADC_SAMPLE_CH) | (1 << PPI_SAADC_RESTART_CH);
+
+            _saadcIntFired = false;
+            sd_nvic_ClearPendingIRQ(SAADC_IRQn);
+            sd_nvic_SetPriority(SAADC_IRQn, 3);
+            sd_nvic_EnableIRQ(SAADC_IRQn);
+        }
+
+
+        /**
+         * @brief SAADCのリミットによるジョイスティックの復帰を停止
+         * @note analogRead()がチャネル0を設定し直せるよう、使ったチャネルは未接続に戻す
+         */
+        static inline void disableSaadcWake()
+        {
+            sd_nvic_DisableIRQ(SAADC_IRQn);
+
+            NRF_PPI->CHENCLR = (1 << PPI_SAADC_SAMPLE_CH) | (1 << PPI_SAADC_RESTART_CH);
+            NRF_RTC2->EVTENCLR = RTC_EVTENCLR_TICK_Msk;
+
+            NRF_SAADC->INTENCLR = 0xFFFFFFFF;
+            NRF_SAADC->EVENTS_STOPPED = 0;
+            NRF_SAADC->TASKS_STOP = 1;
+            while (NRF_SAADC->EVENTS_STOPPED == 0);
+            NRF_SAADC->EVENTS_STOPPED = 0;
+            NRF_SAADC->ENABLE = SAADC_ENABLE_ENABLE_Disabled;
+
+            for (int ch = 0; ch < 2; ch++) {
+                NRF_SAADC->CH[ch].PSELP = SAADC_CH_PSELP_PSELP_NC;
+                NRF_SAADC->CH[ch].PSELN = SAADC_CH_PSELN_PSELN_NC;
+                NRF_SAADC->CH[ch].LIMIT = 0x7FFF8000; // リセット値(リミットなし)
+                NRF_SAADC->EVENTS_CH[ch].LIMITH = 0;
+                NRF_SAADC->EVENTS_CH[ch].LIMITL = 0;
+            }
+            NRF_SAADC->EVENTS_END = 0;
+            NRF_SAADC->EVENTS_STARTED = 0;
+            _saadcIntFired = false;
+        }
+
+
+        /**
+         * @brief SAADCのチャネルを中心±JOYSTICK_WAKE_THRESHOLDのリミット付きで設定
+         */
+        static inline void configureSaadcChannel(const int ch, const uint32_t input, const int16_t center)
+        {
+            NRF_SAADC->CH[ch].CONFIG = (SAADC_CH_CONFIG_RESP_Bypass << SAADC_CH_CONFIG_RESP_Pos)
+                                     | (SAADC_CH_CONFIG_RESN_Bypass << SAADC_CH_CONFIG_RESN_Pos)
+                                     | (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos)
+                                     | (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos)
+                                     | (SAADC_CH_CONFIG_TACQ_10us << SAADC_CH_CONFIG_TACQ_Pos)
+                                     | (SAADC_CH_CONFIG_MODE_SE << SAADC_CH_CONFIG_MODE_Pos);
+            NRF_SAADC->CH[ch].PSELP = input;
+            NRF_SAADC->CH[ch].PSELN = SAADC_CH_PSELN_PSELN_NC;
+
+            uint16_t high = center + JOYSTICK_WAKE_THRESHOLD;
+            uint16_t low = center - JOYSTICK_WAKE_THRESHOLD;
+            NRF_SAADC->CH[ch].LIMIT = ((uint32_t)high << SAADC_CH_LIMIT_HIGH_Pos) | ((uint32_t)low << SAADC_CH_LIMIT_LOW_Pos);
+        }
+
+
         /*
          * @brief X/Y軸のLPCOMP割り込みを有効化
          * @details ジョイスティックX軸/Y軸の電圧をLPCOMPで比較し、軸が動いたら割込みをかける(何かしら動いたらX/Y軸の電圧が対象じゃなくなるはず。一応ヒステリシスを入れる)
@@ -338,6 +543,28 @@ namespace utils
             NRF_P1->LATCH = NRF_P1->LATCH;
         }
 
+        /**
+         * @brief SENSEでLATCHされたボタンを取得
+         * @return Inputの組み合わせ
+         */
+        static inline uint16_t latchedInputs()
+        {
+            uint16_t inputs = 0;
+            if (isLatched(button1::getPin()))        inputs |= Input::BUTTON_1;
+            if (isLatched(button2::getPin()))        inputs |= Input::BUTTON_2;
+            if (isLatched(button3::getPin()))        inputs |= Input::BUTTON_3;
+            if (isLatched(button4::getPin()))        inputs |= Input::BUTTON_4;
+            if (isLatched(middle_button1::getPin())) inputs |= Input::MIDDLE_BUTTON_1;
+            return inputs;
+        }
+
+        static inline bool isLatched(const uint8_t pin)
+        {
+            auto nrfPin = g_ADigitalPinMap[pin];
+            auto port = (nrfPin < 32) ? NRF_P0 : NRF_P1;
+            return (port->LATCH >> (nrfPin & 0x1F)) & 1;
+        }
+
         /*
          * @brief GPIO(ボタン)割り込みを停止
          */
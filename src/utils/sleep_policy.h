@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <Arduino.h>
+#include <config/idle_histogram.h>
+
+namespace utils
+{
+    /**
+     * @brief 無操作時間のヒストグラムからLightSleepに入るまでの時間と無操作時のスレーブレイテンシを選ぶクラス
+     * @details 候補ごとに、ヒストグラムの各区間の代表値の無操作時間が来たときの
+     *          消費電荷(uA・s)と遅延(ms)の期待値を求め、遅延を重みで電荷に換算した合計が最小のものを選ぶ。
+     *
+     *          LightSleepに入るまでの時間T(CPU側)
+     *          - 無操作時間gがTより短ければ、gの間起きたまま
+     *          - 長ければTまで起きたまま、残りはLightSleep。復帰にWAKE_LATENCY_MSかかる
+     *
+     *          スレーブレイテンシd(無線側。IDLEの段階になってから無操作が終わるまで)
+     *          - 接続イベントが1/(d+1)になる
+     *          - 緩める/戻すパラメータ更新の手続きに電荷がかかる
+     *          - セントラルからの送信(出力レポート等)が平均d/2接続間隔遅れる
+     *
+     *          CPUと無線の電荷は独立なので、Tとdは別々に選ぶ。
+     *          サンプル数がMIN_SAMPLESに満たないか無効なら設定値(固定)を使う。
+     * @note 電流値はXIAO nRF52840での目安のモデル値で、実測ではない
+     */
+    class sleep_policy
+    {
+    public:
+        sleep_policy() = default;
+
+
+        /**
+         * @brief 設定する
+         * @param [in] isAdaptive      falseなら常に固定値
+         * @param [in] latencyWeight   遅延1msを何uA・sとみなすか
+         * @param [in] fixedTimeoutMs  固定のLightSleepまでの時間(ms)
+         * @param [in] fixedLatency    固定のスレーブレイテンシ
+         * @param [in] relaxDelayMs    無操作からスレーブレイテンシを上げるまでの時間(ms)
+         */
+        void inline configure(const bool isAdaptive, const uint16_t latencyWeight, const uint32_t fixedTimeoutMs, const uint16_t fixedLatency, const uint32_t relaxDelayMs)
+        {
+            _isAdaptive = isAdaptive;
+            _latencyWeight = latencyWeight;
+            _fixedTimeoutMs = fixedTimeoutMs;
+            _fixedLatency = fixedLatency;
+            _relaxDelayMs = relaxDelayMs;
+            _timeoutMs = fixedTimeoutMs;
+            _latency = fixedLatency;
+        }
+
+
+        /**
+         * @brief ヒストグラムから選び直す
+         * @param [in] histogram 無操作時間のヒストグラム
+         */
+        void inline evaluate(const idle_histogram& histogram)
+        {
+            _samples = histogram.total();
+            _isLearned = _isAdaptive && _samples >= MIN_SAMPLES;
+            if (!_isLearned) {
+                _timeoutMs = _fixedTimeoutMs;
+                _latency = _fixedLatency;
+                return ;
+            }
+
+            // LightSleepまでの時間
+            uint64_t bestCost = UINT64_MAX;
+            for (auto timeoutMs : TIMEOUT_CANDIDATES_MS) {
+                uint64_t cost = 0;
+                for (size_t bin = 0; bin < idle_histogram::BIN_COUNT; bin++) {
+                    cost += (uint64_t)histogram.counts[bin] * sleepCost(idle_histogram::representativeMs(bin), timeoutMs);
+                }
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    _timeoutMs = timeoutMs;
+                }
+            }
+            _sleepCost = bestCost / _samples;
+
+            // スレーブレイテンシ
+            bestCost = UINT64_MAX;
+            for (auto latency : LATENCY_CANDIDATES) {
+                uint64_t cost = 0;
+                for (size_t bin = 0; bin < idle_histogram::BIN_COUNT; bin++) {
+                    cost += (uint64_t)histogram.counts[bin] * radioCost(idle_histogram::representativeMs(bin), latency);
+                }
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    _latency = latency;
+                }
+            }
+            _radioCost = bestCost / _samples;
+        }
+
+
+        /**
+         * @brief LightSleepに入るまでの無操作時間(ms)
+         */
+        uint32_t inline getLightSleepTimeoutMs() const
+        {
+            return _timeoutMs;
+        }
+
+
+        /**
+         * @brief 無操作時のスレーブレイテンシ(0なら緩めない)
+         */
+        uint16_t inline getIdleLatency() const
+        {
+            return _latency;
+        }
+
+
+        /**
+         * @brief 選んだ値をJSONにシリアライズ
+         * @details {"h":[区間ごとの回数],"l":学習済み(0/1),"t":LightSleepまでms,"d":スレーブレイテンシ,"c":[CPU側,無線側の1回あたりのコスト]}
+         * @return 書き込んだサイズ(終端文字を含まない)
+         */
+        size_t serializeStats(const idle_histogram& histogram, char* buffer, const size_t size) const
+        {
+            size_t length = 0;
+            for (size_t bin = 0; bin < idle_histogram::BIN_COUNT && length < size; bin++) {
+                length += snprintf(buffer + length, size - length, "%s%u", (bin == 0) ? "{\"h\":[" : ",", histogram.counts[bin]);
+            }
+            if (length < size) {
+                length += snprintf(buffer + length, size - length, "],\"l\":%d,\"t\":%lu,\"d\":%u,\"c\":[%lu,%lu]}",
+                    _isLearned ? 1 : 0,
+                    (unsigned long)_timeoutMs,
+                    _latency,
+                    (unsigned long)_sleepCost,
+                    (unsigned long)_radioCost);
+            }
+            return min(length, size - 1);
+        }
+
+    private:
+        static constexpr uint32_t MIN_SAMPLES = 20;
+        static constexpr uint32_t TIMEOUT_CANDIDATES_MS[] = {5000, 10000, 20000, 30000, 60000, 120000, 300000, 600000};
+        static constexpr uint16_t LATENCY_CANDIDATES[] = {0, 4, 15, 30};
+
+        // モデル値(uA、uA・s、ms)
+        static constexpr uint32_t CPU_ACTIVE_UA = 1200;     ///< 起きている間(IDLEの段階のスキャン)
+        static constexpr uint32_t CPU_SLEEP_UA = 30;        ///< LightSleep中(SAADCの間欠サンプリングを含む)
+        static constexpr uint32_t WAKE_LATENCY_MS = 30;     ///< LightSleepからの復帰の遅れ
+        static constexpr uint32_t RADIO_UA = 600;           ///< スレーブレイテンシ0で接続を維持する電流
+        static constexpr uint32_t UPDATE_UAS = 100;         ///< 緩める/戻すパラメータ更新1往復の電荷
+        static constexpr uint32_t CONNECTION_INTERVAL_MS = 8;       ///< 接続間隔(7.5msを切り上げ)
+
+        bool _isAdaptive = true;
+        bool _isLearned = false;
+        uint16_t _latencyWeight = 100;
+        uint32_t _fixedTimeoutMs = 30000;
+        uint16_t _fixedLatency = 30;
+        uint32_t _relaxDelayMs = 2000;
+        uint32_t _timeoutMs = 30000;
+        uint16_t _latency = 30;
+        uint32_t _samples = 0;
+        uint32_t _sleepCost = 0;
+        uint32_t _radioCost = 0;
+
+
+        /**
+         * @brief 無操作時間gapMsにLightSleepまでの時間timeoutMsで臨んだときのコスト(uA・s換算)
+         */
+        uint32_t inline sleepCost(const uint32_t gapMs, const uint32_t timeoutMs) const
+        {
+            if (gapMs <= timeoutMs) {
+                return (uint64_t)CPU_ACTIVE_UA * gapMs / 1000;
+            }
+            uint64_t charge = ((uint64_t)CPU_ACTIVE_UA * timeoutMs + (uint64_t)CPU_SLEEP_UA * (gapMs - timeoutMs)) / 1000;
+            return charge + (uint64_t)_latencyWeight * WAKE_LATENCY_MS;
+        }
+
+
+        /**
+         * @brief 無操作時間gapMsにスレーブレイテンシlatencyで臨んだときのコスト(uA・s換算)
+         */
+        uint32_t inline radioCost(const uint32_t gapMs, const uint16_t latency) const
+        {
+            if (latency == 0 || gapMs <= _relaxDelayMs) {
+                return (uint64_t)RADIO_UA * gapMs / 1000;
+            }
+            auto relaxedMs = gapMs - _relaxDelayMs;
+            uint64_t charge = ((uint64_t)RADIO_UA * _relaxDelayMs + (uint64_t)RADIO_UA * relaxedMs / (latency + 1)) / 1000;
+            return charge + UPDATE_UAS + (uint64_t)_latencyWeight * latency * CONNECTION_INTERVAL_MS / 2;
+        }
+    };
+}
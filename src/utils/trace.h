@@ -0,0 +1,171 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string.h>
+
+#define ENABLE_TRACE (1) ///< バイナリトレースを記録する(0なら TRACE() は何もしない)
+
+namespace utils
+{
+    /**
+     * @brief RAM上のバイナリトレース
+     * @details イベントID+引数を時刻と一緒に固定長で記録する。時刻はRTC1のCOUNTER(FreeRTOSのtick、1024Hz)と
+     *          DWTのサイクルカウンタ(CYCCNT、64MHz)の2つを残し、粗い時刻をRTC1、tick未満の差をCYCCNTで取る。
+     *          書式文字列はホスト側(tools/trace)に置き、デバイスでは整形しない。記録は数十サイクルで、Serialに書かないため
+     *          タイミングをほとんど変えない。
+     *
+     *          書き込みはアトミックに通し番号(seq)を取って枠を確保し、最後に枠のseqを書いて確定する(割り込み/BLEのタスクからも記録できる)。
+     *          読み出し(drain())は1か所からだけ行い、枠のseqが期待した番号のときだけ取り出す。
+     *          読み出しが追いつかず上書きされた分は飛ばす(ホストではseqの欠番で分かる)。
+     * @note CYCCNTはCPUが眠っている間(active_idleの待機ごと、LightSleep)は進まないため、単独では眠りを跨いだ時間が消える。
+     *       RTC1は眠っている間も進むので、ホストはRTC1の時刻から1tickの範囲に収まるときだけCYCCNTの差を使う。
+     *       SYNCイベント(millis())はRTC1のCOUNTER(24bit、約4.5時間で一周)をmillis()の時刻に合わせるために記録する
+     */
+    class trace
+    {
+    public:
+        /**
+         * @brief イベントID
+         * @note tools/trace/index.html の EVENTS と合わせること
+         */
+        enum Event : uint16_t
+        {
+            SYNC = 1,        ///< 時刻合わせ(arg1: millis)
+            SCAN_BEGIN,      ///< スキャン開始(arg0: 段階)
+            SCAN_END,        ///< スキャン終了(arg0: 操作あり)
+            CHORD,           ///< 同時押しの確定(arg0: 押下中のInput)
+            REPORT_KEYBOARD, ///< キーボードのレポート(arg0: 修飾キー, arg1: キーコード先頭4個)
+            REPORT_BUTTONS,  ///< マウスボタンのレポート(arg0: ボタン)
+            REPORT_MOUSE,    ///< カーソル移動/スクロールのレポート(arg1: x,y,垂直,水平の各8bit)
+            REPORT_QUEUED,   ///< 未接続のためレポートを溜めた(arg0: 種類)
+            REPORT_FAILED,   ///< 送信キューに積めなかった
+            SLEEP_ENTER,     ///< LightSleep開始(arg1: DeepSleepまでのms)
+            SLEEP_WAKE,      ///< LightSleepから復帰(arg0: きっかけ, arg1: LATCHされたボタン)
+            TASK_MISS,       ///< デッドラインミス(arg0: タスク番号, arg1: 遅れus)
+        };
+
+        /**
+         * @brief 記録1件(20バイト。このままホストに送る)
+         */
+        struct Record
+        {
+            uint32_t seq;    ///< 通し番号
+            uint32_t ticks;  ///< RTC1のCOUNTER(24bit、1024Hz)
+            uint32_t cycles; ///< CYCCNT
+            uint16_t id;     ///< Event
+            uint16_t arg0;
+            uint32_t arg1;
+        };
+        static_assert(sizeof(Record) == 20, "trace record must be 20 bytes");
+
+        static constexpr size_t CAPACITY = 256;     ///< 記録できる件数(2のべき乗)
+        static constexpr size_t HEADER_SIZE = 4;    ///< drain()の先頭: 'T','R',件数,予約
+
+        trace() = delete;
+
+
+        /**
+         * @brief サイクルカウンタを有効にする
+         */
+        static void begin()
+        {
+            CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+            DWT->CYCCNT = 0;
+            DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+            sync();
+        }
+
+
+        /**
+         * @brief 1件記録する(どのコンテキストからでも呼べる)
+         */
+        static inline void record(const Event id, const uint16_t arg0=0, const uint32_t arg1=0)
+        {
+            auto seq = __atomic_fetch_add(&_head, 1, __ATOMIC_RELAXED);
+            auto& slot = _records[seq & (CAPACITY - 1)];
+            __atomic_store_n(&slot.seq, WRITING, __ATOMIC_RELAXED);
+            __atomic_signal_fence(__ATOMIC_SEQ_CST);
+            slot.ticks = NRF_RTC1->COUNTER;
+            slot.cycles = DWT->CYCCNT;
+            slot.id = id;
+            slot.arg0 = arg0;
+            slot.arg1 = arg1;
+            __atomic_store_n(&slot.seq, seq, __ATOMIC_RELEASE);
+        }
+
+
+        /**
+         * @brief 時刻合わせのイベントを記録する(周期的に呼ぶ。RTC1のCOUNTERをmillis()に合わせる)
+         */
+        static void sync()
+        {
+            record(SYNC, 0, millis());
+        }
+
+
+        /**
+         * @brief 未読の記録を取り出す
+         * @param [out] buffer 出力先。先頭HEADER_SIZEバイトのヘッダに続けてRecordを並べる
+         * @param [in]  size   出力先のサイズ
+         * @return 書き込んだサイズ。未読がなければ0
+         * @note 呼び出しは1か所(1つのタスク)からだけにすること
+         */
+        static size_t drain(uint8_t* buffer, const size_t size)
+        {
+            if (size < HEADER_SIZE + sizeof(Record)) {
+                return 0;
+            }
+
+            // 上書きされた分は飛ばす
+            auto head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+            if (head - _tail > CAPACITY) {
+                _tail = head - CAPACITY;
+            }
+
+            size_t count = 0;
+            auto maxCount = min((size - HEADER_SIZE) / sizeof(Record), (size_t)UINT8_MAX);
+            while (_tail != head && count < maxCount) {
+                auto& slot = _records[_tail & (CAPACITY - 1)];
+                auto seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+                if (seq != _tail) {
+                    if (seq != WRITING && (int32_t)(seq - _tail) > 0) {
+                        _tail++; // 上書きされた
+                        continue;
+                    }
+                    break; // 書き込み中
+                }
+
+                Record record;
+                memcpy(&record, (const void*)&slot, sizeof(Record));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) == _tail) {
+                    memcpy(buffer + HEADER_SIZE + count * sizeof(Record), &record, sizeof(Record));
+                    count++;
+                }
+                _tail++;
+            }
+
+            if (count == 0) {
+                return 0;
+            }
+            buffer[0] = 'T';
+            buffer[1] = 'R';
+            buffer[2] = (uint8_t)count;
+            buffer[3] = 0;
+            return HEADER_SIZE + count * sizeof(Record);
+        }
+
+    private:
+        static constexpr uint32_t WRITING = 0xFFFFFFFF; ///< 書き込み中の枠のseq
+
+        static inline Record _records[CAPACITY] = {};
+        static inline uint32_t _head = 1; ///< 次に書く通し番号(0は未使用の枠と区別するため使わない)
+        static inline uint32_t _tail = 1; ///< 次に読む通し番号
+    };
+}
+
+#if ENABLE_TRACE
+#define TRACE(event, ...) utils::trace::record(utils::trace::event, ##__VA_ARGS__)
+#else
+#define TRACE(event, ...)
+#endif
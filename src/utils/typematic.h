@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <Arduino.h>
+
+/**
+ * @brief キーリピート(タイプマティック)をデバイス側で生成するスケジューラ
+ * @details poll()をループから呼ぶだけで、打鍵すべきタイミングかどうかを返す(待機はしない)。
+ *          リピート間隔は強さ(0-255)に応じて遅い間隔～速い間隔の間で変化する。
+ */
+class typematic
+{
+    public:
+        /**
+         * @brief コンストラクタ
+         * @param [in] delayMs      最初の打鍵からリピート開始までの時間
+         * @param [in] slowPeriodMs 強さ0のときのリピート間隔
+         * @param [in] fastPeriodMs 強さ255のときのリピート間隔
+         */
+        typematic(const uint32_t delayMs, const uint32_t slowPeriodMs, const uint32_t fastPeriodMs)
+            : _delayMs(delayMs), _slowPeriodMs(slowPeriodMs), _fastPeriodMs(fastPeriodMs) {}
+
+
+        /**
+         * @brief 打鍵タイミングか判定する
+         * @param [in] active   キーが押され続けているか
+         * @param [in] strength 強さ(0-255)。大きいほどリピートが速くなる
+         * @retval true  打鍵する
+         * @retval false 打鍵しない
+         */
+        bool inline poll(const bool active, const uint8_t strength)
+        {
+            if (!active) {
+                stop();
+                return false;
+            }
+
+            auto now = millis();
+
+            // 押し始めは即時打鍵
+            if (!_isRunning) {
+                _isRunning = true;
+                _nextMs = now + _delayMs;
+                return true;
+            }
+
+            if ((int32_t)(now - _nextMs) < 0) {
+                return false;
+            }
+
+            // 遅れた分をまとめて打鍵しないよう、次回は現在時刻から数える
+            _nextMs = now + getPeriodMs(strength);
+            return true;
+        }
+
+
+        /**
+         * @brief リピートを停止する
+         */
+        void inline stop()
+        {
+            _isRunning = false;
+        }
+
+
+        /**
+         * @brief 強さに応じたリピート間隔を取得
+         * @param [in] strength 強さ(0-255)
+         * @return リピート間隔(ms)
+         */
+        uint32_t inline getPeriodMs(const uint8_t strength) const
+        {
+            return _slowPeriodMs - (((_slowPeriodMs - _fastPeriodMs) * strength) / 255);
+        }
+
+    private:
+        uint32_t _delayMs;
+        uint32_t _slowPeriodMs;
+        uint32_t _fastPeriodMs;
+        uint32_t _nextMs = 0;
+        bool _isRunning = false;
+};
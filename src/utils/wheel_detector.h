@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+#include <utils/fixed_math.h>
+
+/**
+ * @brief ジョイスティックの回転操作をスクロール量に変換するユーティリティクラス
+ * @details iPodのクリックホイールのように、倒した状態でぐるぐる回した角度に比例してスクロール量を返す。
+ *          1周あたりのスクロール量は設定値で決まり、回し続ける限り上限なくスクロールできる。
+ */
+class wheel_detector
+{
+    public:
+        /**
+         * @brief コンストラクタ
+         * @param [in] unitsPerRevolution 1周あたりのスクロール量。0なら無効
+         */
+        wheel_detector(const uint16_t unitsPerRevolution = 0): _unitsPerRevolution(unitsPerRevolution) {}
+
+
+        /**
+         * @brief 1周あたりのスクロール量を設定
+         * @param [in] unitsPerRevolution 1周あたりのスクロール量。0なら無効
+         */
+        void inline setUnitsPerRevolution(const uint16_t unitsPerRevolution)
+        {
+            _unitsPerRevolution = unitsPerRevolution;
+            reset();
+        }
+
+
+        /**
+         * @brief ホイールモードが有効か
+         */
+        bool inline isEnabled() const
+        {
+            return _unitsPerRevolution > 0;
+        }
+
+
+        /**
+         * @brief 角度の追跡をリセットする
+         */
+        void inline reset()
+        {
+            _isTracking = false;
+            _accumulated = 0;
+        }
+
+
+        /**
+         * @brief ジョイスティックの位置を与えてスクロール量を計算する
+         * @param [in] x 中心からのX軸の差(-512～+512)
+         * @param [in] y 中心からのY軸の差(-512～+512)。下方向が正
+         * @return 今回発生したスクロール量。時計回りが正
+         */
+        int32_t inline update(const int32_t x, const int32_t y)
+        {
+            if (!isEnabled()) {
+                return 0;
+            }
+
+            // 倒し具合にヒステリシスを持たせて、リング外周付近でのON/OFFのばたつきを抑える
+            int32_t r2 = (x * x) + (y * y);
+            int32_t threshold = _isTracking ? RADIUS_OFF : RADIUS_ON;
+            if (r2 < threshold * threshold) {
+                reset();
+                return 0;
+            }
+
+            auto angle = fixed::atan2(y, x);
+            if (!_isTracking) {
+                // 倒した直後は基準角度を記録するだけ
+                _previousAngle = angle;
+                _isTracking = true;
+                return 0;
+            }
+
+            auto delta = fixed::angleDelta(angle, _previousAngle);
+            _previousAngle = angle;
+
+            // 1周(65536)あたりunitsPerRevolutionになるように積算し、端数は次回に持ち越す
+            _accumulated += static_cast<int32_t>(delta) * _unitsPerRevolution;
+            int32_t units = _accumulated / static_cast<int32_t>(fixed::FULL_TURN);
+            _accumulated -= units * static_cast<int32_t>(fixed::FULL_TURN);
+            return units;
+        }
+
+    private:
+        static constexpr int32_t RADIUS_ON = 256;  ///< 追跡を開始する倒し量(最大512)
+        static constexpr int32_t RADIUS_OFF = 192; ///< 追跡を終了する倒し量
+
+        uint16_t _unitsPerRevolution = 0;
+        uint16_t _previousAngle = 0;
+        bool _isTracking = false;
+        int32_t _accumulated = 0;
+};
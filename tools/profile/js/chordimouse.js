@@ -1,6 +1,28 @@
 const CONFIG_SERVICE_UUID = 0xF00D;
 const GLOBAL_CONFIG_CHR_UUID = 0xFF01;
 const KEYPROFILE_CONFIG_CHR_UUID = 0xFF02;
+const STATS_CHR_UUID = 0xFF03;
+
+// 計測値の種類(ble::ble_config::Statsの順)。1バイト書き込んで選び、[種類, JSON]を読み出す
+const STATS = {
+    SCHEDULER: 0,
+    GOVERNOR: 1,
+    LINK: 2,
+    CONN_PARAM: 3,
+    RECONNECT: 4,
+    LINK_QUALITY: 5,
+    SLEEP_POLICY: 6,
+    POWER: 7,
+    BATTERY: 8,
+    LATENCY: 9,
+    ENERGY: 10,
+    BOOT: 11,
+    CPU: 12,
+};
+const STATS_RESET_FLAG = 0x80;
+
+// 入力からレポートまでの遅延の経路(utils::latency_monitor::Pathの順)
+const LATENCY_PATHS = ['同時押し(キー)', 'マウスボタン', 'カーソル移動', 'スクロール'];
 
 const Button = {
     B1: 0x0001,
@@ -60,6 +82,7 @@ class ChordiMouse extends EventTarget{
         this.service = null;
         this.globalChar = null;
         this.keyChar = null;
+        this.statsChar = null;
     }
 
     async connect() {
@@ -75,9 +98,28 @@ class ChordiMouse extends EventTarget{
         this.service = await this.server.getPrimaryService(CONFIG_SERVICE_UUID);
         this.globalChar = await this.service.getCharacteristic(GLOBAL_CONFIG_CHR_UUID);
         this.keyChar = await this.service.getCharacteristic(KEYPROFILE_CONFIG_CHR_UUID);
+        // 計測値は古いファームウェアにはないので、なくても設定の編集はできるようにする
+        this.statsChar = await this.getOptionalCharacteristic(STATS_CHR_UUID);
         this.dispatchEvent(new Event('connected'));
     }
 
+    /**
+     * Characteristicを取得する
+     * @returns 見つからなければnull
+     */
+    async getOptionalCharacteristic(uuid) {
+        try {
+            return await this.service.getCharacteristic(uuid);
+        } catch (e) {
+            console.warn(`characteristic ${uuid.toString(16)} not found`, e);
+            return null;
+        }
+    }
+
+    hasStats() {
+        return this.statsChar !== null;
+    }
+
     async disconnect() {
         await this.service.disconnect();
     }
@@ -106,6 +148,53 @@ class ChordiMouse extends EventTarget{
         return profiles;
     }
 
+    /**
+     * 計測値を読み出す
+     * @param kind STATSの値
+     * @returns JSONをパースしたもの
+     */
+    async loadStats(kind) {
+        await this.statsChar.writeValue(new Uint8Array([kind]));
+        // デバイスが選んだ種類の値に差し替えるまで(configタスクの周期20ms)読み直す
+        for (let retry = 0; retry < 50; retry++) {
+            const response = await this.statsChar.readValue();
+            if (response.byteLength > 1 && response.getUint8(0) === kind) {
+                return JSON.parse(new TextDecoder().decode(new Uint8Array(response.buffer, response.byteOffset + 1, response.byteLength - 1)));
+            }
+            await new Promise(resolve => setTimeout(resolve, 20));
+        }
+        throw new Error(`stats ${kind} timed out`);
+    }
+
+    /**
+     * 経路ごとの遅延(p50/p99は区間の上限で近似、maxは実測の最大)
+     * @returns [{ name, count, p50, p99, max }] (us。上限なしの区間に入ったらnull)
+     */
+    async loadLatencyStats() {
+        const stats = await this.loadStats(STATS.LATENCY);
+        const percentile = (hist, total, ratio) => {
+            let sum = 0;
+            for (let i = 0; i < hist.length; i++) {
+                sum += hist[i];
+                if (sum >= total * ratio) {
+                    return stats.u[i] || null;
+                }
+            }
+            return null;
+        };
+        return stats.p.map((path, i) => ({
+            name: LATENCY_PATHS[i] ?? `#${i}`,
+            count: path.n,
+            p50: path.n > 0 ? percentile(path.h, path.n, 0.5) : null,
+            p99: path.n > 0 ? percentile(path.h, path.n, 0.99) : null,
+            max: path.x,
+        }));
+    }
+
+    async resetLatencyStats() {
+        await this.statsChar.writeValue(new Uint8Array([STATS.LATENCY | STATS_RESET_FLAG]));
+    }
+
     async saveGlobalConfig(config) {
         const encoder = new TextEncoder();
         const data = encoder.encode(JSON.stringify(config));